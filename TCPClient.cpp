@@ -1,137 +1,677 @@
 #include <string>
+#include <string_view>
 #include <iostream>
 #include <memory>
 #include <functional>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <barrier>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <sys/epoll.h>
 #include <string.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include "base64.h"
+#include "WSBuffer.h"
+#include "WSProtocol.h"
+
+// 压测客户端: 每个线程一个 epoll, 开大量连接完成真实握手后按开环目标速率发消息,
+// 延迟从"应该发出"的时刻算起(修正协调遗漏), 服务器需回显(如 /ws 的 EchoHandler).
+//   TCPClient -a 127.0.0.1 -p 8500 -u /ws -t 线程数 -c 总连接数 -r 总消息速率/s -d 秒数
+//             -s 大小:权重,... -b 二进制消息比例 -f 分片大小(0不分片)
+
+#define CLIENT_MAXEVENTS 1024
+#define CLIENT_HANDSHAKE_TIMEOUT_US (10 * 1000000)
+#define CLIENT_DRAIN_US (1 * 1000000) // 停止发送后等回应的时间
+
+static uint64_t nowUs()
+{
+	using namespace std::chrono;
+	return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+struct ClientConfig
+{
+	std::string host = "127.0.0.1";
+	unsigned short port = 8500;
+	std::string path = "/ws";
+	int threads = 1;
+	int conns = 100;
+	double rate = 1000;	// 所有连接合计每秒消息数
+	double seconds = 10;
+	std::vector<std::pair<size_t, uint32_t>> sizes = {{64, 1}}; // 大小, 累计权重
+	double binary = 0;
+	size_t fragment = 0;
+};
+
+// 对数分桶的延迟直方图(us), 每个2的幂区间16格, 相对误差约6%
+struct LatencyHistogram
+{
+	static constexpr size_t BUCKETS = 32 + 59 * 16;
+
+	uint64_t counts[BUCKETS] = {};
+	uint64_t total = 0;
+	uint64_t max = 0;
+
+	static size_t index(uint64_t v)
+	{
+		if(v < 32)
+			return v;
+		int m = 63 - __builtin_clzll(v);
+		return 32 + (m - 5) * 16 + ((v >> (m - 4)) - 16);
+	}
+
+	// 桶的上界
+	static uint64_t value(size_t i)
+	{
+		if(i < 32)
+			return i;
+		int m = (i - 32) / 16 + 5;
+		uint64_t sub = (i - 32) % 16 + 16;
+		return ((sub + 1) << (m - 4)) - 1;
+	}
+
+	void record(uint64_t v)
+	{
+		++counts[index(v)];
+		++total;
+		max = std::max(max, v);
+	}
+
+	void merge(const LatencyHistogram& other)
+	{
+		for(size_t i = 0; i < BUCKETS; ++i)
+			counts[i] += other.counts[i];
+		total += other.total;
+		max = std::max(max, other.max);
+	}
+
+	uint64_t percentile(double q) const
+	{
+		uint64_t rank = static_cast<uint64_t>(q * total);
+		uint64_t seen = 0;
+		for(size_t i = 0; i < BUCKETS; ++i)
+		{
+			seen += counts[i];
+			if(seen > rank)
+				return std::min(value(i), max);
+		}
+		return max;
+	}
+};
+
+struct ClientStats
+{
+	uint64_t connected = 0;
+	uint64_t handshakes = 0;
+	uint64_t failed = 0;
+	uint64_t sentMsgs = 0;
+	uint64_t sentBytes = 0;
+	uint64_t recvMsgs = 0;
+	uint64_t recvBytes = 0;
+	uint64_t missed = 0;	// 结束时仍没收到回应的消息, 按已等待时间计入直方图
+	uint64_t unsent = 0;	// 到点时没有已升级的连接, 没发出去的消息
+	uint64_t sendUs = 0;	// 本线程的发送窗口, 不含最后等回应的时间
+	LatencyHistogram latency;
+};
+
+struct ClientConn
+{
+	int fd = -1;
+	bool connected = false;
+	bool upgraded = false;
+	char accept[WS_ACCEPT_LEN];	// 期望的 Sec-WebSocket-Accept
+	std::string in;		// 握手回应和未收完的帧头
+	std::string out;
+	size_t outOffset = 0;
+	uint64_t skip = 0;	// 当前帧还没收到的负载
+	bool countFrame = false; // 当前帧收完算一条回应
+	std::deque<uint64_t> intended; // 等回应的消息的计划发送时间
+};
 
 class TCPClient
 {
 	public:
-		
-		TCPClient(const std::string& name) : clientName(name)
-		{
-			epfd_1 = epoll_create(1);
-			epfd_2 = epoll_create(1);
-		}
-		bool connect(const std::string& ip, const unsigned short port)
-		{
-			sockfd = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-			if(-1 == sockfd)
-				return false;
-			socklen_t size = 64 * 1024;
-			::setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
-			::setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
-			struct sockaddr_in addr;
-			bzero(&addr, sizeof(addr));
-			addr.sin_family = AF_INET;
-			addr.sin_addr.s_addr = inet_addr(ip.c_str());
-			addr.sin_port = htons(port);
-
-			int ret = ::connect(sockfd, (struct sockaddr *)&addr, sizeof(addr));
-			if(ret == -1)
+		TCPClient(const ClientConfig& _config, int _index) : config(_config), index(_index)
+		{
+			epfd = epoll_create1(EPOLL_CLOEXEC);
+			seed = 0x9E3779B97F4A7C15ull * (index + 1) ^ nowUs();
+		}
+		~TCPClient() { shutdown(); }
+		TCPClient(const TCPClient&) = delete;
+		TCPClient& operator = (const TCPClient&) = delete;
+
+		// 建立本线程的连接并等握手完成
+		void connect(int count);
+		// 按开环速率发送 seconds 秒, 再等一会儿回应
+		void run(double rate, double seconds);
+		void shutdown();
+
+		const ClientStats& getStats() const { return stats; }
+
+	private:
+		uint64_t random()
+		{
+			seed ^= seed << 13;
+			seed ^= seed >> 7;
+			seed ^= seed << 17;
+			return seed;
+		}
+
+		void poll(uint64_t timeoutUs);
+		void handleConnected(ClientConn& conn);
+		void handleRead(ClientConn& conn);
+		void handleWrite(ClientConn& conn);
+		bool parseHandshake(ClientConn& conn);
+		void parseFrames(ClientConn& conn, const char* p, size_t n);
+		void sendMsg(ClientConn& conn, uint64_t intended);
+		void closeConn(ClientConn& conn);
+
+		const ClientConfig& config;
+		int index;
+		int epfd = -1;
+		uint64_t seed;
+		std::vector<ClientConn> conns;
+		size_t pendingHandshakes = 0;
+		std::vector<epoll_event> events = std::vector<epoll_event>(CLIENT_MAXEVENTS);
+		std::string payload;	// 预先生成的负载, 发送时拷贝再加掩码
+		ClientStats stats;
+};
+
+void TCPClient::connect(int count)
+{
+	struct sockaddr_in addr;
+	bzero(&addr, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(config.host.c_str());
+	addr.sin_port = htons(config.port);
+
+	size_t maxSize = 0;
+	for(auto& [size, weight] : config.sizes)
+		maxSize = std::max(maxSize, size);
+	payload.resize(maxSize);
+	for(char& c : payload)
+		c = 'a' + random() % 26; // TEXT消息也是合法UTF-8
+
+	conns.resize(count);
+	for(auto& conn : conns)
+	{
+		conn.fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+		if(conn.fd < 0)
+		{
+			std::cerr << "SOCKET FAIL, " << strerror(errno) << std::endl;
+			++stats.failed;
+			continue;
+		}
+		int nodelay = 1;
+		::setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+		if(::connect(conn.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)
+		{
+			std::cerr << "CONNECT FAIL, " << strerror(errno) << std::endl;
+			closeConn(conn);
+			++stats.failed;
+			continue;
+		}
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		ev.data.ptr = &conn;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, conn.fd, &ev);
+		++pendingHandshakes;
+	}
+
+	uint64_t deadline = nowUs() + CLIENT_HANDSHAKE_TIMEOUT_US;
+	while(pendingHandshakes)
+	{
+		uint64_t now = nowUs();
+		if(now >= deadline)
+		{
+			std::cerr << "HANDSHAKE TIMEOUT, PENDING:" << pendingHandshakes << std::endl;
+			break;
+		}
+		poll(deadline - now);
+	}
+}
+
+void TCPClient::run(double rate, double seconds)
+{
+	// 本线程的消息轮流分给各连接, 第 i 条的计划时间是 start + i * interval
+	double interval = 1e6 / rate;
+	uint64_t start = nowUs();
+	uint64_t end = start + static_cast<uint64_t>(seconds * 1e6);
+	uint64_t next = 0;
+	size_t turn = 0;
+	while(true)
+	{
+		uint64_t now = nowUs();
+		if(now >= end)
+			break;
+		// 落后时一次补发所有到期的消息, 不跳过, 延迟照计划时间算
+		uint64_t intended = start + static_cast<uint64_t>(next * interval);
+		while(intended <= now && intended < end)
+		{
+			bool sent = false;
+			for(size_t tries = 0; tries < conns.size() && !sent; ++tries)
 			{
-				std::cout << "CONNECT FAIL" << std::endl;
-				shutdown();
-				return false;
+				ClientConn& conn = conns[turn++ % conns.size()];
+				if(conn.upgraded)
+				{
+					sendMsg(conn, intended);
+					sent = true;
+				}
 			}
-			
-			::fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK);
-			struct epoll_event ev;
-			ev.events = EPOLLIN;
-			ev.data.fd = STDIN_FILENO;
-			epoll_ctl(epfd_1, EPOLL_CTL_ADD, STDIN_FILENO, &ev);
+			if(!sent)
+				++stats.unsent;
+			++next;
+			intended = start + static_cast<uint64_t>(next * interval);
+		}
+		poll(std::min(intended, end) - now);
+	}
+	stats.sendUs = nowUs() - start;
 
-			struct epoll_event ev2;
-			ev2.events = EPOLLIN;
-			ev2.data.ptr = nullptr;
-			epoll_ctl(epfd_2, EPOLL_CTL_ADD, sockfd, &ev2);
+	uint64_t drainEnd = nowUs() + CLIENT_DRAIN_US;
+	while(true)
+	{
+		bool waiting = false;
+		for(auto& conn : conns)
+			waiting = waiting || !conn.intended.empty();
+		uint64_t now = nowUs();
+		if(!waiting || now >= drainEnd)
+			break;
+		poll(drainEnd - now);
+	}
 
-			std::cout << "CONNECT SUCCESS" << std::endl;
-			return true;
+	// 没等到的回应至少延迟了这么久, 不计入会让尾延迟偏低
+	uint64_t now = nowUs();
+	for(auto& conn : conns)
+	{
+		for(uint64_t intended : conn.intended)
+		{
+			stats.latency.record(now - intended);
+			++stats.missed;
 		}
-		void run()
+		conn.intended.clear();
+	}
+}
+
+void TCPClient::poll(uint64_t timeoutUs)
+{
+	struct timespec timeout;
+	timeout.tv_sec = timeoutUs / 1000000;
+	timeout.tv_nsec = timeoutUs % 1000000 * 1000;
+	int num = epoll_pwait2(epfd, events.data(), events.size(), &timeout, nullptr);
+	if(num < 0 && errno == ENOSYS)
+		num = epoll_wait(epfd, events.data(), events.size(), (timeoutUs + 999) / 1000);
+	for(int i = 0; i < num; ++i)
+	{
+		ClientConn& conn = *static_cast<ClientConn*>(events[i].data.ptr);
+		if(conn.fd < 0)
+			continue;
+		if(!conn.connected && (events[i].events & (EPOLLOUT | EPOLLERR)))
+			handleConnected(conn);
+		if(conn.fd >= 0 && (events[i].events & EPOLLIN))
+			handleRead(conn);
+		if(conn.fd >= 0 && (events[i].events & EPOLLOUT))
+			handleWrite(conn);
+		if(conn.fd >= 0 && (events[i].events & (EPOLLERR | EPOLLHUP)))
+			closeConn(conn);
+	}
+}
+
+void TCPClient::handleConnected(ClientConn& conn)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+	::getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+	if(err)
+	{
+		std::cerr << "CONNECT FAIL, " << strerror(err) << std::endl;
+		++stats.failed;
+		closeConn(conn);
+		return;
+	}
+	conn.connected = true;
+	++stats.connected;
+
+	// 每个连接随机key, 回应里的accept要对得上
+	unsigned char nonce[16];
+	for(size_t i = 0; i < sizeof(nonce); i += 8)
+	{
+		uint64_t r = random();
+		std::memcpy(nonce + i, &r, 8);
+	}
+	char key[base64_encoded_size(16) + 1] = {0};
+	base64_encode(nonce, sizeof(nonce), key);
+
+	wsAcceptKey(key, conn.accept);
+
+	conn.out = "GET " + config.path + " HTTP/1.1\r\nHost: " + config.host + "\r\nConnection: Upgrade\r\nUpgrade: websocket\r\n"
+		"Sec-WebSocket-Version: 13\r\nSec-WebSocket-Key: " + key + "\r\n\r\n";
+	handleWrite(conn);
+}
+
+void TCPClient::handleWrite(ClientConn& conn)
+{
+	if(!conn.connected)
+		return;
+	while(conn.outOffset < conn.out.size())
+	{
+		ssize_t ret = ::send(conn.fd, conn.out.data() + conn.outOffset, conn.out.size() - conn.outOffset, MSG_NOSIGNAL);
+		if(ret < 0)
 		{
-			struct epoll_event ev;
-			struct epoll_event ev2;
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN)
+				closeConn(conn);
+			return;
+		}
+		conn.outOffset += ret;
+	}
+	conn.out.clear();
+	conn.outOffset = 0;
+}
 
-			std::string request = "GET /ws HTTP/1.1\r\nConnection: Upgrade\r\nUpgrade: websocket\r\nSec-WebSocket-Version: 13\r\nSec-WebSocket-Key: QWz1vB/77j8J8JcT/qtiLQ==\r\n\r\n";
+void TCPClient::handleRead(ClientConn& conn)
+{
+	char buff[64 * 1024];
+	while(conn.fd >= 0)
+	{
+		ssize_t ret = ::recv(conn.fd, buff, sizeof(buff), 0);
+		if(ret < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN)
+				closeConn(conn);
+			return;
+		}
+		if(ret == 0)
+		{
+			std::cerr << "server close me" << std::endl;
+			closeConn(conn);
+			return;
+		}
+		stats.recvBytes += ret;
+		if(conn.upgraded)
+		{
+			parseFrames(conn, buff, ret);
+			continue;
+		}
+		conn.in.append(buff, ret);
+		if(!parseHandshake(conn))
+			return;
+	}
+}
 
-			::write(sockfd, request.data(), request.size());
+bool TCPClient::parseHandshake(ClientConn& conn)
+{
+	size_t end = conn.in.find("\r\n\r\n");
+	if(end == std::string::npos)
+		return true;
+	std::string_view response(conn.in.data(), end);
+	bool ok = response.starts_with("HTTP/1.1 101") && wsFindHeader(response, "sec-websocket-accept") == std::string_view(conn.accept, sizeof(conn.accept));
+	if(!ok)
+	{
+		std::cerr << "HANDSHAKE FAIL: " << response.substr(0, response.find('\r')) << std::endl;
+		++stats.failed;
+		closeConn(conn);
+		return false;
+	}
+	conn.upgraded = true;
+	++stats.handshakes;
+	--pendingHandshakes;
+	std::string rest = conn.in.substr(end + 4);
+	conn.in.clear();
+	parseFrames(conn, rest.data(), rest.size());
+	return true;
+}
 
-			while(true)
+// 服务器发来的帧不带掩码, 负载只数不存; 帧头可能跨两次recv
+void TCPClient::parseFrames(ClientConn& conn, const char* p, size_t n)
+{
+	while(n)
+	{
+		if(conn.skip)
+		{
+			size_t len = std::min<uint64_t>(conn.skip, n);
+			p += len;
+			n -= len;
+			conn.skip -= len;
+		}
+		else
+		{
+			size_t take = std::min<size_t>(n, WS_HEADROOM - conn.in.size());
+			conn.in.append(p, take);
+			const uint8_t* header = reinterpret_cast<const uint8_t*>(conn.in.data());
+			size_t headerLen = 2;
+			if(conn.in.size() >= 2)
+				headerLen += ((header[1] & 0x7F) == 126 ? 2 : (header[1] & 0x7F) == 127 ? 8 : 0) + ((header[1] & 0x80) ? 4 : 0);
+			if(conn.in.size() < headerLen)
 			{
-				/*
-				if(::epoll_wait(epfd_1, &ev, 1, 0) > 0)
-				{
-					if(ev.events & EPOLLIN)
-					{
-						char buf[100];
-						bzero(buf, sizeof(buf));
-						::read(STDIN_FILENO, buf, sizeof(buf) - 1);
-						::write(sockfd, buf, strlen(buf));
-					}
-				}
-				*/
-				if(::epoll_wait(epfd_2, &ev2, 1, 0) > 0)
-				{
-					if(ev2.events & EPOLLIN)
-					{
-						char buf[200];
-						bzero(buf, sizeof(buf));
-						int ret = ::recv(sockfd, buf, sizeof(buf), MSG_NOSIGNAL);
-						if(ret == 0)
-						{
-							std::cout << "server close me" << std::endl;
-							::shutdown(sockfd, SHUT_RDWR);
-							close(sockfd);
-							exit(1);
-						}
-						else if(ret > 0)
-							std::cout << "recv msg:" << buf <<std::endl;
-					}
-				}
+				p += take;
+				n -= take;
+				continue;
+			}
+			// 多拷进来的字节退回去
+			size_t used = take - (conn.in.size() - headerLen);
+			p += used;
+			n -= used;
+			uint64_t len = header[1] & 0x7F;
+			if(len == 126)
+				len = (uint64_t(header[2]) << 8) | header[3];
+			else if(len == 127)
+			{
+				len = 0;
+				for(int i = 0; i < 8; ++i)
+					len = (len << 8) | header[2 + i];
+			}
+			uint8_t opcode = header[0] & 0x0F;
+			conn.countFrame = (header[0] & 0x80) && opcode < WSOpcode::CLOSE;
+			conn.skip = len;
+			conn.in.clear();
+			if(opcode == WSOpcode::CLOSE)
+			{
+				std::cerr << "server close frame" << std::endl;
+				closeConn(conn);
+				return;
 			}
 		}
-		void shutdown()
+		if(!conn.skip && conn.countFrame)
 		{
-			::close(epfd_1);
-			::close(epfd_2);
-			epfd_1 = -1;
-			epfd_2 = -1;
-			if(-1 != sockfd)
+			conn.countFrame = false;
+			++stats.recvMsgs;
+			if(!conn.intended.empty())
 			{
-				::shutdown(sockfd, SHUT_RDWR);
-				::close(sockfd);
-				sockfd = -1;
+				stats.latency.record(nowUs() - conn.intended.front());
+				conn.intended.pop_front();
 			}
 		}
-	private:
-		std::string clientName;
-		int sockfd = -1;
-		int epfd_1 = -1;
-		int epfd_2 = -1;
-};
+	}
+}
+
+void TCPClient::sendMsg(ClientConn& conn, uint64_t intended)
+{
+	uint32_t pick = random() % config.sizes.back().second;
+	size_t size = std::find_if(config.sizes.begin(), config.sizes.end(), [pick](auto& item) { return pick < item.second; })->first;
+	uint8_t opcode = (random() % 10000) < config.binary * 10000 ? WSOpcode::BINARY : WSOpcode::TEXT;
+	size_t fragment = config.fragment ? config.fragment : size;
+
+	// 客户端帧必须加掩码, 每帧随机掩码
+	size_t offset = 0;
+	do
+	{
+		size_t len = std::min(fragment, size - offset);
+		bool fin = offset + len == size;
+		uint8_t maskKey[4];
+		wsMaskKey(maskKey);
+		uint8_t header[WS_HEADROOM];
+		size_t headerLen = writeFrameHeader(header, offset ? static_cast<uint8_t>(WSOpcode::CONTINUE) : opcode, fin, len, maskKey);
+		conn.out.append(reinterpret_cast<const char*>(header), headerLen);
+		size_t begin = conn.out.size();
+		conn.out.resize(begin + len);
+		maskCopy(conn.out.data() + begin, payload.data() + offset, len, maskKey);
+		offset += len;
+		stats.sentBytes += headerLen + len;
+	} while(offset < size);
+
+	conn.intended.push_back(intended);
+	++stats.sentMsgs;
+	handleWrite(conn);
+}
+
+void TCPClient::closeConn(ClientConn& conn)
+{
+	if(conn.fd < 0)
+		return;
+	if(!conn.upgraded && pendingHandshakes)
+		--pendingHandshakes;
+	::close(conn.fd);
+	conn.fd = -1;
+	conn.connected = false;
+	conn.upgraded = false;
+}
+
+void TCPClient::shutdown()
+{
+	for(auto& conn : conns)
+		closeConn(conn);
+	if(epfd != -1)
+		::close(epfd);
+	epfd = -1;
+}
+
+// "64:70,1024:25,65536:5" -> 大小和累计权重
+static bool parseSizes(const char* arg, std::vector<std::pair<size_t, uint32_t>>& sizes)
+{
+	sizes.clear();
+	uint32_t total = 0;
+	std::string_view list(arg);
+	while(!list.empty())
+	{
+		std::string item(list.substr(0, list.find(',')));
+		size_t size = std::strtoull(item.c_str(), nullptr, 10);
+		auto colon = item.find(':');
+		uint32_t weight = colon == std::string::npos ? 1 : std::strtoul(item.c_str() + colon + 1, nullptr, 10);
+		if(!weight)
+			return false;
+		total += weight;
+		sizes.emplace_back(size, total);
+		if(list.find(',') == std::string_view::npos)
+			break;
+		list.remove_prefix(list.find(',') + 1);
+	}
+	return !sizes.empty();
+}
 
-int main(int agrc, char** argv)
+int main(int argc, char** argv)
 {
-	std::unique_ptr<TCPClient> client = std::make_unique<TCPClient>("BowClient");
-	if(!client)
-		return 0;
-	if(!client->connect("122.51.106.92", 8500))
+	ClientConfig config;
+	int opt;
+	while((opt = getopt(argc, argv, "a:p:u:t:c:r:d:s:b:f:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'a': config.host = optarg; break;
+			case 'p': config.port = std::atoi(optarg); break;
+			case 'u': config.path = optarg; break;
+			case 't': config.threads = std::max(1, std::atoi(optarg)); break;
+			case 'c': config.conns = std::max(1, std::atoi(optarg)); break;
+			case 'r': config.rate = std::atof(optarg); break;
+			case 'd': config.seconds = std::atof(optarg); break;
+			case 'b': config.binary = std::atof(optarg); break;
+			case 'f': config.fragment = std::strtoull(optarg, nullptr, 10); break;
+			case 's':
+				if(!parseSizes(optarg, config.sizes))
+				{
+					std::cerr << "bad size mix: " << optarg << std::endl;
+					return 1;
+				}
+				break;
+			default:
+				std::cerr << "usage: " << argv[0] << " [-a host] [-p port] [-u path] [-t threads] [-c conns] [-r msgs/s] [-d seconds]"
+					" [-s size:weight,...] [-b binary ratio] [-f fragment size]" << std::endl;
+				return 1;
+		}
+	}
+	if(config.rate <= 0)
+	{
+		std::cerr << "rate must be positive" << std::endl;
+		return 1;
+	}
+
+	struct rlimit limit;
+	if(::getrlimit(RLIMIT_NOFILE, &limit) == 0)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		::setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	// 连接全部建好后各线程同时开始计时
+	std::vector<std::unique_ptr<TCPClient>> clients;
+	std::vector<std::thread> threads;
+	std::barrier ready(config.threads + 1);
+	std::barrier done(config.threads + 1);
+	for(int i = 0; i < config.threads; ++i)
 	{
-		std::cout << strerror(errno) << std::endl;
-		return 0;
+		clients.push_back(std::make_unique<TCPClient>(config, i));
+		int count = config.conns / config.threads + (i < config.conns % config.threads ? 1 : 0);
+		threads.emplace_back([&, client = clients.back().get(), count]()
+		{
+			client->connect(count);
+			ready.arrive_and_wait();
+			client->run(config.rate / config.threads, config.seconds);
+			done.arrive_and_wait();
+			client->shutdown();
+		});
 	}
-	client->run();
-	client->shutdown();
-	
+	ready.arrive_and_wait();
+	done.arrive_and_wait();
+	for(auto& thread : threads)
+		thread.join();
+
+	// 速率按各线程自己的发送窗口算再相加, 不算最后等回应的时间
+	ClientStats total;
+	double sentMsgsRate = 0, sentBytesRate = 0, recvMsgsRate = 0, recvBytesRate = 0;
+	for(auto& client : clients)
+	{
+		const ClientStats& stats = client->getStats();
+		double seconds = std::max<uint64_t>(stats.sendUs, 1) / 1e6;
+		sentMsgsRate += stats.sentMsgs / seconds;
+		sentBytesRate += stats.sentBytes / seconds;
+		recvMsgsRate += stats.recvMsgs / seconds;
+		recvBytesRate += stats.recvBytes / seconds;
+		total.connected += stats.connected;
+		total.handshakes += stats.handshakes;
+		total.failed += stats.failed;
+		total.sentMsgs += stats.sentMsgs;
+		total.sentBytes += stats.sentBytes;
+		total.recvMsgs += stats.recvMsgs;
+		total.recvBytes += stats.recvBytes;
+		total.missed += stats.missed;
+		total.unsent += stats.unsent;
+		total.latency.merge(stats.latency);
+	}
+
+	std::cout << "CONNS connected:" << total.connected << " handshakes:" << total.handshakes << " failed:" << total.failed << std::endl;
+	std::cout << "SENT msgs:" << total.sentMsgs << " bytes:" << total.sentBytes
+		<< " msgs/s:" << sentMsgsRate << " bytes/s:" << sentBytesRate << " unsent:" << total.unsent << std::endl;
+	std::cout << "RECV msgs:" << total.recvMsgs << " bytes:" << total.recvBytes
+		<< " msgs/s:" << recvMsgsRate << " bytes/s:" << recvBytesRate << " missed:" << total.missed << std::endl;
+	std::cout << "LATENCY us p50:" << total.latency.percentile(0.5) << " p90:" << total.latency.percentile(0.9)
+		<< " p99:" << total.latency.percentile(0.99) << " p99.9:" << total.latency.percentile(0.999)
+		<< " p99.99:" << total.latency.percentile(0.9999) << " max:" << total.latency.max << std::endl;
 	return 0;
 }
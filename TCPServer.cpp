@@ -1,6 +1,7 @@
 #include <string>
 #include <iostream>
 #include <memory>
+#include <cstdlib>
 #include <csignal>
 #include <functional>
 #include <sys/types.h>
@@ -14,33 +15,27 @@
 #include <netinet/tcp.h>
 #include <map>
 #include "WSRequest.h"
-
-static int setNonBlocking(int fd)
-{
-	int flags;
-	int nodelay = 1;
-	if(::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void*)&nodelay, sizeof(nodelay)))
-		return -1;
-	flags = ::fcntl(fd, F_GETFL, 0);
-	if (-1 == flags) 
-		return -1;
-	flags |= O_NONBLOCK;
-	if(-1 == ::fcntl(fd, F_SETFL, flags))
-		return -1;
-	return 0;
-}
+#include "WSCapture.h"
+#include "WSListen.h"
 
 struct ConnData
 {
-	ConnData(int _fd) : fd(_fd){};
+	ConnData(int _fd) : fd(_fd)
+	{
+		ws.fd = fd;
+		ws.output = &outBuffer;
+	};
 
 	int fd = -1;
 	__uint32_t events;
 	
 	bool close = false;
+	bool dirty = false;	// 本轮有新输出, 轮末统一写出
+	uint64_t corkStart = 0;	// 变脏的时间(us)
+	uint32_t captureId = 0;
 
-	std::string inBuffer;
-	std::string outBuffer;
+	WSInBuffer inBuffer;
+	WSOutQueue outBuffer;
 
 	WSSocket ws;
 
@@ -57,6 +52,8 @@ void ConnData::parseBuffer()
 }
 
 #define MAXEVENTS 100
+#define ACCEPT_BATCH 64 // 每次唤醒最多接受的连接数, 连接风暴时不饿死已有连接
+#define WS_CORK_BYTES (16 * 1024) // 攒够这么多立即写出, 不等延迟上限
 
 class TCPServer
 {
@@ -65,9 +62,29 @@ class TCPServer
 		{
 			epfd = epoll_create(MAXEVENTS);
 			events = std::vector<epoll_event>(MAXEVENTS);
+			wsReactor = &reactor;
+			wsBatch = &batch;
+
+			// 其他线程的投递由 eventfd 唤醒
+			struct epoll_event ev;
+			ev.events = EPOLLIN;
+			ev.data.fd = posts.fd();
+			epoll_ctl(epfd, EPOLL_CTL_ADD, posts.fd(), &ev);
+			wsPostQueues[reactorId].store(&posts, std::memory_order_release);
+
+			// 节点间转发的链路在 relay 自己的 epoll 里, 这里只挂它的fd
+			ev.data.fd = relay.fd();
+			epoll_ctl(epfd, EPOLL_CTL_ADD, relay.fd(), &ev);
+			relay.setDeliver([this](WSConnHandle handle, uint8_t opcode, std::string_view msg) { deliverRelay(handle, opcode, msg); });
+			wsRelay = &relay;
 		}
 		~TCPServer()
 		{
+			wsPostQueues[reactorId].store(nullptr, std::memory_order_release);
+			wsRelay = nullptr;
+			dataMap.clear(); // 协程帧先还给帧池
+			wsReactor = nullptr;
+			wsBatch = nullptr;
 			TEMP_FAILURE_RETRY(::close(epfd));
 			if(listenfd != -1)
 			{
@@ -86,49 +103,73 @@ class TCPServer
 		int handleRead(int fd);
 		int handleWrite(int fd);
 		void handleConn(int fd);
+		void handleAccept();
 		void handleEvents(int num);
+		void handleTimers();
+		void handleBatch();
+		void handlePosts();
+		void deliverRelay(WSConnHandle handle, uint8_t opcode, std::string_view msg);
+		void markDirty(ConnData& conn);
+		void flushOutput();
+		void updateEvents(ConnData& conn, bool wantWrite);
+		bool checkLag(ConnData& conn);
+		void printStats();
 		void shutdown();
 
+		// 输出合并: 小输出最多攒 usec 微秒再写, 0 表示每轮末写出
+		void setCork(uint32_t usec) { corkUsec = usec; }
+
+		// 监听socket的调优选项, 在 bind 之前设置
+		void setListenConfig(const WSListenConfig& config) { listenConfig = config; }
+
+		// 把收到的原始字节记到文件, 用 WSReplay 重放
+		bool setCapture(const char* path) { return capture.open(path); }
+
+		// 节点间转发: relayPort 为0时不监听, peers 为 "ip:port"; 默认只监听回环地址
+		bool startRelay(unsigned short relayPort, const std::vector<std::string>& peers, const std::string& bindAddress, std::string_view secret)
+		{
+			return relay.start(relayPort, peers, bindAddress, secret);
+		}
+
+		// 连接槽位, 句柄里的代数对不上说明连接已关闭
+		WSConnHandle allocHandle(int fd);
+		void releaseHandle(WSConnHandle handle);
+		ConnData* findConn(WSConnHandle handle);
+
 	private:
 		std::string serverName;
 		int listenfd = -1;
 		int epfd = -1;
 		std::vector<epoll_event> events;
-		std::map<int, std::shared_ptr<ConnData>> dataMap;
+		WSReactorContext reactor;
+		WSBatchQueue batch;
+		std::map<int, std::unique_ptr<ConnData>> dataMap;
+		std::vector<WSInBuffer> inPool; // 空闲连接的 inBuffer 还到这里, 不持有堆内存
+		std::vector<int> dirtyConns;
+		uint32_t corkUsec = 0;
+		uint64_t corkDeadline = 0; // 被攒住的输出中最早的写出时间(us), 0表示没有
+		WSCapture capture;
+		WSListenConfig listenConfig;
+
+		struct ConnSlot
+		{
+			int fd = -1;
+			uint32_t generation = 1; // 从1开始, 句柄0永远无效
+		};
+		uint32_t reactorId = 0;
+		WSPostQueue posts;
+		std::vector<ConnSlot> slots;
+		std::vector<uint32_t> freeSlots;
+		uint64_t postsDelivered = 0;
+		uint64_t postsDropped = 0;
+		WSRelay relay;
 };
 
 bool TCPServer::bind(const unsigned short port)
 {
-	listenfd = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	listenfd = wsListen(port, listenConfig);
 	if(-1 == listenfd)
-	{
-		std::cerr << "SOCKET FAIL" << std::endl;
-		return false;	
-	}
-	socklen_t size = 64 * 1024;
-	::setsockopt(listenfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
-	::setsockopt(listenfd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
-	int reuse = 1;
-	::setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-
-	struct sockaddr_in addr;
-	bzero(&addr, sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_addr.s_addr = htonl(INADDR_ANY);
-	addr.sin_port = htons(port);
-
-	if(-1 == ::bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)))
-	{
-		std::cerr << "BIND FAIL" << std::endl;
-		shutdown();
 		return false;
-	}
-
-	if(-1 == ::listen(listenfd, MAXEVENTS))
-	{
-		std::cerr << "LISTEN FAIL" << std::endl;
-		return false;
-	}
 
 	serverEpollAdd(listenfd, EPOLLIN);
 
@@ -143,9 +184,9 @@ void TCPServer::serverEpollAdd(int fd, __uint32_t events)
 	ev.data.fd = fd;
 	epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev); // not resolve error
 
-	auto dataPtr = std::make_shared<ConnData>(fd);
+	auto dataPtr = std::make_unique<ConnData>(fd);
 	dataPtr->events = events;
-	dataMap[fd] = dataPtr;
+	dataMap[fd] = std::move(dataPtr);
 }
 
 void TCPServer::serverEpollClose(int fd)
@@ -155,13 +196,28 @@ void TCPServer::serverEpollClose(int fd)
 
 int TCPServer::serverEpollWait()
 {
-	int rc = epoll_wait(epfd, &*events.begin(), events.size(), 2000);
+	// 定时器按毫秒, 输出合并的延迟上限按微秒
+	int64_t timeoutUs = relay.nextTimeout(reactor.nextTimeout(2000)) * 1000LL;
+	if(corkDeadline)
+	{
+		uint64_t now = wsNowUs();
+		timeoutUs = std::min<int64_t>(timeoutUs, corkDeadline > now ? corkDeadline - now : 0);
+	}
+	struct timespec timeout;
+	timeout.tv_sec = timeoutUs / 1000000;
+	timeout.tv_nsec = timeoutUs % 1000000 * 1000;
+	int rc = epoll_pwait2(epfd, &*events.begin(), events.size(), &timeout, nullptr);
+	if(rc < 0 && errno == ENOSYS)
+		rc = epoll_wait(epfd, &*events.begin(), events.size(), (timeoutUs + 999) / 1000);
 	if(rc < 0)
 	{
 		std::cerr << "EPOLL_WAIT ERROR, " << errno << std::endl; 
 	}
-	else if(rc == 0)
+	else if(rc == 0 && reactor.timers.empty() && !corkDeadline)
+	{
 		std::cout << "EPOLL TIMEOUT" << std::endl;
+		printStats();
+	}
 	return rc;
 }
 
@@ -183,8 +239,24 @@ int TCPServer::handleRead(int fd)
 	if(ret > 0)
 	{
 		// std::cout << "HANDLE READ, FD:" << fd << " RECV:\n" << buff << "SIZE:" << ret << std::endl;
-		iter->second->inBuffer += std::string(buff, buff + ret);
+		WSInBuffer& inBuffer = iter->second->inBuffer;
+		if(inBuffer.empty() && !inPool.empty())
+		{
+			inBuffer.swap(inPool.back());
+			inPool.pop_back();
+		}
+		inBuffer.append(buff, ret);
+		if(capture.active())
+			capture.record(CAPTURE_DATA, iter->second->captureId, buff, ret);
 		iter->second->parseBuffer();
+		markDirty(*iter->second);
+		// 读空了就把缓冲还回池里, 大缓冲直接释放
+		if(inBuffer.empty())
+		{
+			if(inBuffer.capacity() > WSInBuffer().capacity() && inBuffer.capacity() <= WS_FRAGMENT_SIZE && inPool.size() < WS_POOL_MAX)
+				inPool.push_back(std::move(inBuffer));
+			WSInBuffer().swap(inBuffer);
+		}
 	}
 	return ret;
 }
@@ -198,17 +270,125 @@ int TCPServer::handleWrite(int fd)
 		abort();
 		return 0;
 	}
-	if(iter->second->outBuffer.empty())
-		return 0;
-	std::string& buffer = iter->second->outBuffer;
-	int ret = ::send(fd, buffer.data(), buffer.size(), MSG_NOSIGNAL); // -1 close
-	if(ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	WSOutQueue& buffer = iter->second->outBuffer;
+	WSSocket& ws = iter->second->ws;
+	int ret = 0;
+	// 写到发完或内核缓冲满, 后面还有要发的就带 MSG_MORE
+	while(true)
+	{
+		if(buffer.size() < ws.fragmentSize)
+			ws.pumpOutput(buffer);
+		if(buffer.empty())
+			break;
+		ret = buffer.writeTo(fd, ws.hasPendingOutput() ? MSG_MORE : 0); // -1 close
+		if(ret == -1)
+		{
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+			ret = 0;
+			break;
+		}
+	}
+	updateEvents(*iter->second, !buffer.empty() || ws.hasPendingOutput());
+	if(checkLag(*iter->second))
 		return 0;
-	if(ret > 0)
-		buffer = buffer.substr(ret);
+	// 积压降到低水位, 唤醒等待 send 的协程
+	if(ws.waitKind == WAIT_SEND && ws.sendReady())
+	{
+		ws.resumeTask();
+		iter->second->parseBuffer();
+		markDirty(*iter->second);
+	}
 	return ret;
 }
 
+// 只在内核发送缓冲满时关注 EPOLLOUT, 否则水平触发会让循环空转
+void TCPServer::updateEvents(ConnData& conn, bool wantWrite)
+{
+	__uint32_t events = wantWrite ? (conn.events | EPOLLOUT) : (conn.events & ~EPOLLOUT);
+	if(events == conn.events)
+		return;
+	conn.events = events;
+	struct epoll_event ev;
+	ev.events = events;
+	ev.data.fd = conn.fd;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, conn.fd, &ev);
+}
+
+// 积压持续超过阈值的慢消费者直接断开, 不让发送队列无限增长
+bool TCPServer::checkLag(ConnData& conn)
+{
+	if(conn.close || !conn.ws.lagging(conn.outBuffer.size(), wsNowMs()))
+		return false;
+	std::cout << "SLOW CONSUMER, CLOSE CONN, FD:" << conn.fd << " PENDING:" << conn.outBuffer.size() + conn.ws.queuedBytes << std::endl;
+	++wsIoStats.slowClosed;
+	conn.close = true;
+	return true;
+}
+
+void TCPServer::markDirty(ConnData& conn)
+{
+	if(conn.dirty)
+		return;
+	conn.dirty = true;
+	conn.corkStart = wsNowUs();
+	dirtyConns.push_back(conn.fd);
+}
+
+// 轮末写出本轮产生的输出, 每个连接一次 sendmsg;
+// 开启合并时, 不足 WS_CORK_BYTES 的输出留到下一轮, 但不超过 corkUsec
+void TCPServer::flushOutput()
+{
+	relay.flush();
+	uint64_t now = wsNowUs();
+	size_t keep = 0;
+	corkDeadline = 0;
+	// 写出时可能唤醒协程产生新的脏连接, 按下标遍历
+	for(size_t i = 0; i < dirtyConns.size(); ++i)
+	{
+		int fd = dirtyConns[i];
+		auto iter = dataMap.find(fd);
+		if(iter == dataMap.end() || !iter->second->dirty)
+			continue;
+		ConnData& conn = *iter->second;
+		if(corkUsec && !conn.close && conn.outBuffer.size() < WS_CORK_BYTES && !conn.ws.hasPendingOutput()
+				&& now < conn.corkStart + corkUsec)
+		{
+			uint64_t deadline = conn.corkStart + corkUsec;
+			if(!corkDeadline || deadline < corkDeadline)
+				corkDeadline = deadline;
+			dirtyConns[keep++] = fd;
+			continue;
+		}
+		conn.dirty = false;
+		if(checkLag(conn))
+		{
+			handleConn(fd);
+			continue;
+		}
+		if(!conn.close && (conn.events & EPOLLOUT) == 0 && handleWrite(fd) == -1)
+		{
+			std::cout << "WRITE ERR, CLOSE CONN, FD:" << fd << std::endl;
+			serverEpollClose(fd);
+		}
+		handleConn(fd);
+	}
+	dirtyConns.resize(keep);
+}
+
+void TCPServer::printStats()
+{
+	if(!wsIoStats.msgs)
+		return;
+	std::cout << "IO STATS msgs:" << wsIoStats.msgs << " sendCalls:" << wsIoStats.sendCalls << " bytes:" << wsIoStats.bytes
+		<< " sendCalls/msg:" << static_cast<double>(wsIoStats.sendCalls) / wsIoStats.msgs
+		<< " conflated:" << wsIoStats.conflated << " slowClosed:" << wsIoStats.slowClosed << std::endl;
+	if(postsDelivered || postsDropped)
+		std::cout << "POST STATS delivered:" << postsDelivered << " dropped:" << postsDropped << std::endl;
+	relay.printStats();
+	wsSlabPrintStats();
+}
+
 void TCPServer::handleConn(int fd)
 {
 	if(dataMap[fd]->close)
@@ -218,6 +398,18 @@ void TCPServer::handleConn(int fd)
 		ev.data.fd = fd;
 		epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &ev);
 
+		if(dataMap[fd]->ws.batched)
+			batch.drop(&dataMap[fd]->ws);
+		dataMap[fd]->ws.onClose(WS_CLOSE_ABNORMAL);
+
+		// 尽力发出关闭帧
+		if(!dataMap[fd]->outBuffer.empty())
+			dataMap[fd]->outBuffer.writeTo(fd, MSG_DONTWAIT);
+
+		if(capture.active())
+			capture.record(CAPTURE_CLOSE, dataMap[fd]->captureId);
+		relay.unsubscribeAll(dataMap[fd]->ws.handle);
+		releaseHandle(dataMap[fd]->ws.handle);
 		dataMap.erase(fd);
 
 		std::cout << "CLOSE, FD:" << fd << std::endl << std::endl;
@@ -227,22 +419,64 @@ void TCPServer::handleConn(int fd)
 	}
 }
 
-void TCPServer::handleEvents(int num)
+// 监听socket非阻塞, 一次唤醒接受到 EAGAIN 或 ACCEPT_BATCH 为止
+void TCPServer::handleAccept()
 {
-	for(int i = 0; i < num; ++i)
+	for(int i = 0; i < ACCEPT_BATCH; ++i)
 	{
-		if(events[i].data.fd == listenfd && events[i].events & EPOLLIN)
+		int newConnFd = ::accept4(listenfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(newConnFd < 0)
 		{
-			struct sockaddr_in client_addr;
-			memset(&client_addr, 0, sizeof(struct sockaddr_in));
-			socklen_t len = sizeof(client_addr);
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if(errno != EAGAIN)
+				std::cerr << "ACCEPT ERROR, " << errno << std::endl;
+			return;
+		}
+		std::cout << "ACCEPT NEW CONN, FD:" << newConnFd << std::endl;
+
+		int nodelay = 1;
+		::setsockopt(newConnFd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
 
-			int newConnFd = TEMP_FAILURE_RETRY(::accept(listenfd, (struct sockaddr*)&client_addr, &len));
-			std::cout << "ACCEPT NEW CONN, FD:" << newConnFd << std::endl;
+		serverEpollAdd(newConnFd, EPOLLIN | EPOLLERR | EPOLLPRI);
+		dataMap[newConnFd]->ws.handle = allocHandle(newConnFd);
+		if(capture.active())
+		{
+			dataMap[newConnFd]->captureId = capture.nextConn();
+			capture.record(CAPTURE_OPEN, dataMap[newConnFd]->captureId);
+		}
 
-			setNonBlocking(newConnFd);
+		// 延迟接受时握手请求已经到了, 直接读, 不再等下一轮 epoll
+		if(listenConfig.deferAcceptSec > 0)
+		{
+			if(handleRead(newConnFd) == -1)
+			{
+				std::cout << "READ ERR, CLOSE CONN, FD:" << newConnFd << std::endl;
+				serverEpollClose(newConnFd);
+			}
+			handleConn(newConnFd);
+		}
+	}
+}
 
-			serverEpollAdd(newConnFd, EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLPRI);
+void TCPServer::handleEvents(int num)
+{
+	for(int i = 0; i < num; ++i)
+	{
+		if(events[i].data.fd == listenfd && events[i].events & EPOLLIN)
+		{
+			handleAccept();
+			continue;
+		}
+		else if(events[i].data.fd == posts.fd())
+		{
+			handlePosts();
+			continue;
+		}
+		else if(events[i].data.fd == relay.fd())
+		{
+			relay.poll();
+			continue;
 		}
 		else
 		{
@@ -271,6 +505,131 @@ void TCPServer::handleEvents(int num)
 
 }
 
+void TCPServer::handleTimers()
+{
+	relay.handleTimers();
+	uint64_t now = wsNowMs();
+	while(!reactor.timers.empty() && reactor.timers.top().deadline <= now)
+	{
+		WSTimer timer = reactor.timers.top();
+		reactor.timers.pop();
+
+		auto iter = dataMap.find(timer.fd);
+		if(iter == dataMap.end())
+			continue;
+		WSSocket& ws = iter->second->ws;
+		if(ws.lagToken && ws.lagToken == timer.token)
+		{
+			ws.lagToken = 0;
+			if(checkLag(*iter->second))
+				handleConn(timer.fd);
+			continue;
+		}
+		if(ws.waitKind != WAIT_SLEEP || ws.sleepToken != timer.token)
+			continue;
+		ws.sleepToken = 0;
+		ws.resumeTask();
+		// 协程回到 recv 后继续解析积压的输入
+		iter->second->parseBuffer();
+		markDirty(*iter->second);
+		handleConn(timer.fd);
+	}
+}
+
+// 轮末统一分派批量消息, 回应随 flushOutput 一起写出
+void TCPServer::handleBatch()
+{
+	if(batch.empty())
+		return;
+	batch.flush();
+	for(WSSocket* ws : batch.touched)
+	{
+		int fd = ws->fd;
+		auto& conn = dataMap[fd];
+		markDirty(*conn);
+		if(ws->closing)
+		{
+			ws->onClose(ws->closeCode);
+			conn->close = true;
+			handleConn(fd);
+		}
+	}
+	batch.touched.clear();
+}
+
+WSConnHandle TCPServer::allocHandle(int fd)
+{
+	uint32_t slot;
+	if(!freeSlots.empty())
+	{
+		slot = freeSlots.back();
+		freeSlots.pop_back();
+	}
+	else if(slots.size() < WS_MAX_SLOTS)
+	{
+		slot = slots.size();
+		slots.emplace_back();
+	}
+	else
+		return 0;
+	slots[slot].fd = fd;
+	return wsMakeHandle(reactorId, slot, slots[slot].generation);
+}
+
+void TCPServer::releaseHandle(WSConnHandle handle)
+{
+	if(!findConn(handle))
+		return;
+	ConnSlot& slot = slots[wsHandleSlot(handle)];
+	slot.fd = -1;
+	if(++slot.generation == 0)
+		slot.generation = 1;
+	freeSlots.push_back(wsHandleSlot(handle));
+}
+
+ConnData* TCPServer::findConn(WSConnHandle handle)
+{
+	uint32_t index = wsHandleSlot(handle);
+	if(!handle || wsHandleReactor(handle) != reactorId || index >= slots.size() || slots[index].generation != wsHandleGeneration(handle))
+		return nullptr;
+	auto iter = dataMap.find(slots[index].fd);
+	return iter == dataMap.end() ? nullptr : iter->second.get();
+}
+
+// 其他线程投递的消息按投递顺序进各连接的发送队列, 随 flushOutput 写出
+void TCPServer::handlePosts()
+{
+	WSPost* post = posts.drain();
+	while(post)
+	{
+		WSPost* next = post->next;
+		ConnData* conn = findConn(post->handle);
+		if(conn && conn->ws.opened && !conn->ws.closing && !conn->close)
+		{
+			if(post->conflate)
+				conn->ws.conflate(post->key, post->opcode, std::move(post->data));
+			else
+				conn->ws.queueMsg(post->opcode, std::move(post->data), post->priority);
+			markDirty(*conn);
+			++postsDelivered;
+		}
+		else
+			++postsDropped;
+		delete post;
+		post = next;
+	}
+}
+
+// 发布的消息投给本节点订阅者, 小消息直接拼进 outBuffer, 随 flushOutput 写出
+void TCPServer::deliverRelay(WSConnHandle handle, uint8_t opcode, std::string_view msg)
+{
+	ConnData* conn = findConn(handle);
+	if(!conn || !conn->ws.opened || conn->ws.closing || conn->close)
+		return;
+	WSReply(conn->ws, conn->outBuffer).send(opcode, msg.data(), msg.size());
+	markDirty(*conn);
+}
+
 void TCPServer::shutdown()
 {
 	TEMP_FAILURE_RETRY(::close(epfd));
@@ -293,12 +652,63 @@ int main(int argc, char** argv)
 	std::unique_ptr<TCPServer> server = std::make_unique<TCPServer>("Server");
 	if(!server)
 		return 0;
-	if(!server->bind(8500))
-		return 0;
+	// TCPServer -p 端口 -c 合并输出的延迟上限us -m 大页(0 不用, 1 THP, 2 HUGETLB) -w 捕获文件 -l 监听选项(见 WSListen.h)
+	//           -r 节点间转发端口 -b 转发监听地址(默认 127.0.0.1) -n 对端 ip:port,shm:port,... -s 节点间口令
+	unsigned short port = 8500;
+	unsigned short relayPort = 0;
+	std::string relayBind = RELAY_DEFAULT_BIND;
+	std::string relaySecret;
+	std::vector<std::string> peers;
+	int opt;
+	while((opt = getopt(argc, argv, "p:c:m:w:l:r:b:n:s:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'p': port = std::atoi(optarg); break;
+			case 'c': server->setCork(std::atoi(optarg)); break;
+			case 'm': wsSlabConfigure(static_cast<WSHugePage>(std::atoi(optarg))); break;
+			case 'w':
+				if(!server->setCapture(optarg))
+					return 1;
+				break;
+			case 'l':
+			{
+				WSListenConfig listenConfig;
+				if(!listenConfig.parse(optarg) || !wsPinCpu(listenConfig))
+					return 1;
+				server->setListenConfig(listenConfig);
+				break;
+			}
+			case 'r': relayPort = std::atoi(optarg); break;
+			case 'b': relayBind = optarg; break;
+			case 'n':
+			{
+				std::string_view list = optarg;
+				while(!list.empty())
+				{
+					size_t comma = list.find(',');
+					if(comma)
+						peers.emplace_back(list.substr(0, comma));
+					list.remove_prefix(comma == std::string_view::npos ? list.size() : comma + 1);
+				}
+				break;
+			}
+			case 's': relaySecret = optarg; break;
+			default:
+				std::cerr << "usage: " << argv[0] << " [-p port] [-c cork us] [-m hugepage 0/1/2] [-w capture file] [-l listen options]"
+					" [-r relay port] [-b relay bind address] [-n peers] [-s relay secret]" << std::endl;
+				return 1;
+		}
+	}
+	if(!server->bind(port))
+		return 1;
+	if((relayPort || !peers.empty()) && !server->startRelay(relayPort, peers, relayBind, relaySecret))
+		return 1;
 	// daemon(1,1);
 
 	shutdown_handler = [&exitFlag](int sig){ exitFlag = true; std::cout << "SHUT DOWN" << std::endl;};
 	std::signal(SIGINT, signal_handler);
+	std::signal(SIGPIPE, SIG_IGN); // sendfile 不能带 MSG_NOSIGNAL
 
 	// one thread
 	while(!exitFlag)
@@ -312,7 +722,11 @@ int main(int argc, char** argv)
 		{
 			std::cout << "epoll err" << std::endl;
 		}
+		server->handleTimers();
+		server->handleBatch();
+		server->flushOutput();
 	}
+	server->printStats();
 	server->shutdown();
 	
 	return 0;
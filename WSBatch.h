@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <span>
+#include <string_view>
+#include <algorithm>
+#include "WSBuffer.h"
+
+struct WSSocket;
+class WSReply;
+
+struct WSBatchItem
+{
+	WSSocket* ws;
+	std::string_view msg;
+	uint8_t opcode;
+
+	WSReply reply() const;
+};
+
+// 批量分派: 处理器定义 static void onBatch(std::span<WSBatchItem> items) 即开启,
+// 一轮 epoll_wait 里所有连接收齐的消息攒成一个连续数组, 轮末一次交给处理器, 再统一发出回应.
+// 消息缓冲被移进 held 直到轮末, 用过的缓冲清空后还给 WSSpareBuffers, 稳态下不分配.
+struct WSBatchQueue
+{
+	std::vector<std::vector<WSBatchItem>> items; // 按处理器下标分组
+	std::vector<WSFrameBuffer> held;
+	std::vector<WSSpill> spills;
+	std::vector<WSSocket*> touched;
+	size_t pending = 0;
+
+	bool empty() const { return pending == 0; }
+
+	// 接管连接当前的消息(接收缓冲或memfd), 换一块空缓冲给连接继续接收
+	void push(uint8_t handler, WSSocket* ws, uint8_t opcode);
+
+	// 连接在轮末之前关闭, 丢掉它的消息
+	void drop(WSSocket* ws);
+
+	// 分派给各处理器并把回应推进各连接的outBuffer, 由 reactor 随后写出
+	void flush();
+};
+
+inline thread_local WSBatchQueue* wsBatch = nullptr;
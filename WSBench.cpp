@@ -0,0 +1,451 @@
+#include <string>
+#include <string_view>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "WSRequest.h"
+#include "WSShm.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// 协议热路径的微基准: 帧解析, 解掩码, 帧头编码, 握手头解析, accept key, base64, 节点间传输.
+//   WSBench [结果json] [基线json] [允许变慢的百分比, 默认10]
+// 给出基线时逐项对比, 有超过阈值的变慢返回 1, 可直接放进脚本比较两次构建
+// handleMsg 里的调试输出在测量时关掉, 只测解析本身
+
+#define BENCH_RUNS 5
+#define BENCH_MIN_NS (50 * 1000 * 1000) // 每轮至少跑这么久
+
+struct BenchResult
+{
+	std::string name;
+	double nsPerOp;
+	double cyclesPerOp;
+	size_t bytesPerOp;
+	uint64_t iterations;
+};
+
+static inline uint64_t cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static inline uint64_t nowNs()
+{
+	using namespace std::chrono;
+	return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// 阻止编译器把被测结果当作无用代码删掉
+template <typename T>
+static inline void keep(T&& value)
+{
+	asm volatile("" : : "g"(&value) : "memory");
+}
+
+static std::vector<BenchResult> results;
+
+// 先估出迭代次数, 再跑 BENCH_RUNS 轮取最快的一轮
+static void bench(const std::string& name, size_t bytesPerOp, const std::function<void()>& op)
+{
+	uint64_t iterations = 1;
+	while(true)
+	{
+		uint64_t start = nowNs();
+		for(uint64_t i = 0; i < iterations; ++i)
+			op();
+		uint64_t elapsed = nowNs() - start;
+		if(elapsed >= BENCH_MIN_NS / 10)
+		{
+			iterations = std::max<uint64_t>(1, iterations * BENCH_MIN_NS / std::max<uint64_t>(elapsed, 1));
+			break;
+		}
+		iterations *= 10;
+	}
+
+	double bestNs = 0, bestCycles = 0;
+	for(int run = 0; run < BENCH_RUNS; ++run)
+	{
+		uint64_t startCycles = cycles();
+		uint64_t start = nowNs();
+		for(uint64_t i = 0; i < iterations; ++i)
+			op();
+		double ns = static_cast<double>(nowNs() - start) / iterations;
+		double cyc = static_cast<double>(cycles() - startCycles) / iterations;
+		if(run == 0 || ns < bestNs)
+		{
+			bestNs = ns;
+			bestCycles = cyc;
+		}
+	}
+	results.push_back({name, bestNs, bestCycles, bytesPerOp, iterations});
+	std::cerr << name << " ns/op:" << bestNs;
+	if(bytesPerOp)
+		std::cerr << " cycles/byte:" << bestCycles / bytesPerOp;
+	std::cerr << std::endl;
+}
+
+// 客户端发出的带掩码帧
+static std::string maskedFrame(uint8_t opcode, bool fin, const std::string& payload)
+{
+	uint8_t maskKey[4] = {0x37, 0xfa, 0x21, 0x3d};
+	uint8_t header[WS_HEADROOM];
+	size_t headerLen = writeFrameHeader(header, opcode, fin, payload.size(), maskKey);
+	std::string frame(reinterpret_cast<const char*>(header), headerLen);
+	size_t begin = frame.size();
+	frame += payload;
+	maskPayload(frame.data() + begin, payload.size(), maskKey);
+	return frame;
+}
+
+static std::string textPayload(size_t size)
+{
+	std::string payload(size, 'a');
+	for(size_t i = 0; i < size; ++i)
+		payload[i] = 'a' + i % 26;
+	return payload;
+}
+
+static void openSocket(WSSocket& ws)
+{
+	ws.route = findRoute("/ws");
+	ws.state = WS_TRANSMISSION;
+	ws.maxMessageSize = SIZE_MAX;
+	ws.spillSize = SIZE_MAX; // 只测内存路径
+	ws.validateUtf8 = ws.route->settings.validateUtf8;
+}
+
+// wire 是一次 recv 收到的字节, 逐帧解析直到读空, 每条完整消息交出后清空
+static void benchHandleMsg(const std::string& name, const std::string& wire, size_t payloadBytes)
+{
+	WSSocket ws;
+	openSocket(ws);
+	WSInBuffer inBuffer;
+	inBuffer.reserve(wire.size());
+	bench(name, payloadBytes, [&]()
+	{
+		inBuffer.assign(wire.data(), wire.size());
+		while(true)
+		{
+			auto result = ws.handleMsg(inBuffer);
+			if(result == SUCCESS)
+				ws.clearMessage();
+			else if(result != RECV_SEGMENT && result != RECV_CONTROL)
+				break;
+		}
+		keep(inBuffer);
+	});
+}
+
+static void benchFrames()
+{
+	for(size_t size : {16, 125, 1024, 16 * 1024, 64 * 1024, 1024 * 1024})
+	{
+		std::string wire = maskedFrame(WSOpcode::BINARY, true, textPayload(size));
+		benchHandleMsg("handleMsg/binary/" + std::to_string(size), wire, size);
+	}
+	for(size_t size : {125, 16 * 1024})
+	{
+		std::string wire = maskedFrame(WSOpcode::TEXT, true, textPayload(size));
+		benchHandleMsg("handleMsg/text_utf8/" + std::to_string(size), wire, size);
+	}
+
+	// 1MB 消息分成 16 个 64KB 分片
+	{
+		std::string payload = textPayload(64 * 1024);
+		std::string wire;
+		for(int i = 0; i < 16; ++i)
+			wire += maskedFrame(i ? WSOpcode::CONTINUE : WSOpcode::BINARY, i == 15, payload);
+		benchHandleMsg("handleMsg/fragmented/16x65536", wire, 16 * payload.size());
+	}
+
+	// 一次 recv 里带多条小消息
+	for(int count : {8, 64})
+	{
+		std::string payload = textPayload(64);
+		std::string wire;
+		for(int i = 0; i < count; ++i)
+			wire += maskedFrame(WSOpcode::BINARY, true, payload);
+		benchHandleMsg("handleMsg/batched/" + std::to_string(count) + "x64", wire, count * payload.size());
+	}
+
+	// 整条接收路径: 解析 + EchoHandler 回显 + 出队
+	{
+		std::string wire = maskedFrame(WSOpcode::BINARY, true, textPayload(1024));
+		WSSocket ws;
+		openSocket(ws);
+		WSOutQueue outBuffer;
+		ws.output = &outBuffer;
+		WSInBuffer inBuffer;
+		bench("parseBuffer/echo/1024", 1024, [&]()
+		{
+			inBuffer.assign(wire.data(), wire.size());
+			ws.parseBuffer(inBuffer, outBuffer);
+			outBuffer.consume(outBuffer.size());
+		});
+	}
+}
+
+static void benchMask()
+{
+	uint8_t maskKey[4] = {0x12, 0x34, 0x56, 0x78};
+	for(size_t size : {64, 1024, 64 * 1024})
+	{
+		std::string data = textPayload(size);
+		bench("maskPayload/" + std::to_string(size), size, [&]()
+		{
+			maskPayload(data.data(), data.size(), maskKey);
+			keep(data);
+		});
+	}
+
+	// 客户端发送: 取掩码 + 拷贝加掩码 + 帧头, 和纯拷贝对比
+	bench("wsMaskKey", 0, [&]()
+	{
+		uint8_t key[4];
+		wsMaskKey(key);
+		keep(key);
+	});
+	for(size_t size : {64, 1024, 64 * 1024})
+	{
+		std::string data = textPayload(size);
+		WSFrameBuffer frame(size);
+		bench("memcpy/" + std::to_string(size), size, [&]()
+		{
+			frame.clear();
+			frame.append(data.data(), data.size());
+			keep(frame);
+		});
+		bench("WSFrameBuffer::encodeMasked/" + std::to_string(size), size, [&]()
+		{
+			uint8_t key[4];
+			wsMaskKey(key);
+			frame.encodeMasked(WSOpcode::BINARY, true, data.data(), data.size(), key);
+			keep(frame);
+		});
+	}
+}
+
+static void benchHeaders()
+{
+	uint8_t header[WS_HEADROOM];
+	uint8_t maskKey[4] = {1, 2, 3, 4};
+	for(uint64_t len : {100, 1000, 100000})
+	{
+		bench("writeFrameHeader/" + std::to_string(len), 0, [&]()
+		{
+			keep(writeFrameHeader(header, WSOpcode::BINARY, true, len));
+			keep(header);
+		});
+		bench("writeFrameHeader/masked/" + std::to_string(len), 0, [&]()
+		{
+			keep(writeFrameHeader(header, WSOpcode::BINARY, true, len, maskKey));
+			keep(header);
+		});
+	}
+
+	// 发送路径: 帧头写进负载前的headroom
+	WSFrameBuffer frame(textPayload(1000).data(), 1000);
+	bench("WSFrameBuffer::encodeHeader/1000", 0, [&]()
+	{
+		frame.encodeHeader(WSOpcode::TEXT, true);
+		keep(frame);
+	});
+}
+
+static void benchHandshake()
+{
+	// 浏览器实际发出的握手
+	const std::string request =
+		"GET /ws?token=abc123 HTTP/1.1\r\n"
+		"Host: example.com:8500\r\n"
+		"Connection: Upgrade\r\n"
+		"Pragma: no-cache\r\n"
+		"Cache-Control: no-cache\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+		"Upgrade: websocket\r\n"
+		"Origin: https://example.com\r\n"
+		"Sec-WebSocket-Version: 13\r\n"
+		"Accept-Encoding: gzip, deflate, br\r\n"
+		"Accept-Language: en-US,en;q=0.9\r\n"
+		"Cookie: session=0123456789abcdef0123456789abcdef; theme=dark\r\n"
+		"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+		"Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n"
+		"\r\n";
+	size_t lineEnd = request.find("\r\n");
+	std::string_view block(request.data() + lineEnd + 2, request.size() - lineEnd - 4);
+	bench("WSHttpHeaders::parse", block.size(), [&]()
+	{
+		WSHttpHeaders headers;
+		if(headers.parse(block) != R_SUCCESS)
+			abort();
+		keep(headers);
+	});
+
+	WSInBuffer inBuffer(request.data(), request.size());
+	bench("WSHttpRequest::parse", request.size(), [&]()
+	{
+		WSHttpRequest parsed;
+		if(parsed.parse(inBuffer) != R_SUCCESS)
+			abort();
+		keep(parsed);
+	});
+
+	char accept[WS_ACCEPT_LEN];
+	bench("wsAcceptKey", 0, [&]()
+	{
+		wsAcceptKey("dGhlIHNhbXBsZSBub25jZQ==", accept);
+		keep(accept);
+	});
+
+	for(size_t size : {20, 1024})
+	{
+		std::string data = textPayload(size);
+		std::string out(base64_encoded_size(size), '\0');
+		bench("base64_encode/" + std::to_string(size), size, [&]()
+		{
+			keep(base64_encode(reinterpret_cast<const unsigned char*>(data.data()), size, out.data()));
+			keep(out);
+		});
+	}
+}
+
+// 同机节点间搬一段数据的开销: 共享内存环写入再读出 对比 回环TCP send 再 recv, 单线程, 只计CPU
+static void benchTransport()
+{
+	int pair[2];
+	if(::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0)
+		return;
+	WSShmChannel writer, reader;
+	if(!writer.create(1 << 20) || !writer.sendTo(pair[0]) || !reader.recvFrom(pair[1]))
+		abort();
+
+	int listenfd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	struct sockaddr_in addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	if(::bind(listenfd, reinterpret_cast<struct sockaddr*>(&addr), len) < 0 || ::listen(listenfd, 1) < 0
+			|| ::getsockname(listenfd, reinterpret_cast<struct sockaddr*>(&addr), &len) < 0)
+		abort();
+	int client = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(::connect(client, reinterpret_cast<struct sockaddr*>(&addr), len) < 0)
+		abort();
+	int server = ::accept(listenfd, nullptr, nullptr);
+	int one = 1;
+	::setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	for(size_t size : {64, 1024, 64 * 1024})
+	{
+		std::string data = textPayload(size);
+		std::string buf(size, '\0');
+		bench("shmRing/write+read/" + std::to_string(size), size, [&]()
+		{
+			writer.out.write(data.data(), size);
+			for(size_t got = 0; got < size; )
+				got += reader.in.read(buf.data() + got, size - got);
+			keep(buf);
+		});
+		bench("loopbackTcp/send+recv/" + std::to_string(size), size, [&]()
+		{
+			for(size_t sent = 0; sent < size; )
+				sent += ::send(client, data.data() + sent, size - sent, 0);
+			for(size_t got = 0; got < size; )
+				got += ::recv(server, buf.data() + got, size - got, 0);
+			keep(buf);
+		});
+	}
+	for(int fd : {pair[0], pair[1], listenfd, client, server})
+		::close(fd);
+}
+
+static std::string toJson(const BenchResult& r)
+{
+	std::ostringstream out;
+	out << "{\"name\": \"" << r.name << "\", \"ns_per_op\": " << r.nsPerOp << ", \"cycles_per_op\": " << r.cyclesPerOp
+		<< ", \"cycles_per_byte\": " << (r.bytesPerOp ? r.cyclesPerOp / r.bytesPerOp : 0) << ", \"bytes_per_op\": " << r.bytesPerOp
+		<< ", \"iterations\": " << r.iterations << "}";
+	return out.str();
+}
+
+// 只读自己写出的格式: 每项结果一行
+static std::map<std::string, double> loadBaseline(const char* path)
+{
+	std::map<std::string, double> baseline;
+	std::ifstream in(path);
+	std::string line;
+	while(std::getline(in, line))
+	{
+		auto name = line.find("\"name\": \"");
+		auto ns = line.find("\"ns_per_op\": ");
+		if(name == std::string::npos || ns == std::string::npos)
+			continue;
+		name += 9;
+		baseline[line.substr(name, line.find('"', name) - name)] = std::atof(line.c_str() + ns + 13);
+	}
+	return baseline;
+}
+
+int main(int argc, char** argv)
+{
+	const char* output = argc > 1 ? argv[1] : nullptr;
+	const char* baselinePath = argc > 2 ? argv[2] : nullptr;
+	double threshold = argc > 3 ? std::atof(argv[3]) : 10;
+
+	std::cout.setstate(std::ios::failbit);
+	benchFrames();
+	benchMask();
+	benchHeaders();
+	benchHandshake();
+	benchTransport();
+	std::cout.clear();
+
+	std::ostringstream json;
+	json << "{\"results\": [\n";
+	for(size_t i = 0; i < results.size(); ++i)
+		json << "  " << toJson(results[i]) << (i + 1 < results.size() ? ",\n" : "\n");
+	json << "]}\n";
+	if(output)
+		std::ofstream(output) << json.str();
+	else
+		std::cout << json.str();
+
+	if(!baselinePath)
+		return 0;
+	auto baseline = loadBaseline(baselinePath);
+	if(baseline.empty())
+	{
+		std::cerr << "NO BASELINE RESULTS, " << baselinePath << std::endl;
+		return 1;
+	}
+	bool regressed = false;
+	for(auto& r : results)
+	{
+		auto iter = baseline.find(r.name);
+		if(iter == baseline.end() || iter->second <= 0)
+			continue;
+		double delta = (r.nsPerOp - iter->second) / iter->second * 100;
+		bool slower = delta > threshold;
+		regressed = regressed || slower;
+		std::cout << (slower ? "SLOWER " : "OK     ") << r.name << " " << iter->second << " -> " << r.nsPerOp << " ns/op (" << delta << "%)" << std::endl;
+	}
+	return regressed ? 1 : 0;
+}
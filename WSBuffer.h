@@ -0,0 +1,701 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <new>
+#include <algorithm>
+#include <utility>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/random.h>
+#include <errno.h>
+#include <string>
+#include "WSSlab.h"
+#include "WSSpill.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WS_MASK_X86
+#endif
+
+#undef htonll
+#define htonll(x) ((1 == htonl(1)) ? (x) : ((uint64_t)htonl((x)&0xFFFFFFFF) << 32) | htonl((x) >> 32))
+#undef ntohll
+#define ntohll(x) htonll(x)
+
+#define WS_HEADROOM 14 // 最大帧头: 2 + 8字节长度 + 4字节掩码
+#define WS_MAX_IOV 64
+#define WS_POOL_MAX 4096 // 每种对象池留存的空闲对象上限
+#define WS_RING_MIN 4
+#define WS_MASK_RESEED 4096 // 掩码生成器每产出这么多个key重取一次种子
+
+enum WSLenClass
+{
+	WS_LEN_7 = 0,	// <126
+	WS_LEN_16 = 1,	// <65536
+	WS_LEN_64 = 2
+};
+
+constexpr WSLenClass frameLenClass(uint64_t len)
+{
+	return len < 126 ? WS_LEN_7 : (len < 65536 ? WS_LEN_16 : WS_LEN_64);
+}
+
+constexpr size_t frameHeaderSize(uint64_t len, bool masked)
+{
+	return 2 + (len < 126 ? 0 : (len < 65536 ? 2 : 8)) + (masked ? 4 : 0);
+}
+
+// 按长度类别和是否掩码特化, 每种组合都是定长写入
+template <WSLenClass LenClass, bool Masked>
+inline size_t encodeFrameHeader(uint8_t* dst, uint8_t b0, uint64_t len, const uint8_t* maskKey)
+{
+	constexpr size_t extLen = LenClass == WS_LEN_7 ? 0 : (LenClass == WS_LEN_16 ? 2 : 8);
+	constexpr uint8_t maskBit = Masked ? 0x80 : 0;
+
+	dst[0] = b0;
+	if constexpr (LenClass == WS_LEN_7)
+	{
+		dst[1] = maskBit | static_cast<uint8_t>(len);
+	}
+	else if constexpr (LenClass == WS_LEN_16)
+	{
+		dst[1] = maskBit | 126;
+		uint16_t value = htons(static_cast<uint16_t>(len));
+		std::memcpy(dst + 2, &value, 2);
+	}
+	else
+	{
+		dst[1] = maskBit | 127;
+		uint64_t value = htonll(len);
+		std::memcpy(dst + 2, &value, 8);
+	}
+	if constexpr (Masked)
+		std::memcpy(dst + 2 + extLen, maskKey, 4);
+	return 2 + extLen + (Masked ? 4 : 0);
+}
+
+// 写帧头, 返回帧头长度; dst 至少 WS_HEADROOM 字节
+inline size_t writeFrameHeader(uint8_t* dst, uint8_t opcode, bool fin, uint64_t len, const uint8_t* maskKey = nullptr)
+{
+	uint8_t b0 = opcode | (fin ? 0x80 : 0);
+	switch(frameLenClass(len))
+	{
+		case WS_LEN_7:
+			return maskKey ? encodeFrameHeader<WS_LEN_7, true>(dst, b0, len, maskKey) : encodeFrameHeader<WS_LEN_7, false>(dst, b0, len, maskKey);
+		case WS_LEN_16:
+			return maskKey ? encodeFrameHeader<WS_LEN_16, true>(dst, b0, len, maskKey) : encodeFrameHeader<WS_LEN_16, false>(dst, b0, len, maskKey);
+		default:
+			return maskKey ? encodeFrameHeader<WS_LEN_64, true>(dst, b0, len, maskKey) : encodeFrameHeader<WS_LEN_64, false>(dst, b0, len, maskKey);
+	}
+}
+
+// 发送统计, 每个reactor线程一份, 用来看每条消息摊到几次系统调用
+struct WSIoStats
+{
+	uint64_t msgs = 0;
+	uint64_t sendCalls = 0;
+	uint64_t bytes = 0;
+	uint64_t conflated = 0;		// 被同键新消息替换掉的消息
+	uint64_t slowClosed = 0;	// 积压超时断开的慢消费者
+};
+
+inline thread_local WSIoStats wsIoStats;
+
+// 掩码生成器: xoshiro256**, 种子每 WS_MASK_RESEED 个key从 getrandom 重取一次.
+// 掩码只防中间代理被构造的负载投毒, 不需要对连接两端保密, 每帧一次系统调用太贵
+struct WSMaskKeys
+{
+	uint64_t state[4];
+	uint32_t left = 0;	// 距下次重取种子还能产出的key数
+
+	void next(uint8_t* key)
+	{
+		if(!left)
+			reseed();
+		--left;
+		uint32_t value = static_cast<uint32_t>(generate() >> 32);
+		std::memcpy(key, &value, 4);
+	}
+
+	uint64_t generate()
+	{
+		uint64_t result = rotl(state[1] * 5, 7) * 9;
+		uint64_t t = state[1] << 17;
+		state[2] ^= state[0];
+		state[3] ^= state[1];
+		state[1] ^= state[2];
+		state[0] ^= state[3];
+		state[2] ^= t;
+		state[3] = rotl(state[3], 45);
+		return result;
+	}
+
+	static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+	void reseed()
+	{
+		char* p = reinterpret_cast<char*>(state);
+		size_t filled = 0;
+		while(filled < sizeof(state))
+		{
+			ssize_t ret = ::getrandom(p + filled, sizeof(state) - filled, 0);
+			if(ret < 0)
+			{
+				if(errno == EINTR)
+					continue;
+				abort();
+			}
+			filled += ret;
+		}
+		// 全零状态不会再变
+		if(!(state[0] | state[1] | state[2] | state[3]))
+			state[0] = 1;
+		left = WS_MASK_RESEED;
+	}
+};
+
+inline thread_local WSMaskKeys wsMaskKeys;
+
+// 客户端每帧一个不可预测的掩码
+inline void wsMaskKey(uint8_t* key)
+{
+	wsMaskKeys.next(key);
+}
+
+#ifdef WS_MASK_X86
+inline const bool wsHasAvx2 = __builtin_cpu_supports("avx2");
+
+// 返回已处理的字节数, 剩下不足一个向量的部分由调用方处理
+__attribute__((target("avx2"))) inline size_t maskCopyAvx2(char* dst, const char* src, size_t len, uint64_t key64)
+{
+	__m256i key = _mm256_set1_epi64x(static_cast<long long>(key64));
+	size_t i = 0;
+	for(; i + 32 <= len; i += 32)
+	{
+		__m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_xor_si256(data, key));
+	}
+	return i;
+}
+
+__attribute__((target("sse2"))) inline size_t maskCopySse2(char* dst, const char* src, size_t len, uint64_t key64)
+{
+	__m128i key = _mm_set1_epi64x(static_cast<long long>(key64));
+	size_t i = 0;
+	for(; i + 16 <= len; i += 16)
+	{
+		__m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_xor_si128(data, key));
+	}
+	return i;
+}
+#endif
+
+// 按4字节掩码异或后写到 dst, dst 可以就是 src; offset 为 src[0] 在整段负载中的位置
+inline void maskCopy(char* dst, const char* src, size_t len, const uint8_t* maskKey, size_t offset = 0)
+{
+	uint8_t key[8];
+	for(int i = 0; i < 8; ++i)
+		key[i] = maskKey[(offset + i) % 4];
+	uint64_t key64;
+	std::memcpy(&key64, key, 8);
+
+	size_t i = 0;
+#ifdef WS_MASK_X86
+	i = wsHasAvx2 ? maskCopyAvx2(dst, src, len, key64) : maskCopySse2(dst, src, len, key64);
+#endif
+	for(; i + 8 <= len; i += 8)
+	{
+		uint64_t word;
+		std::memcpy(&word, src + i, 8);
+		word ^= key64;
+		std::memcpy(dst + i, &word, 8);
+	}
+	for(; i < len; ++i)
+		dst[i] = src[i] ^ key[i % 8];
+}
+
+inline void maskPayload(char* data, size_t len, const uint8_t* maskKey, size_t offset = 0)
+{
+	maskCopy(data, data, len, maskKey, offset);
+}
+
+// 线程内对象池: 空闲连接不持有的状态(握手, UTF-8校验, 队列存储)用时借, 用完还
+template <typename T>
+struct WSObjectPool
+{
+	struct FreeList
+	{
+		std::vector<T*> objects;
+		~FreeList()
+		{
+			for(T* p : objects)
+				delete p;
+		}
+	};
+
+	static FreeList& freeList()
+	{
+		static thread_local FreeList list;
+		return list;
+	}
+
+	static T* borrow()
+	{
+		auto& list = freeList().objects;
+		if(list.empty())
+			return new T();
+		T* p = list.back();
+		list.pop_back();
+		return p;
+	}
+
+	// 调用方负责把对象恢复成初始状态
+	static void release(T* p)
+	{
+		auto& list = freeList().objects;
+		if(list.size() < WS_POOL_MAX)
+			list.push_back(p);
+		else
+			delete p;
+	}
+};
+
+// 环形队列, 空时不占内存; 最小容量的存储从对象池借
+template <typename T>
+class WSRing
+{
+	public:
+		WSRing() = default;
+		~WSRing()
+		{
+			while(count)
+				pop_front();
+		}
+		WSRing(const WSRing&) = delete;
+		WSRing& operator = (const WSRing&) = delete;
+
+		bool empty() const { return count == 0; }
+		size_t size() const { return count; }
+
+		T& front() { return slots[head]; }
+		const T& front() const { return slots[head]; }
+		T& back() { return slots[(head + count - 1) & (cap - 1)]; }
+		T& operator [] (size_t i) { return slots[(head + i) & (cap - 1)]; }
+
+		T& emplace_back()
+		{
+			if(count == cap)
+				grow();
+			T* p = new (&slots[(head + count) & (cap - 1)]) T();
+			++count;
+			return *p;
+		}
+
+		void push_back(T&& value) { emplace_back() = std::move(value); }
+
+		void pop_front()
+		{
+			slots[head].~T();
+			head = (head + 1) & (cap - 1);
+			if(--count == 0)
+				release();
+		}
+
+	private:
+		struct MinBlock { alignas(T) char data[sizeof(T) * WS_RING_MIN]; };
+
+		void grow()
+		{
+			uint32_t newCap = cap ? cap * 2 : WS_RING_MIN;
+			T* newSlots = newCap == WS_RING_MIN
+				? reinterpret_cast<T*>(WSObjectPool<MinBlock>::borrow()->data)
+				: static_cast<T*>(wsSlabAlloc(sizeof(T) * newCap));
+			for(uint32_t i = 0; i < count; ++i)
+			{
+				T& old = slots[(head + i) & (cap - 1)];
+				new (&newSlots[i]) T(std::move(old));
+				old.~T();
+			}
+			uint32_t oldCount = count;
+			release();
+			slots = newSlots;
+			cap = newCap;
+			count = oldCount;
+		}
+
+		void release()
+		{
+			if(cap == WS_RING_MIN)
+				WSObjectPool<MinBlock>::release(reinterpret_cast<MinBlock*>(slots));
+			else if(cap)
+				wsSlabFree(slots, sizeof(T) * cap);
+			slots = nullptr;
+			cap = head = count = 0;
+		}
+
+		T* slots = nullptr;
+		uint32_t cap = 0;
+		uint32_t head = 0;
+		uint32_t count = 0;
+};
+
+// 接收缓冲, 内存从slab取
+using WSInBuffer = std::basic_string<char, std::char_traits<char>, WSSlabAllocator<char>>;
+
+// 负载前预留 WS_HEADROOM 字节, 帧头直接写在负载前面, 整帧一次发出
+class WSFrameBuffer
+{
+	public:
+		WSFrameBuffer() = default;
+		explicit WSFrameBuffer(size_t capacity) { reserve(capacity); }
+		WSFrameBuffer(const char* data, size_t len) { append(data, len); }
+		~WSFrameBuffer() { release(); }
+
+		WSFrameBuffer(WSFrameBuffer&& other) noexcept
+			: mem(other.mem), cap(other.cap), len(other.len), head(other.head)
+		{
+			other.mem = nullptr;
+			other.cap = other.len = 0;
+			other.head = WS_HEADROOM;
+		}
+		WSFrameBuffer& operator = (WSFrameBuffer&& other) noexcept
+		{
+			if(this != &other)
+			{
+				release();
+				mem = other.mem;
+				cap = other.cap;
+				len = other.len;
+				head = other.head;
+				other.mem = nullptr;
+				other.cap = other.len = 0;
+				other.head = WS_HEADROOM;
+			}
+			return *this;
+		}
+		WSFrameBuffer(const WSFrameBuffer&) = delete;
+		WSFrameBuffer& operator = (const WSFrameBuffer&) = delete;
+
+		char* data() { return mem ? mem + WS_HEADROOM : nullptr; }
+		const char* data() const { return mem ? mem + WS_HEADROOM : nullptr; }
+		size_t size() const { return len; }
+		bool empty() const { return len == 0; }
+		size_t capacity() const { return cap; }
+
+		void reserve(size_t n)
+		{
+			if(n <= cap)
+				return;
+			// 按slab级别取整, 多出的部分直接算作容量
+			size_t size = wsSlabRound(WS_HEADROOM + n);
+			char* p = static_cast<char*>(wsSlabAlloc(size));
+			if(mem)
+			{
+				std::memcpy(p, mem, WS_HEADROOM + len);
+				release();
+			}
+			mem = p;
+			cap = size - WS_HEADROOM;
+		}
+
+		// 追加n字节未初始化空间, 返回其起始位置
+		char* grow(size_t n)
+		{
+			if(len + n > cap)
+				reserve(std::max(len + n, cap * 2));
+			char* p = data() + len;
+			len += n;
+			return p;
+		}
+
+		void resize(size_t n)
+		{
+			reserve(n);
+			len = n;
+		}
+
+		void append(const char* p, size_t n)
+		{
+			if(n)
+				std::memcpy(grow(n), p, n);
+		}
+
+		void clear()
+		{
+			len = 0;
+			head = WS_HEADROOM;
+		}
+
+		// 帧头写入headroom; payloadLen 小于 size() 时表示只发首个分片
+		void encodeHeader(uint8_t opcode, bool fin, const uint8_t* maskKey = nullptr)
+		{
+			encodeHeader(opcode, fin, len, maskKey);
+		}
+		void encodeHeader(uint8_t opcode, bool fin, size_t payloadLen, const uint8_t* maskKey)
+		{
+			if(!mem)
+				reserve(1);
+			head = WS_HEADROOM - frameHeaderSize(payloadLen, maskKey != nullptr);
+			writeFrameHeader(reinterpret_cast<uint8_t*>(mem + head), opcode, fin, payloadLen, maskKey);
+			if(maskKey)
+				maskPayload(data(), payloadLen, maskKey);
+		}
+
+		// 客户端发送: 负载拷进来的同时加掩码, 一遍完成
+		void encodeMasked(uint8_t opcode, bool fin, const char* payload, size_t n, const uint8_t* maskKey)
+		{
+			clear();
+			reserve(std::max<size_t>(n, 1));
+			maskCopy(mem + WS_HEADROOM, payload, n, maskKey);
+			len = n;
+			head = WS_HEADROOM - frameHeaderSize(n, true);
+			writeFrameHeader(reinterpret_cast<uint8_t*>(mem + head), opcode, fin, n, maskKey);
+		}
+
+		const char* frameData() const { return mem + head; }
+		size_t frameSize() const { return WS_HEADROOM - head + len; }
+		size_t headerSize() const { return WS_HEADROOM - head; }
+
+	private:
+		void release()
+		{
+			if(mem)
+				wsSlabFree(mem, WS_HEADROOM + cap);
+		}
+
+		char* mem = nullptr;
+		size_t cap = 0;
+		size_t len = 0;
+		size_t head = WS_HEADROOM;
+};
+
+// 空缓冲池: 连接空闲时把接收缓冲还回来, 有数据时再借, 稳态下不分配
+struct WSSpareBuffers
+{
+	static std::vector<WSFrameBuffer>& list()
+	{
+		static thread_local std::vector<WSFrameBuffer> buffers;
+		return buffers;
+	}
+
+	static WSFrameBuffer take()
+	{
+		auto& buffers = list();
+		if(buffers.empty())
+			return WSFrameBuffer();
+		WSFrameBuffer buffer = std::move(buffers.back());
+		buffers.pop_back();
+		return buffer;
+	}
+
+	// 大缓冲直接释放, 免得少数大消息把池撑大
+	static void give(WSFrameBuffer&& buffer, size_t maxCapacity)
+	{
+		auto& buffers = list();
+		if(!buffer.capacity() || buffer.capacity() > maxCapacity || buffers.size() >= WS_POOL_MAX)
+		{
+			buffer = WSFrameBuffer();
+			return;
+		}
+		buffer.clear();
+		buffers.push_back(std::move(buffer));
+	}
+};
+
+// 应用消息的优先级类别, 类别之间按权重轮转(DRR); 控制帧另有队列, 严格优先于所有类别
+enum WSPriority : uint8_t
+{
+	WS_PRIO_HIGH = 0,	// 订单回报等要求低延迟的小消息
+	WS_PRIO_NORMAL = 1,
+	WS_PRIO_BULK = 2,	// 快照, 大文件
+	WS_PRIO_AUTO = 0xFF,	// 按大小分: 不超过一个分片走 NORMAL, 否则走 BULK
+};
+
+#define WS_PRIORITY_CLASSES 3
+#define WS_DRR_QUANTUM (16 * 1024) // 每轮额度 = 权重 * WS_DRR_QUANTUM 字节
+
+// 待发送的一段: 独立帧头(分片用) + 负载区间; owner 持有负载内存
+struct WSOutChunk
+{
+	WSFrameBuffer owner;
+	uint8_t header[WS_HEADROOM];
+	size_t headerLen = 0;
+	const char* data = nullptr;
+	size_t len = 0;
+	bool open = false; // 可继续追加小帧
+	int fileFd = -1;	// 负载在文件里, 用 sendfile 发送
+	off_t fileOffset = 0;
+	WSSpill file;	// 文件负载的最后一个分片持有文件
+
+	size_t total() const { return headerLen + len; }
+};
+
+// 连接的发送队列, writev 一次发出多段
+struct WSOutQueue
+{
+	WSRing<WSOutChunk> chunks;
+	size_t bytes = 0;	// 未发送字节数
+	size_t sent = 0;	// 队首已发送字节数
+
+	bool empty() const { return bytes == 0; }
+	size_t size() const { return bytes; }
+
+	// 已在headroom写好帧头的整帧, 零拷贝入队
+	void push(WSFrameBuffer&& frame)
+	{
+		WSOutChunk chunk;
+		chunk.data = frame.frameData();
+		chunk.len = frame.frameSize();
+		chunk.owner = std::move(frame);
+		bytes += chunk.len;
+		chunks.push_back(std::move(chunk));
+	}
+
+	// 引用外部内存的分片, 内存由同一消息的最后一个分片持有
+	void pushFragment(const uint8_t* header, size_t headerLen, const char* data, size_t len, WSFrameBuffer* owner = nullptr)
+	{
+		WSOutChunk chunk;
+		std::memcpy(chunk.header, header, headerLen);
+		chunk.headerLen = headerLen;
+		chunk.data = data;
+		chunk.len = len;
+		if(owner)
+			chunk.owner = std::move(*owner);
+		bytes += chunk.total();
+		chunks.push_back(std::move(chunk));
+	}
+
+	// 负载是文件区间的分片, 文件由最后一个分片接管
+	void pushFile(const uint8_t* header, size_t headerLen, WSSpill& file, size_t offset, size_t len, bool own)
+	{
+		WSOutChunk chunk;
+		std::memcpy(chunk.header, header, headerLen);
+		chunk.headerLen = headerLen;
+		chunk.fileFd = file.fileFd();
+		chunk.fileOffset = offset;
+		chunk.len = len;
+		if(own)
+			chunk.file = std::move(file);
+		bytes += chunk.total();
+		chunks.push_back(std::move(chunk));
+	}
+
+	// 小帧连同帧头追加到队尾的合并缓冲, 多条回应共用一次分配
+	void appendFrame(uint8_t opcode, const char* data, size_t len)
+	{
+		if(chunks.empty() || !chunks.back().open)
+		{
+			chunks.emplace_back();
+			chunks.back().open = true;
+		}
+		WSOutChunk& chunk = chunks.back();
+		size_t headerLen = frameHeaderSize(len, false);
+		char* p = chunk.owner.grow(headerLen + len);
+		writeFrameHeader(reinterpret_cast<uint8_t*>(p), opcode, true, len);
+		if(len)
+			std::memcpy(p + headerLen, data, len);
+		// grow 可能搬迁内存, sent 是偏移量不受影响
+		chunk.data = chunk.owner.data();
+		chunk.len = chunk.owner.size();
+		bytes += headerLen + len;
+	}
+
+	// 不带帧头的原始字节, 如握手回应
+	void append(const char* data, size_t len)
+	{
+		if(!len)
+			return;
+		WSFrameBuffer raw(data, len);
+		push(std::move(raw));
+	}
+
+	void consume(size_t n)
+	{
+		bytes -= n;
+		while(n && !chunks.empty())
+		{
+			size_t left = chunks.front().total() - sent;
+			if(n < left)
+			{
+				sent += n;
+				return;
+			}
+			n -= left;
+			sent = 0;
+			chunks.pop_front();
+		}
+	}
+
+	// 返回值同 send
+	ssize_t writeTo(int fd, int flags = 0)
+	{
+		struct iovec iov[WS_MAX_IOV];
+		int count = 0;
+		size_t skip = sent;
+		size_t index = 0;
+		for(; index < chunks.size() && count < WS_MAX_IOV - 1; ++index)
+		{
+			WSOutChunk* iter = &chunks[index];
+			if(iter->headerLen > skip)
+			{
+				iov[count].iov_base = iter->header + skip;
+				iov[count++].iov_len = iter->headerLen - skip;
+				skip = 0;
+			}
+			else
+				skip -= iter->headerLen;
+			if(iter->fileFd >= 0)
+			{
+				// 先发完前面攒的iovec, 轮到文件负载时单独 sendfile
+				if(!count)
+					return sendFile(fd, *iter, skip);
+				flags |= MSG_MORE;
+				++index;
+				break;
+			}
+			if(iter->len > skip)
+			{
+				iov[count].iov_base = const_cast<char*>(iter->data) + skip;
+				iov[count++].iov_len = iter->len - skip;
+			}
+			skip = 0;
+		}
+		if(!count)
+			return 0;
+		// iovec 装不下时后面还有一次发送
+		if(index < chunks.size())
+			flags |= MSG_MORE;
+
+		struct msghdr msg;
+		std::memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		ssize_t ret = ::sendmsg(fd, &msg, MSG_NOSIGNAL | flags);
+		++wsIoStats.sendCalls;
+		if(ret > 0)
+		{
+			consume(ret);
+			wsIoStats.bytes += ret;
+		}
+		return ret;
+	}
+
+	ssize_t sendFile(int fd, const WSOutChunk& chunk, size_t skip)
+	{
+		off_t offset = chunk.fileOffset + skip;
+		ssize_t ret = ::sendfile(fd, chunk.fileFd, &offset, chunk.len - skip);
+		++wsIoStats.sendCalls;
+		if(ret > 0)
+		{
+			consume(ret);
+			wsIoStats.bytes += ret;
+		}
+		return ret;
+	}
+};
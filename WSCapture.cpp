@@ -0,0 +1,98 @@
+#include "WSCapture.h"
+#include "WSCoroutine.h"
+#include <iostream>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+bool WSCapture::open(const char* path)
+{
+	fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(fd < 0)
+	{
+		std::cerr << "CAPTURE OPEN ERROR, " << path << " " << errno << std::endl;
+		return false;
+	}
+	lastUs = wsNowUs();
+	WSCaptureHeader header;
+	std::memcpy(header.magic, WS_CAPTURE_MAGIC, sizeof(header.magic));
+	header.startUs = lastUs;
+	char* p = reserve(sizeof(header));
+	if(!p)
+	{
+		close();
+		return false;
+	}
+	std::memcpy(p, &header, sizeof(header));
+	std::cout << "CAPTURE TO " << path << std::endl;
+	return true;
+}
+
+void WSCapture::close()
+{
+	if(fd < 0)
+		return;
+	if(mapped)
+		::munmap(mapped, mapLen);
+	// 裁掉最后一段没用到的部分
+	if(::ftruncate(fd, pos) < 0)
+		std::cerr << "CAPTURE TRUNCATE ERROR, " << errno << std::endl;
+	::close(fd);
+	fd = -1;
+	mapped = nullptr;
+	mapBase = mapLen = pos = 0;
+}
+
+char* WSCapture::reserve(size_t n)
+{
+	if(pos + n > mapBase + mapLen)
+	{
+		if(mapped)
+			::munmap(mapped, mapLen);
+		mapped = nullptr;
+		size_t page = ::sysconf(_SC_PAGESIZE);
+		mapBase = pos & ~(page - 1);
+		mapLen = (pos - mapBase + n + WS_CAPTURE_SEGMENT - 1) / WS_CAPTURE_SEGMENT * WS_CAPTURE_SEGMENT;
+		if(::ftruncate(fd, mapBase + mapLen) < 0)
+		{
+			std::cerr << "CAPTURE TRUNCATE ERROR, " << errno << std::endl;
+			return nullptr;
+		}
+		void* p = ::mmap(nullptr, mapLen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, mapBase);
+		if(p == MAP_FAILED)
+		{
+			std::cerr << "CAPTURE MMAP ERROR, " << errno << std::endl;
+			return nullptr;
+		}
+		mapped = static_cast<char*>(p);
+	}
+	char* p = mapped + (pos - mapBase);
+	pos += n;
+	return p;
+}
+
+void WSCapture::record(uint8_t kind, uint32_t conn, const char* data, size_t len)
+{
+	if(fd < 0)
+		return;
+	uint64_t now = wsNowUs();
+	WSCaptureRecord rec;
+	rec.deltaUs = static_cast<uint32_t>(std::min<uint64_t>(now - lastUs, UINT32_MAX));
+	rec.conn = conn;
+	rec.len = static_cast<uint32_t>(len);
+	rec.kind = kind;
+	lastUs = now;
+
+	char* p = reserve(sizeof(rec) + len);
+	if(!p)
+	{
+		// 磁盘满等情况下停止捕获, 不影响服务
+		close();
+		return;
+	}
+	std::memcpy(p, &rec, sizeof(rec));
+	if(len)
+		std::memcpy(p + sizeof(rec), data, len);
+}
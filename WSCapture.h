@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// 流量捕获: 按到达顺序记录每个连接收到的原始字节, 供 WSReplay 在回环上重放
+// 文件格式: WSCaptureHeader, 之后是一串 WSCaptureRecord + len 字节数据, kind 为 0 表示结束
+
+#define WS_CAPTURE_MAGIC "WSCAP001"
+#define WS_CAPTURE_SEGMENT (16 * 1024 * 1024) // 每次扩展并映射的大小
+
+enum WSCaptureKind
+{
+	CAPTURE_END = 0,
+	CAPTURE_OPEN = 1,
+	CAPTURE_DATA = 2,
+	CAPTURE_CLOSE = 3,
+};
+
+struct WSCaptureHeader
+{
+	char magic[8];
+	uint64_t startUs;	// 捕获开始的时间, 只作记录
+};
+
+struct __attribute__((packed)) WSCaptureRecord
+{
+	uint32_t deltaUs;	// 距上一条记录, 超过 uint32 的空闲会被截短
+	uint32_t conn;		// 捕获内的连接序号, 从1开始
+	uint32_t len;
+	uint8_t kind;
+};
+
+// 写入方: 文件按段扩展后 mmap 写入, 不走 write 系统调用; 单线程使用
+class WSCapture
+{
+	public:
+		WSCapture() = default;
+		~WSCapture() { close(); }
+		WSCapture(const WSCapture&) = delete;
+		WSCapture& operator = (const WSCapture&) = delete;
+
+		bool open(const char* path);
+		void close();
+		bool active() const { return fd >= 0; }
+
+		uint32_t nextConn() { return ++connCount; }
+		void record(uint8_t kind, uint32_t conn, const char* data = nullptr, size_t len = 0);
+
+	private:
+		char* reserve(size_t n);
+
+		int fd = -1;
+		char* mapped = nullptr;
+		size_t mapBase = 0;	// 映射区在文件中的偏移, 页对齐
+		size_t mapLen = 0;
+		size_t pos = 0;		// 文件中的写入位置
+		uint64_t lastUs = 0;
+		uint32_t connCount = 0;
+};
@@ -0,0 +1,562 @@
+#include "WSClient.h"
+#include "WSCoroutine.h"
+#include "base64.h"
+#include "utf8.h"
+#include <iostream>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/random.h>
+
+#define CLIENT_MAX_RESPONSE 8192	// 握手回应上限
+
+static void fillRandom(void* buf, size_t len)
+{
+	char* p = static_cast<char*>(buf);
+	while(len)
+	{
+		ssize_t ret = ::getrandom(p, len, 0);
+		if(ret < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			std::cerr << "GETRANDOM ERROR, " << errno << std::endl;
+			abort();
+		}
+		p += ret;
+		len -= ret;
+	}
+}
+
+WSClient::WSClient(WSClientReactor& _reactor, const WSClientConfig& _config, uint32_t _index)
+	: reactor(_reactor), config(_config), index(_index)
+{
+	if(config.validateUtf8)
+		utf8 = std::make_unique<UTF8Validator>();
+}
+
+WSClient::~WSClient()
+{
+	if(fd >= 0)
+		::close(fd);
+}
+
+void WSClient::startConnect()
+{
+	++generation;
+	state = CLIENT_CONNECTING;
+	fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0)
+	{
+		std::cerr << "CLIENT SOCKET ERROR, " << errno << std::endl;
+		disconnect(WS_CLOSE_ABNORMAL);
+		return;
+	}
+	int one = 1;
+	::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	// connect 立即返回, 真正的 SYN 推迟到第一次写
+	if(config.fastOpen)
+		::setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one));
+
+	struct sockaddr_in addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(config.port);
+	if(::inet_pton(AF_INET, config.host.c_str(), &addr.sin_addr) != 1)
+	{
+		// 地址写错了重连也没用
+		std::cerr << "CLIENT BAD HOST " << config.host << std::endl;
+		stopped = true;
+		disconnect(WS_CLOSE_ABNORMAL);
+		return;
+	}
+	int ret = ::connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
+	if(ret < 0 && errno != EINPROGRESS)
+	{
+		std::cerr << "CLIENT CONNECT ERROR, " << strerror(errno) << std::endl;
+		disconnect(WS_CLOSE_ABNORMAL);
+		return;
+	}
+	reactor.watch(*this);
+	reactor.schedule(*this, config.connectTimeoutMs);
+	if(ret == 0)
+		handleConnected();
+}
+
+void WSClient::handleEvent(uint32_t events)
+{
+	if(state == CLIENT_CONNECTING)
+	{
+		handleConnected();
+		if(state != CLIENT_HANDSHAKING)
+			return;
+	}
+	if(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+		handleRead();
+	if(fd >= 0 && (events & EPOLLOUT))
+		handleWrite();
+}
+
+void WSClient::handleConnected()
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+	::getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+	if(err)
+	{
+		std::cerr << "CLIENT CONNECT FAIL, " << strerror(err) << std::endl;
+		disconnect(WS_CLOSE_ABNORMAL);
+		return;
+	}
+	state = CLIENT_HANDSHAKING;
+
+	// 每次连接换一个key, 回应里的accept要对得上
+	unsigned char nonce[16];
+	fillRandom(nonce, sizeof(nonce));
+	char key[base64_encoded_size(sizeof(nonce))];
+	base64_encode(nonce, sizeof(nonce), key);
+
+	wsAcceptKey(std::string_view(key, sizeof(key)), accept);
+
+	std::string request = "GET " + config.path + " HTTP/1.1\r\nHost: " + config.host + ":" + std::to_string(config.port) +
+		"\r\nConnection: Upgrade\r\nUpgrade: websocket\r\nSec-WebSocket-Version: 13\r\nSec-WebSocket-Key: " +
+		std::string(key, sizeof(key)) + "\r\n\r\n";
+	outBuffer.append(request.data(), request.size());
+	handleWrite();
+}
+
+void WSClient::handleWrite()
+{
+	while(fd >= 0 && !outBuffer.empty())
+	{
+		ssize_t ret = outBuffer.writeTo(fd);
+		if(ret < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			// fast open 没有 cookie 时先发普通 SYN, 连上后 EPOLLOUT 再写
+			if(errno != EAGAIN && errno != EINPROGRESS)
+				disconnect(WS_CLOSE_ABNORMAL);
+			return;
+		}
+		if(ret == 0)
+			return;
+	}
+}
+
+void WSClient::handleRead()
+{
+	char buff[64 * 1024];
+	uint32_t gen = generation;
+	while(fd >= 0 && gen == generation)
+	{
+		ssize_t ret = ::recv(fd, buff, sizeof(buff), 0);
+		if(ret < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN)
+				disconnect(WS_CLOSE_ABNORMAL);
+			return;
+		}
+		if(ret == 0)
+		{
+			// 没收到关闭帧就断了
+			disconnect(WS_CLOSE_ABNORMAL);
+			return;
+		}
+		inBuffer.append(buff, ret);
+		if(state == CLIENT_HANDSHAKING && !parseHandshake())
+			return;
+		if(state >= CLIENT_OPEN && !parseFrames())
+			return;
+	}
+}
+
+bool WSClient::parseHandshake()
+{
+	size_t end = inBuffer.find("\r\n\r\n");
+	if(end == WSInBuffer::npos)
+	{
+		if(inBuffer.size() <= CLIENT_MAX_RESPONSE)
+			return true;
+		end = CLIENT_MAX_RESPONSE;
+	}
+	std::string_view response(inBuffer.data(), end);
+	std::string_view status = response.substr(0, response.find("\r\n"));
+	bool ok = status.starts_with("HTTP/1.1 101") && wsFindHeader(response, "sec-websocket-accept") == std::string_view(accept, sizeof(accept));
+	if(!ok)
+	{
+		std::cerr << "CLIENT HANDSHAKE FAIL: " << status << std::endl;
+		disconnect(WS_CLOSE_ABNORMAL);
+		return false;
+	}
+	inBuffer.erase(0, end + 4);
+	state = CLIENT_OPEN;
+	attempts = 0;
+	timerToken = 0;
+	uint32_t gen = generation;
+	if(onOpen)
+		onOpen(*this);
+	return fd >= 0 && gen == generation;
+}
+
+// 整帧到齐再处理; 未分片的消息直接从接收缓冲交给回调, 不拷贝
+bool WSClient::parseFrames()
+{
+	uint32_t gen = generation;
+	size_t pos = 0;
+	while(inBuffer.size() - pos >= 2)
+	{
+		const uint8_t* p = reinterpret_cast<const uint8_t*>(inBuffer.data() + pos);
+		size_t avail = inBuffer.size() - pos;
+		bool fin = p[0] & 0x80;
+		uint8_t opcode = p[0] & 0x0F;
+		uint64_t len = p[1] & 0x7F;
+		size_t headerLen = 2;
+		if(len == 126)
+		{
+			if(avail < 4)
+				break;
+			uint16_t value;
+			std::memcpy(&value, p + 2, 2);
+			len = ntohs(value);
+			headerLen = 4;
+		}
+		else if(len == 127)
+		{
+			if(avail < 10)
+				break;
+			uint64_t value;
+			std::memcpy(&value, p + 2, 8);
+			len = ntohll(value);
+			headerLen = 10;
+		}
+
+		// 服务器发来的帧不能带掩码, 没有协商扩展时RSV必须为0
+		bool control = opcode & 0x8;
+		if((p[0] & 0x70) || (p[1] & 0x80) || (control && (!fin || len > 125 || opcode > WSOpcode::PONG)) || (!control && opcode > WSOpcode::BINARY))
+		{
+			fail(WS_CLOSE_PROTOCOL_ERROR);
+			return false;
+		}
+		if(!control && len > config.maxMessageSize - message.size())
+		{
+			fail(WS_CLOSE_MESSAGE_TOO_BIG);
+			return false;
+		}
+		if(avail - headerLen < len)
+		{
+			inBuffer.reserve(pos + headerLen + len);
+			break;
+		}
+		const char* payload = inBuffer.data() + pos + headerLen;
+		pos += headerLen + len;
+
+		if(opcode == WSOpcode::CLOSE)
+		{
+			uint16_t code = WS_CLOSE_NO_STATUS;
+			if(len == 1)
+				code = WS_CLOSE_PROTOCOL_ERROR;
+			else if(len >= 2)
+			{
+				std::memcpy(&code, payload, 2);
+				code = ntohs(code);
+			}
+			// 服务器先发的关闭, 原样回一个再断
+			if(state == CLIENT_OPEN)
+			{
+				queueFrame(WSOpcode::CLOSE, true, payload, std::min<uint64_t>(len, 2));
+				handleWrite();
+			}
+			disconnect(code);
+			return false;
+		}
+		if(opcode == WSOpcode::PING)
+		{
+			queueFrame(WSOpcode::PONG, true, payload, len);
+			continue;
+		}
+		if(opcode == WSOpcode::PONG)
+			continue;
+
+		if((opcode == WSOpcode::CONTINUE) == (msgOpcode == 0))
+		{
+			// 续帧前没有首帧, 或上一条消息还没结束又来新消息
+			fail(WS_CLOSE_PROTOCOL_ERROR);
+			return false;
+		}
+		if(opcode)
+			msgOpcode = opcode;
+		if(msgOpcode == WSOpcode::TEXT && utf8 && !(utf8->feed(payload, len) && (!fin || utf8->finish())))
+		{
+			fail(WS_CLOSE_INVALID_PAYLOAD);
+			return false;
+		}
+		if(!fin)
+		{
+			message.append(payload, len);
+			continue;
+		}
+		uint8_t msgType = msgOpcode;
+		msgOpcode = 0;
+		if(utf8)
+			utf8->reset();
+		if(message.empty())
+		{
+			if(onMessage)
+				onMessage(*this, std::string_view(payload, len), msgType);
+		}
+		else
+		{
+			message.append(payload, len);
+			if(onMessage)
+				onMessage(*this, std::string_view(message.data(), message.size()), msgType);
+			message.clear();
+		}
+		// 回调里可能断开了连接, 缓冲已清空
+		if(fd < 0 || gen != generation)
+			return false;
+	}
+	inBuffer.erase(0, pos);
+	handleWrite();
+	return fd >= 0 && gen == generation;
+}
+
+void WSClient::queueFrame(uint8_t opcode, bool fin, const char* data, size_t len)
+{
+	uint8_t maskKey[4];
+	wsMaskKey(maskKey);
+	WSFrameBuffer frame;
+	frame.encodeMasked(opcode, fin, data, len, maskKey);
+	outBuffer.push(std::move(frame));
+}
+
+bool WSClient::send(uint8_t opcode, const char* data, size_t len)
+{
+	if(state != CLIENT_OPEN)
+		return false;
+	// 队列非空说明在等可写事件, 只入队
+	bool idle = outBuffer.empty();
+	size_t fragment = config.fragmentSize ? config.fragmentSize : len;
+	size_t offset = 0;
+	do
+	{
+		size_t n = std::min(fragment, len - offset);
+		queueFrame(offset ? static_cast<uint8_t>(WSOpcode::CONTINUE) : opcode, offset + n == len, data + offset, n);
+		offset += n;
+	} while(offset < len);
+	if(idle)
+		handleWrite();
+	return true;
+}
+
+void WSClient::close(uint16_t code)
+{
+	stopped = true;
+	if(state == CLIENT_OPEN)
+	{
+		uint16_t value = htons(code);
+		queueFrame(WSOpcode::CLOSE, true, reinterpret_cast<const char*>(&value), sizeof(value));
+		state = CLIENT_CLOSING;
+		reactor.schedule(*this, config.closeTimeoutMs);
+		handleWrite();
+	}
+	else if(state != CLIENT_CLOSING)
+		disconnect(code);
+}
+
+void WSClient::handleTimeout()
+{
+	switch(state)
+	{
+		case CLIENT_IDLE:
+			if(!stopped)
+			{
+				++reconnects;
+				startConnect();
+			}
+			break;
+		case CLIENT_CONNECTING:
+		case CLIENT_HANDSHAKING:
+			std::cerr << "CLIENT CONNECT TIMEOUT " << config.host << ":" << config.port << std::endl;
+			disconnect(WS_CLOSE_ABNORMAL);
+			break;
+		case CLIENT_CLOSING:
+			disconnect(WS_CLOSE_ABNORMAL);
+			break;
+		default:
+			break;
+	}
+}
+
+void WSClient::fail(uint16_t code)
+{
+	std::cerr << "CLIENT PROTOCOL ERROR " << code << std::endl;
+	if(state == CLIENT_OPEN)
+	{
+		uint16_t value = htons(code);
+		queueFrame(WSOpcode::CLOSE, true, reinterpret_cast<const char*>(&value), sizeof(value));
+		handleWrite();
+	}
+	disconnect(code);
+}
+
+void WSClient::disconnect(uint16_t code)
+{
+	bool wasOpen = state >= CLIENT_OPEN;
+	if(fd >= 0)
+	{
+		::epoll_ctl(reactor.epfd, EPOLL_CTL_DEL, fd, nullptr);
+		::close(fd);
+		fd = -1;
+	}
+	// 下一次连接从干净的状态开始, 旧 fd 上已取出的事件按代数丢弃
+	++generation;
+	state = CLIENT_IDLE;
+	timerToken = 0;
+	inBuffer.clear();
+	while(!outBuffer.chunks.empty())
+		outBuffer.chunks.pop_front();
+	outBuffer.bytes = outBuffer.sent = 0;
+	message.clear();
+	msgOpcode = 0;
+	if(utf8)
+		utf8->reset();
+
+	if(!stopped && config.reconnect)
+	{
+		// 指数退避 + 等量抖动: 一半固定, 一半随机, 避免一批连接同时重连
+		uint64_t ceiling = std::min<uint64_t>(config.reconnectMaxMs, static_cast<uint64_t>(config.reconnectMinMs) << std::min<uint32_t>(attempts, 20));
+		++attempts;
+		reactor.schedule(*this, ceiling / 2 + reactor.random() % (ceiling / 2 + 1));
+	}
+	if(wasOpen && onClose && !removed)
+		onClose(*this, code);
+}
+
+WSClientReactor::WSClientReactor()
+{
+	epfd = ::epoll_create1(EPOLL_CLOEXEC);
+	if(epfd < 0)
+	{
+		std::cerr << "CLIENT EPOLL ERROR, " << errno << std::endl;
+		abort();
+	}
+	events.resize(WS_CLIENT_MAXEVENTS);
+	fillRandom(&seed, sizeof(seed));
+	seed |= 1;
+}
+
+WSClientReactor::~WSClientReactor()
+{
+	clients.clear();
+	::close(epfd);
+}
+
+WSClient* WSClientReactor::connect(const WSClientConfig& config)
+{
+	uint32_t index = clients.size();
+	if(!freeSlots.empty())
+	{
+		index = freeSlots.back();
+		freeSlots.pop_back();
+	}
+	else
+		clients.emplace_back();
+	WSClient* client = new WSClient(*this, config, index);
+	clients[index].reset(client);
+	client->startConnect();
+	return client;
+}
+
+void WSClientReactor::remove(WSClient* client)
+{
+	if(client->removed)
+		return;
+	client->removed = true;
+	client->stopped = true;
+	client->disconnect(WS_CLOSE_NORMAL);
+	removed.push_back(client->index);
+}
+
+// 回调可能还在栈上, 连接对象等本轮事件和定时器处理完再释放; 留在堆里的定时器按 token 丢弃
+void WSClientReactor::releaseRemoved()
+{
+	for(uint32_t index : removed)
+	{
+		clients[index].reset();
+		freeSlots.push_back(index);
+	}
+	removed.clear();
+}
+
+void WSClientReactor::watch(WSClient& client)
+{
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.u64 = client.index | static_cast<uint64_t>(client.generation) << 32;
+	if(::epoll_ctl(epfd, EPOLL_CTL_ADD, client.fd, &ev) < 0)
+		std::cerr << "CLIENT EPOLL ADD ERROR, " << errno << std::endl;
+}
+
+void WSClientReactor::schedule(WSClient& client, uint64_t delayMs)
+{
+	client.timerToken = ++nextToken;
+	timers.push({wsNowMs() + delayMs, client.timerToken, client.index});
+}
+
+uint64_t WSClientReactor::random()
+{
+	// xorshift64, 只用于抖动
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return seed;
+}
+
+int WSClientReactor::nextTimeout(int limit) const
+{
+	if(timers.empty())
+		return limit;
+	uint64_t now = wsNowMs();
+	uint64_t deadline = timers.top().deadline;
+	return deadline <= now ? 0 : static_cast<int>(std::min<uint64_t>(deadline - now, limit));
+}
+
+void WSClientReactor::poll(int timeoutMs)
+{
+	int count = ::epoll_wait(epfd, events.data(), events.size(), timeoutMs);
+	if(count < 0 && errno != EINTR)
+		std::cerr << "CLIENT EPOLL WAIT ERROR, " << errno << std::endl;
+	for(int i = 0; i < count; ++i)
+	{
+		uint32_t index = static_cast<uint32_t>(events[i].data.u64);
+		uint32_t generation = static_cast<uint32_t>(events[i].data.u64 >> 32);
+		WSClient* client = clients[index].get();
+		if(!client || client->generation != generation || client->fd < 0)
+			continue;
+		client->handleEvent(events[i].events);
+	}
+	handleTimers();
+	releaseRemoved();
+}
+
+void WSClientReactor::handleTimers()
+{
+	uint64_t now = wsNowMs();
+	while(!timers.empty() && timers.top().deadline <= now)
+	{
+		Timer timer = timers.top();
+		timers.pop();
+		// 已被取消或重新设置过的定时器直接丢弃, 槽位换了连接也一样, token 不会重复
+		WSClient* client = clients[timer.index].get();
+		if(!client || client->timerToken != timer.token)
+			continue;
+		client->timerToken = 0;
+		client->handleTimeout();
+	}
+}
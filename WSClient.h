@@ -0,0 +1,162 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <queue>
+#include <functional>
+#include <sys/epoll.h>
+#include "WSBuffer.h"
+#include "WSProtocol.h"
+
+// 客户端库: 一个 WSClientReactor 用一个 epoll 管理本线程的大量上游连接,
+// 非阻塞连接, 握手校验 Sec-WebSocket-Accept, 发出的帧都加掩码, 断线后按带抖动的指数退避重连.
+// reactor 可以单独 poll, 也可以把 fd() 加进外层 epoll, 可读时调用 poll(0).
+//   WSClientReactor reactor;
+//   WSClient* ws = reactor.connect(config);
+//   ws->onMessage = [](WSClient& ws, std::string_view msg, uint8_t opcode) { ... };
+//   while(true) reactor.poll(reactor.nextTimeout(1000));
+//   reactor.remove(ws); // 不用时释放, 槽位留给之后的 connect
+
+#define WS_CLIENT_MAXEVENTS 256
+
+struct WSClientConfig
+{
+	std::string host = "127.0.0.1"; // 只接受IPv4地址, 不做会阻塞的域名解析
+	unsigned short port = 8500;
+	std::string path = "/ws";
+	bool reconnect = true;
+	uint32_t reconnectMinMs = 100;
+	uint32_t reconnectMaxMs = 30 * 1000;
+	uint32_t connectTimeoutMs = 5000;	// 连接加握手
+	uint32_t closeTimeoutMs = 1000;		// 发出关闭帧后等服务器回应
+	size_t maxMessageSize = 16 * 1024 * 1024;
+	size_t fragmentSize = 64 * 1024;	// 发送分片大小
+	bool validateUtf8 = true;
+	bool fastOpen = false;	// TCP_FASTOPEN_CONNECT: 有 cookie 时握手请求随 SYN 发出, 重连省一个往返
+};
+
+enum WSClientState
+{
+	CLIENT_IDLE = 0,		// 等待重连或已关闭
+	CLIENT_CONNECTING = 1,
+	CLIENT_HANDSHAKING = 2,
+	CLIENT_OPEN = 3,
+	CLIENT_CLOSING = 4,	// 已发关闭帧
+};
+
+class WSClientReactor;
+struct UTF8Validator;
+
+class WSClient
+{
+	public:
+		~WSClient();
+
+		std::function<void(WSClient& ws)> onOpen;
+		std::function<void(WSClient& ws, std::string_view msg, uint8_t opcode)> onMessage;
+		std::function<void(WSClient& ws, uint16_t code)> onClose; // 每次断开都通知, 之后可能自动重连
+
+		// 未连上时返回 false, 不缓存
+		bool send(uint8_t opcode, const char* data, size_t len);
+		bool text(std::string_view msg) { return send(WSOpcode::TEXT, msg.data(), msg.size()); }
+		bool binary(std::string_view msg) { return send(WSOpcode::BINARY, msg.data(), msg.size()); }
+
+		// 主动关闭, 不再重连
+		void close(uint16_t code = WS_CLOSE_NORMAL);
+
+		WSClientState getState() const { return state; }
+		bool isOpen() const { return state == CLIENT_OPEN; }
+		const WSClientConfig& getConfig() const { return config; }
+		uint32_t getReconnects() const { return reconnects; }
+
+	private:
+		friend class WSClientReactor;
+
+		WSClient(WSClientReactor& _reactor, const WSClientConfig& _config, uint32_t _index);
+
+		void startConnect();
+		void handleEvent(uint32_t events);
+		void handleConnected();
+		void handleRead();
+		void handleWrite();
+		void handleTimeout();
+		bool parseHandshake();
+		bool parseFrames();
+		void queueFrame(uint8_t opcode, bool fin, const char* data, size_t len);
+		void fail(uint16_t code);
+		void disconnect(uint16_t code);
+
+		WSClientReactor& reactor;
+		WSClientConfig config;
+		uint32_t index;
+		uint32_t generation = 0;	// 每次重连加一, 丢掉旧 fd 的事件
+		int fd = -1;
+		WSClientState state = CLIENT_IDLE;
+		bool stopped = false;	// 用户关闭后不再重连
+		bool removed = false;	// 已从 reactor 移除, 等本轮 poll 结束释放, 不再回调
+		uint32_t attempts = 0;	// 连续失败次数, 决定退避时间
+		uint32_t reconnects = 0;
+		uint64_t timerToken = 0;
+
+		char accept[WS_ACCEPT_LEN];	// 期望的 Sec-WebSocket-Accept
+		WSInBuffer inBuffer;
+		WSOutQueue outBuffer;
+		WSFrameBuffer message;	// 收到一半的消息
+		uint8_t msgOpcode = 0;
+		std::unique_ptr<UTF8Validator> utf8;
+};
+
+class WSClientReactor
+{
+	public:
+		WSClientReactor();
+		~WSClientReactor();
+		WSClientReactor(const WSClientReactor&) = delete;
+		WSClientReactor& operator = (const WSClientReactor&) = delete;
+
+		// 创建连接并立即开始连接, 连接对象归 reactor 所有
+		WSClient* connect(const WSClientConfig& config);
+
+		// 断开并释放连接, 不再回调; 可以在回调里调用, 对象到本轮 poll 结束才释放
+		void remove(WSClient* client);
+
+		int fd() const { return epfd; }
+		size_t size() const { return clients.size() - freeSlots.size() - removed.size(); }
+
+		// 距最近定时器的毫秒数, 没有定时器返回 limit
+		int nextTimeout(int limit) const;
+
+		// 处理就绪事件和到期定时器, timeoutMs 为等待上限
+		void poll(int timeoutMs);
+
+	private:
+		friend class WSClient;
+
+		struct Timer
+		{
+			uint64_t deadline;
+			uint64_t token;
+			uint32_t index;
+
+			bool operator > (const Timer& other) const { return deadline > other.deadline; }
+		};
+
+		void watch(WSClient& client);
+		void schedule(WSClient& client, uint64_t delayMs);
+		void handleTimers();
+		void releaseRemoved();
+		uint64_t random();
+
+		int epfd = -1;
+		std::vector<std::unique_ptr<WSClient>> clients;	// 下标即 epoll/定时器里的 index, 释放后为空
+		std::vector<uint32_t> freeSlots;
+		std::vector<uint32_t> removed;	// 等本轮 poll 结束释放
+		std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+		uint64_t nextToken = 0;
+		uint64_t seed;
+		std::vector<struct epoll_event> events;
+};
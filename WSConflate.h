@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <unordered_map>
+#include "WSBuffer.h"
+
+// 按键合并的待发消息: 同一键还没发出的旧消息被新消息原地替换, 保留最早入队的位置, 各键轮流发出.
+// 消费者跟不上时积压按键数封顶, 不随消息速率增长; 只在发送队列有空间时才取出, 取出后不再合并
+class WSConflator
+{
+	public:
+		bool empty() const { return entries.empty(); }
+		size_t size() const { return entries.size(); }
+
+		// 返回 true 表示替换了同一键未发出的旧消息, replacedSize 为被替换消息的字节数
+		bool push(uint64_t key, uint8_t opcode, WSFrameBuffer&& data, size_t& replacedSize)
+		{
+			auto iter = index.find(key);
+			if(iter != index.end())
+			{
+				Entry& entry = entries[iter->second - headSeq];
+				replacedSize = entry.data.size();
+				entry.opcode = opcode;
+				entry.data = std::move(data);
+				return true;
+			}
+			index.emplace(key, headSeq + entries.size());
+			Entry& entry = entries.emplace_back();
+			entry.key = key;
+			entry.opcode = opcode;
+			entry.data = std::move(data);
+			return false;
+		}
+
+		// 取出最早入队的键的最新消息
+		void pop(uint8_t& opcode, WSFrameBuffer& data)
+		{
+			Entry& entry = entries.front();
+			opcode = entry.opcode;
+			data = std::move(entry.data);
+			index.erase(entry.key);
+			entries.pop_front();
+			++headSeq;
+		}
+
+	private:
+		struct Entry
+		{
+			uint64_t key = 0;
+			uint8_t opcode = 0;
+			WSFrameBuffer data;
+		};
+
+		WSRing<Entry> entries;
+		std::unordered_map<uint64_t, uint64_t> index; // 键 -> 入队序号
+		uint64_t headSeq = 0; // 队首的入队序号
+};
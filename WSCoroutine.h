@@ -0,0 +1,226 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <algorithm>
+#include <functional>
+#include <coroutine>
+#include <chrono>
+#include <queue>
+#include <vector>
+#include <string_view>
+#include "WSBuffer.h"
+
+struct WSSocket;
+
+#define WS_FRAME_CLASS 64	// 协程帧按64字节分级
+#define WS_FRAME_CLASSES 32	// 2KB以上直接走 operator new
+#define WS_FRAME_SLAB (64 * 1024)
+
+// 协程帧池: 每个reactor一个, 单线程使用, 释放的帧挂回对应级别的空闲链表
+class WSFramePool
+{
+	public:
+		WSFramePool() = default;
+		~WSFramePool()
+		{
+			for(void* slab : slabs)
+				::free(slab);
+		}
+		WSFramePool(const WSFramePool&) = delete;
+		WSFramePool& operator = (const WSFramePool&) = delete;
+
+		void* alloc(size_t n)
+		{
+			size_t index = (n + WS_FRAME_CLASS - 1) / WS_FRAME_CLASS;
+			if(index >= WS_FRAME_CLASSES)
+				return ::operator new(n);
+			if(!freeList[index])
+				refill(index);
+			FreeNode* node = freeList[index];
+			freeList[index] = node->next;
+			return node;
+		}
+
+		void free(void* p, size_t n)
+		{
+			size_t index = (n + WS_FRAME_CLASS - 1) / WS_FRAME_CLASS;
+			if(index >= WS_FRAME_CLASSES)
+			{
+				::operator delete(p);
+				return;
+			}
+			FreeNode* node = static_cast<FreeNode*>(p);
+			node->next = freeList[index];
+			freeList[index] = node;
+		}
+
+	private:
+		struct FreeNode { FreeNode* next; };
+
+		void refill(size_t index)
+		{
+			size_t size = index * WS_FRAME_CLASS;
+			char* slab = static_cast<char*>(::malloc(WS_FRAME_SLAB));
+			if(!slab)
+				abort();
+			slabs.push_back(slab);
+			for(size_t offset = 0; offset + size <= WS_FRAME_SLAB; offset += size)
+				free(slab + offset, size);
+		}
+
+		FreeNode* freeList[WS_FRAME_CLASSES] = {};
+		std::vector<void*> slabs;
+};
+
+inline uint64_t wsNowMs()
+{
+	using namespace std::chrono;
+	return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+inline uint64_t wsNowUs()
+{
+	using namespace std::chrono;
+	return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// 定时器按 token 惰性取消: 到期时连接已关闭或已被其他事件唤醒则丢弃
+struct WSTimer
+{
+	uint64_t deadline;
+	uint64_t token;
+	int fd;
+
+	bool operator > (const WSTimer& other) const { return deadline > other.deadline; }
+};
+
+// reactor 的协程运行环境, 由 TCPServer 持有并设为当前线程的 wsReactor
+struct WSReactorContext
+{
+	WSFramePool framePool;
+	std::priority_queue<WSTimer, std::vector<WSTimer>, std::greater<WSTimer>> timers;
+	uint64_t nextToken = 0;
+
+	// 距最近定时器的毫秒数, 没有定时器返回 limit
+	int nextTimeout(int limit) const
+	{
+		if(timers.empty())
+			return limit;
+		uint64_t now = wsNowMs();
+		uint64_t deadline = timers.top().deadline;
+		return deadline <= now ? 0 : static_cast<int>(std::min<uint64_t>(deadline - now, limit));
+	}
+};
+
+inline thread_local WSReactorContext* wsReactor = nullptr;
+
+// 连接协程, 创建后挂起, 由 WSSocket 启动和持有; 连接关闭时在挂起点销毁帧
+class WSTask
+{
+	public:
+		struct promise_type
+		{
+			WSTask get_return_object() { return WSTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+			std::suspend_always initial_suspend() noexcept { return {}; }
+			std::suspend_always final_suspend() noexcept { return {}; }
+			void return_void() {}
+			void unhandled_exception() { abort(); }
+
+			static void* operator new(size_t n) { return wsReactor ? wsReactor->framePool.alloc(n) : ::operator new(n); }
+			static void operator delete(void* p, size_t n)
+			{
+				if(wsReactor)
+					wsReactor->framePool.free(p, n);
+				else
+					::operator delete(p);
+			}
+		};
+
+		WSTask() = default;
+		explicit WSTask(std::coroutine_handle<promise_type> h) : handle(h) {}
+		~WSTask() { reset(); }
+		WSTask(WSTask&& other) noexcept : handle(other.handle) { other.handle = nullptr; }
+		WSTask& operator = (WSTask&& other) noexcept
+		{
+			if(this != &other)
+			{
+				reset();
+				handle = other.handle;
+				other.handle = nullptr;
+			}
+			return *this;
+		}
+		WSTask(const WSTask&) = delete;
+		WSTask& operator = (const WSTask&) = delete;
+
+		explicit operator bool () const { return static_cast<bool>(handle); }
+		bool done() const { return handle && handle.done(); }
+		void resume() { handle.resume(); }
+
+		void reset()
+		{
+			if(handle)
+				handle.destroy();
+			handle = nullptr;
+		}
+
+	private:
+		std::coroutine_handle<promise_type> handle;
+};
+
+struct WSMessage
+{
+	std::string_view data; // 有效期到下一次 recv
+	uint8_t opcode;
+};
+
+enum WSWait
+{
+	WAIT_NONE = 0,
+	WAIT_RECV = 1,
+	WAIT_SEND = 2,	// 等outBuffer降到低水位
+	WAIT_SLEEP = 3,
+};
+
+struct WSRecvAwaiter
+{
+	WSSocket& ws;
+	bool await_ready();
+	void await_suspend(std::coroutine_handle<> h);
+	WSMessage await_resume();
+};
+
+struct WSSendAwaiter
+{
+	WSSocket& ws;
+	bool await_ready();
+	void await_suspend(std::coroutine_handle<> h);
+	void await_resume() {}
+};
+
+struct WSSleepAwaiter
+{
+	WSSocket& ws;
+	uint64_t ms;
+	bool await_ready() { return ms == 0 || !wsReactor; }
+	void await_suspend(std::coroutine_handle<> h);
+	void await_resume() {}
+};
+
+// 协程里使用的连接句柄, 处理器定义 static WSTask run(WSConn ws) 即以协程方式运行:
+//   auto msg = co_await ws.recv();
+//   co_await ws.send(msg.opcode, msg.data);
+//   co_await ws.sleep(100);
+// 协程不在 recv 上等待时不解析后续帧, 输入积压在inBuffer里
+struct WSConn
+{
+	WSSocket* socket;
+
+	WSRecvAwaiter recv() { return {*socket}; }
+	WSSendAwaiter send(uint8_t opcode, std::string_view msg, WSPriority priority = WS_PRIO_AUTO);
+	WSSleepAwaiter sleep(uint64_t ms) { return {*socket, ms}; }
+	void close(uint16_t code);
+};
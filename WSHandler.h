@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string_view>
+#include <span>
+#include <type_traits>
+#include "WSBuffer.h"
+#include "WSBatch.h"
+#include "WSCoroutine.h"
+
+struct WSSocket;
+
+// 回应构造器, 直接写进连接的发送队列
+class WSReply
+{
+	public:
+		WSReply(WSSocket& _ws, WSOutQueue& _out) : ws(_ws), out(_out) {}
+
+		// 小消息在没有排队消息时合并写入outBuffer尾部, 不单独分配
+		void send(uint8_t opcode, const char* data, size_t len, WSPriority priority = WS_PRIO_AUTO);
+		void text(std::string_view msg, WSPriority priority = WS_PRIO_AUTO) { send(0x1, msg.data(), msg.size(), priority); }
+		void binary(std::string_view msg, WSPriority priority = WS_PRIO_AUTO) { send(0x2, msg.data(), msg.size(), priority); }
+
+		// 已填好负载的缓冲, 帧头写在其headroom, 零拷贝
+		void send(uint8_t opcode, WSFrameBuffer&& msg, WSPriority priority = WS_PRIO_AUTO);
+
+		// memfd里的大消息, 帧头之后的负载用 sendfile 发出
+		void send(uint8_t opcode, WSSpill&& file, WSPriority priority = WS_PRIO_AUTO);
+
+		// 按键合并: 同一键还没发出的旧消息直接被替换, 如行情只需每个品种的最新价
+		void conflate(uint64_t key, uint8_t opcode, const char* data, size_t len);
+
+		// 原样回发当前消息, 接管接收缓冲或memfd, 不拷贝
+		void echo();
+
+		void close(uint16_t code);
+
+	private:
+		WSSocket& ws;
+		WSOutQueue& out;
+};
+
+// 处理器是只含静态函数的类型, 回调均可省略:
+//   static void onOpen(WSSocket& ws, WSReply& reply);
+//   static void onMessage(WSSocket& ws, std::string_view msg, uint8_t opcode, WSReply& reply);
+//   static void onClose(WSSocket& ws, uint16_t code);
+//   static WSTask run(WSConn ws); // 协程方式, 有 run 时不再调用 onMessage
+// 路由表只记下标, 分派时按下标展开成直接调用, 没有虚函数
+template <typename... Handlers>
+struct WSHandlerList
+{
+	static_assert(sizeof...(Handlers) < 256);
+
+	template <typename H>
+	static constexpr uint8_t id()
+	{
+		uint8_t index = 0, found = 0xFF;
+		((std::is_same_v<H, Handlers> ? (found = index, ++index) : ++index), ...);
+		if(found == 0xFF)
+			throw "handler not in list";
+		return found;
+	}
+
+	template <typename F>
+	static void dispatch(uint8_t id, F&& func)
+	{
+		uint8_t index = 0;
+		((index++ == id ? (func(static_cast<Handlers*>(nullptr)), true) : false) || ...);
+	}
+};
+
+struct EchoHandler
+{
+	static void onMessage(WSSocket&, std::string_view, uint8_t, WSReply& reply) { reply.echo(); }
+};
+
+// 协程示例: 收到 "毫秒数 负载" 后睡那么久再回发负载, 睡眠中不读下一条, 回应和请求同序;
+// 毫秒数超过 WS_DELAY_MAX_MS 或格式不对按策略关闭. 睡眠中连接关闭时协程帧在挂起点销毁, 定时器到期按 token 丢弃
+#define WS_DELAY_MAX_MS 10000
+
+struct DelayHandler
+{
+	static WSTask run(WSConn ws);
+};
+
+// 批量示例: 每条消息回 "本批条数:消息", 一批里按到达顺序回应; 连接在轮末前关闭的消息不会交到这里
+struct BatchEchoHandler
+{
+	static void onBatch(std::span<WSBatchItem> items);
+};
+
+// 跨节点发布订阅, 文本命令: "SUB 主题", "UNSUB 主题", "PUB 主题 负载", 订阅者收到负载本身.
+// 主题由 wsRelay 转给其他节点, 没有配置 relay 时只在本节点内
+struct PubSubHandler
+{
+	static void onMessage(WSSocket& ws, std::string_view msg, uint8_t opcode, WSReply& reply);
+};
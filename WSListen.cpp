@@ -0,0 +1,128 @@
+#include "WSListen.h"
+#include <iostream>
+#include <string>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+
+bool WSListenConfig::parse(std::string_view options)
+{
+	while(!options.empty())
+	{
+		size_t comma = options.find(',');
+		std::string_view item = options.substr(0, comma);
+		options.remove_prefix(comma == std::string_view::npos ? options.size() : comma + 1);
+		if(item.empty())
+			continue;
+		size_t eq = item.find('=');
+		std::string_view key = item.substr(0, eq);
+		int value = eq == std::string_view::npos ? 1 : std::atoi(std::string(item.substr(eq + 1)).c_str());
+		if(key == "backlog")
+			backlog = value;
+		else if(key == "defer")
+			deferAcceptSec = value;
+		else if(key == "fastopen")
+			fastOpenQueue = value;
+		else if(key == "reuseport")
+			reusePort = value;
+		else if(key == "steer")
+			steerCpu = value;
+		else if(key == "cpu")
+			cpu = value;
+		else
+		{
+			std::cerr << "UNKNOWN LISTEN OPTION " << item << std::endl;
+			return false;
+		}
+	}
+	if(steerCpu && !reusePort)
+	{
+		std::cerr << "LISTEN OPTION steer NEEDS reuseport" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// 返回收包的 CPU 号作为 reuseport 组内下标
+static bool attachCpuSteering(int fd)
+{
+	struct sock_filter code[] =
+	{
+		{BPF_LD | BPF_W | BPF_ABS, 0, 0, static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU)},
+		{BPF_RET | BPF_A, 0, 0, 0},
+	};
+	struct sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+	return ::setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0;
+}
+
+int wsListen(unsigned short port, const WSListenConfig& config)
+{
+	int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	if(fd < 0)
+	{
+		std::cerr << "SOCKET FAIL" << std::endl;
+		return -1;
+	}
+	socklen_t size = 64 * 1024;
+	::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	::setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	int one = 1;
+	::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if(config.reusePort && ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+	{
+		std::cerr << "SO_REUSEPORT FAIL, " << strerror(errno) << std::endl;
+		::close(fd);
+		return -1;
+	}
+
+	struct sockaddr_in addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if(::bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0)
+	{
+		std::cerr << "BIND FAIL, " << strerror(errno) << std::endl;
+		::close(fd);
+		return -1;
+	}
+
+	// 下面几项失败只是少了优化, 不影响服务
+	if(config.deferAcceptSec > 0 && ::setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &config.deferAcceptSec, sizeof(int)) < 0)
+		std::cerr << "TCP_DEFER_ACCEPT FAIL, " << strerror(errno) << std::endl;
+	if(config.fastOpenQueue > 0 && ::setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &config.fastOpenQueue, sizeof(int)) < 0)
+		std::cerr << "TCP_FASTOPEN FAIL, " << strerror(errno) << std::endl;
+
+	if(::listen(fd, config.backlog) < 0)
+	{
+		std::cerr << "LISTEN FAIL, " << strerror(errno) << std::endl;
+		::close(fd);
+		return -1;
+	}
+	// listen 之后才加入 reuseport 组, 之前附加会自成一组, 组内后来的 listen 就冲突了; 程序对整组生效, 重复附加只是替换
+	if(config.steerCpu && !attachCpuSteering(fd))
+		std::cerr << "SO_ATTACH_REUSEPORT_CBPF FAIL, " << strerror(errno) << std::endl;
+	return fd;
+}
+
+bool wsPinCpu(const WSListenConfig& config)
+{
+	if(config.cpu < 0)
+		return true;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(config.cpu, &set);
+	if(::sched_setaffinity(0, sizeof(set), &set) < 0)
+	{
+		std::cerr << "PIN CPU " << config.cpu << " FAIL, " << strerror(errno) << std::endl;
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string_view>
+
+// 监听socket的调优选项, 命令行写成逗号分隔的一串, 如 "defer=1,fastopen=256,reuseport,steer,cpu=0"
+//   backlog=N    listen 队列长度
+//   defer=秒     TCP_DEFER_ACCEPT: 客户端发来握手数据才唤醒 accept, 空连接不占事件循环; 超时后照常交付
+//   fastopen=N   TCP_FASTOPEN: 带 cookie 重连的客户端在 SYN 里带上握手请求, 省一个往返; N 为未完成队列长度,
+//                需要 net.ipv4.tcp_fastopen 打开服务端位(2)
+//   reuseport    SO_REUSEPORT: 同机多个进程监听同一端口, 内核分发新连接
+//   steer        附加 CBPF 程序, 按收到连接的 CPU 号选组内第几个 socket, 连接落在处理网卡中断的同一个CPU上;
+//                要求第 i 个绑定的进程钉在 CPU i 上 (cpu=i), CPU 号超出组大小时内核退回按哈希分发
+//   cpu=N        把进程钉在 CPU N 上
+struct WSListenConfig
+{
+	int backlog = 4096;
+	int deferAcceptSec = 0;
+	int fastOpenQueue = 0;
+	bool reusePort = false;
+	bool steerCpu = false;
+	int cpu = -1;
+
+	// 有不认识的选项返回 false
+	bool parse(std::string_view options);
+};
+
+// 建好非阻塞的监听socket并 listen, 失败返回 -1
+int wsListen(unsigned short port, const WSListenConfig& config);
+
+// 按 config.cpu 钉住当前线程, 没配置时什么都不做
+bool wsPinCpu(const WSListenConfig& config);
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <atomic>
+#include <iostream>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "WSBuffer.h"
+
+// 连接句柄: 低24位槽位, 接着8位 reactor 编号, 高32位槽位代数.
+// fd 关闭后马上会被新连接复用, 句柄不会: 槽位释放时代数加一, 旧句柄从此对不上
+using WSConnHandle = uint64_t;
+
+#define WS_MAX_REACTORS 256
+#define WS_MAX_SLOTS (1u << 24)
+
+constexpr WSConnHandle wsMakeHandle(uint32_t reactor, uint32_t slot, uint32_t generation)
+{
+	return static_cast<uint64_t>(generation) << 32 | reactor << 24 | slot;
+}
+
+constexpr uint32_t wsHandleSlot(WSConnHandle handle) { return handle & (WS_MAX_SLOTS - 1); }
+constexpr uint32_t wsHandleReactor(WSConnHandle handle) { return (handle >> 24) & 0xFF; }
+constexpr uint32_t wsHandleGeneration(WSConnHandle handle) { return handle >> 32; }
+
+// 其他线程投递的消息, 负载在投递线程的slab上分配, reactor 发完后跨线程归还
+struct WSPost
+{
+	WSPost* next = nullptr;
+	WSConnHandle handle = 0;
+	uint8_t opcode = 0;
+	WSPriority priority = WS_PRIO_AUTO;
+	bool conflate = false; // 按 key 合并, 见 WSConflator
+	uint64_t key = 0;
+	WSFrameBuffer data;
+};
+
+// 多生产者单消费者: 生产者CAS压栈, reactor 一次取走整条链再反转回投递顺序.
+// 只有栈由空变非空时写 eventfd, 突发投递只唤醒 reactor 一次
+class WSPostQueue
+{
+	public:
+		WSPostQueue()
+		{
+			efd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if(efd < 0)
+			{
+				std::cerr << "EVENTFD ERROR, " << errno << std::endl;
+				abort();
+			}
+		}
+		~WSPostQueue()
+		{
+			for(WSPost* post = drain(); post; )
+			{
+				WSPost* next = post->next;
+				delete post;
+				post = next;
+			}
+			::close(efd);
+		}
+		WSPostQueue(const WSPostQueue&) = delete;
+		WSPostQueue& operator = (const WSPostQueue&) = delete;
+
+		// 加进 reactor 的 epoll, 可读表示有投递
+		int fd() const { return efd; }
+
+		void push(WSPost* post)
+		{
+			WSPost* old = head.load(std::memory_order_relaxed);
+			do
+			{
+				post->next = old;
+			} while(!head.compare_exchange_weak(old, post, std::memory_order_release, std::memory_order_relaxed));
+			if(!old)
+			{
+				uint64_t one = 1;
+				while(::write(efd, &one, sizeof(one)) < 0 && errno == EINTR);
+			}
+		}
+
+		// 只在 reactor 线程调用; 先清 eventfd 再取链, 之后的投递会重新唤醒
+		WSPost* drain()
+		{
+			uint64_t count;
+			while(::read(efd, &count, sizeof(count)) < 0 && errno == EINTR);
+			WSPost* list = head.exchange(nullptr, std::memory_order_acquire);
+			WSPost* ordered = nullptr;
+			while(list)
+			{
+				WSPost* next = list->next;
+				list->next = ordered;
+				ordered = list;
+				list = next;
+			}
+			return ordered;
+		}
+
+	private:
+		std::atomic<WSPost*> head{nullptr};
+		int efd = -1;
+};
+
+// reactor 启动时登记, 退出前注销; 投递线程须在 reactor 退出前停止投递
+inline std::atomic<WSPostQueue*> wsPostQueues[WS_MAX_REACTORS] = {};
+
+// 任意线程调用. 只保证投递到所属 reactor, 连接已关闭或句柄过期时消息在 reactor 上丢弃
+inline bool wsSend(WSConnHandle handle, uint8_t opcode, WSFrameBuffer&& msg, WSPriority priority = WS_PRIO_AUTO)
+{
+	WSPostQueue* queue = wsPostQueues[wsHandleReactor(handle)].load(std::memory_order_acquire);
+	if(!queue || !wsHandleGeneration(handle))
+		return false;
+	WSPost* post = new WSPost;
+	post->handle = handle;
+	post->opcode = opcode;
+	post->priority = priority;
+	post->data = std::move(msg);
+	queue->push(post);
+	return true;
+}
+
+inline bool wsSend(WSConnHandle handle, uint8_t opcode, const char* data, size_t len, WSPriority priority = WS_PRIO_AUTO)
+{
+	return wsSend(handle, opcode, WSFrameBuffer(data, len), priority);
+}
+
+// 同 wsSend, 但同一连接上同一 key 还没发出的旧消息会被替换
+inline bool wsConflate(WSConnHandle handle, uint64_t key, uint8_t opcode, const char* data, size_t len)
+{
+	WSPostQueue* queue = wsPostQueues[wsHandleReactor(handle)].load(std::memory_order_acquire);
+	if(!queue || !wsHandleGeneration(handle))
+		return false;
+	WSPost* post = new WSPost;
+	post->handle = handle;
+	post->opcode = opcode;
+	post->conflate = true;
+	post->key = key;
+	post->data.append(data, len);
+	queue->push(post);
+	return true;
+}
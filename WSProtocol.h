@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <strings.h>
+#include "sha1.h"
+#include "base64.h"
+
+// 服务端和客户端共用的协议常量 (RFC 6455)
+
+#define WS_KEY "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_MAX_KEY_LEN 64
+#define WS_ACCEPT_LEN 28 // base64(20字节SHA-1)
+
+#define WS_CLOSE_NORMAL 1000
+#define WS_CLOSE_PROTOCOL_ERROR 1002
+#define WS_CLOSE_NO_STATUS 1005
+#define WS_CLOSE_ABNORMAL 1006
+#define WS_CLOSE_INVALID_PAYLOAD 1007
+#define WS_CLOSE_POLICY_VIOLATION 1008
+#define WS_CLOSE_MESSAGE_TOO_BIG 1009
+#define WS_CLOSE_INTERNAL_ERROR 1011
+
+enum WSOpcode
+{
+	CONTINUE = 0x0,
+	TEXT = 0x1,
+	BINARY = 0x2,
+	CLOSE = 0x8,
+	PING = 0x9,
+	PONG = 0xA
+};
+
+// Sec-WebSocket-Accept = base64(sha1(key + WS_KEY)), 全程在栈上
+inline bool wsAcceptKey(std::string_view key, char* accept)
+{
+	char message[WS_MAX_KEY_LEN + sizeof(WS_KEY) - 1];
+	if(key.empty() || key.size() > WS_MAX_KEY_LEN)
+		return false;
+	std::memcpy(message, key.data(), key.size());
+	std::memcpy(message + key.size(), WS_KEY, sizeof(WS_KEY) - 1);
+
+	unsigned char digest[20];
+	sha1_digest(message, key.size() + sizeof(WS_KEY) - 1, digest);
+	base64_encode(digest, sizeof(digest), accept);
+	return true;
+}
+
+// 握手回应里找指定头的值, name 为小写; 第一行是状态行, 不参与匹配
+inline std::string_view wsFindHeader(std::string_view response, const char* name)
+{
+	size_t nameLen = strlen(name);
+	size_t pos = response.find("\r\n");
+	while(pos != std::string_view::npos)
+	{
+		pos += 2;
+		size_t end = response.find("\r\n", pos);
+		std::string_view line = response.substr(pos, end == std::string_view::npos ? std::string_view::npos : end - pos);
+		if(line.size() > nameLen && line[nameLen] == ':' && strncasecmp(line.data(), name, nameLen) == 0)
+		{
+			line.remove_prefix(nameLen + 1);
+			while(!line.empty() && (line.front() == ' ' || line.front() == '\t'))
+				line.remove_prefix(1);
+			while(!line.empty() && (line.back() == ' ' || line.back() == '\t'))
+				line.remove_suffix(1);
+			return line;
+		}
+		pos = end;
+	}
+	return std::string_view();
+}
@@ -0,0 +1,786 @@
+#include "WSRelay.h"
+#include "WSCoroutine.h"
+#include <iostream>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/random.h>
+
+#define RELAY_LISTEN_TAG UINT64_MAX	// epoll data, 其余为链路下标
+#define RELAY_LOCAL_LISTEN_TAG (UINT64_MAX - 1)
+#define RELAY_WAKE_FLAG (1ull << 32)	// 链路下标带此位表示共享内存通道的 eventfd
+// 一批在超过 RELAY_MAX_BATCH 的那条记录处结束, 再大视为协议错误; HELLO 之前对端只该发一条 HELLO
+#define RELAY_MAX_FRAME (RELAY_MAX_BATCH + sizeof(WSRelayRecord) + RELAY_MAX_TOPIC + RELAY_MAX_MESSAGE)
+#define RELAY_MAX_HELLO (sizeof(WSRelayRecord) + sizeof(uint64_t) + RELAY_MAX_SECRET)
+
+// 同机节点用抽象 unix socket, 不留文件, 端口号和 TCP 监听的相同
+static socklen_t localAddress(unsigned short port, struct sockaddr_un& addr)
+{
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	int len = std::snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, "wsrelay.%u", port);
+	return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+// 比较耗时不随第一个不同字节的位置变化
+static bool sameSecret(std::string_view a, std::string_view b)
+{
+	if(a.size() != b.size())
+		return false;
+	unsigned char diff = 0;
+	for(size_t i = 0; i < a.size(); ++i)
+		diff |= a[i] ^ b[i];
+	return !diff;
+}
+
+WSRelay::WSRelay()
+{
+	epfd = ::epoll_create1(EPOLL_CLOEXEC);
+	if(epfd < 0)
+	{
+		std::cerr << "RELAY EPOLL ERROR, " << errno << std::endl;
+		abort();
+	}
+	while(::getrandom(&nodeId, sizeof(nodeId), 0) != sizeof(nodeId));
+}
+
+WSRelay::~WSRelay()
+{
+	for(auto& link : links)
+		if(link->fd >= 0)
+			::close(link->fd);
+	if(listenfd >= 0)
+		::close(listenfd);
+	if(localListenfd >= 0)
+		::close(localListenfd);
+	::close(epfd);
+}
+
+bool WSRelay::start(unsigned short port, const std::vector<std::string>& peers, const std::string& bindAddress, std::string_view _secret)
+{
+	if(_secret.size() > RELAY_MAX_SECRET)
+	{
+		std::cerr << "RELAY SECRET TOO LONG" << std::endl;
+		return false;
+	}
+	secret = _secret;
+	if(port)
+	{
+		struct sockaddr_in addr;
+		std::memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		if(::inet_pton(AF_INET, bindAddress.c_str(), &addr.sin_addr) != 1)
+		{
+			std::cerr << "RELAY BAD BIND " << bindAddress << std::endl;
+			return false;
+		}
+		listenfd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if(listenfd < 0)
+		{
+			std::cerr << "RELAY SOCKET ERROR, " << errno << std::endl;
+			return false;
+		}
+		int one = 1;
+		::setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if(::bind(listenfd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 || ::listen(listenfd, RELAY_MAXEVENTS) < 0)
+		{
+			std::cerr << "RELAY LISTEN ERROR, " << strerror(errno) << std::endl;
+			return false;
+		}
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.u64 = RELAY_LISTEN_TAG;
+		::epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev);
+
+		struct sockaddr_un local;
+		socklen_t localLen = localAddress(port, local);
+		localListenfd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if(localListenfd < 0 || ::bind(localListenfd, reinterpret_cast<struct sockaddr*>(&local), localLen) < 0
+				|| ::listen(localListenfd, RELAY_MAXEVENTS) < 0)
+		{
+			std::cerr << "RELAY LOCAL LISTEN ERROR, " << strerror(errno) << std::endl;
+			return false;
+		}
+		ev.data.u64 = RELAY_LOCAL_LISTEN_TAG;
+		::epoll_ctl(epfd, EPOLL_CTL_ADD, localListenfd, &ev);
+		std::cout << "RELAY LISTEN " << bindAddress << ":" << port << ", NODE " << std::hex << nodeId << std::dec << std::endl;
+	}
+	for(const std::string& peer : peers)
+	{
+		auto& link = links.emplace_back(std::make_unique<Link>());
+		link->index = links.size() - 1;
+		link->peer = peer;
+		link->local = peer.compare(0, 4, "shm:") == 0;
+		startConnect(*link);
+	}
+	return true;
+}
+
+void WSRelay::startConnect(Link& link)
+{
+	if(link.local)
+	{
+		// unix socket 的 connect 不会 EINPROGRESS, 连上就建通道把fd传过去
+		struct sockaddr_un local;
+		socklen_t localLen = localAddress(std::atoi(link.peer.c_str() + 4), local);
+		link.fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		link.shm = std::make_unique<WSShmChannel>();
+		if(link.fd < 0 || ::connect(link.fd, reinterpret_cast<struct sockaddr*>(&local), localLen) < 0
+				|| !link.shm->create() || !link.shm->sendTo(link.fd))
+		{
+			std::cerr << "RELAY CONNECT FAIL " << link.peer << ", " << strerror(errno) << std::endl;
+			closeLink(link);
+			return;
+		}
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+		ev.data.u64 = link.index;
+		::epoll_ctl(epfd, EPOLL_CTL_ADD, link.fd, &ev);
+		ev.data.u64 = link.index | RELAY_WAKE_FLAG;
+		::epoll_ctl(epfd, EPOLL_CTL_ADD, link.shm->wakeFd(), &ev);
+		std::cout << "RELAY LINK UP " << link.peer << std::endl;
+		openLink(link);
+		// 读一次把环读空, 置上等待标志, 对端写入时才会唤醒
+		handleRead(link);
+		return;
+	}
+
+	struct sockaddr_in addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	size_t colon = link.peer.rfind(':');
+	if(colon == std::string::npos || ::inet_pton(AF_INET, link.peer.substr(0, colon).c_str(), &addr.sin_addr) != 1)
+	{
+		// 地址写错了重连也没用
+		std::cerr << "RELAY BAD PEER " << link.peer << std::endl;
+		return;
+	}
+	addr.sin_port = htons(std::atoi(link.peer.c_str() + colon + 1));
+
+	link.fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(link.fd < 0)
+	{
+		std::cerr << "RELAY SOCKET ERROR, " << errno << std::endl;
+		closeLink(link);
+		return;
+	}
+	int one = 1;
+	::setsockopt(link.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	int ret = ::connect(link.fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
+	if(ret < 0 && errno != EINPROGRESS)
+	{
+		std::cerr << "RELAY CONNECT ERROR " << link.peer << ", " << strerror(errno) << std::endl;
+		closeLink(link);
+		return;
+	}
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.u64 = link.index;
+	::epoll_ctl(epfd, EPOLL_CTL_ADD, link.fd, &ev);
+	if(ret == 0)
+		handleConnected(link);
+}
+
+void WSRelay::handleConnected(Link& link)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+	::getsockopt(link.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+	if(err)
+	{
+		std::cerr << "RELAY CONNECT FAIL " << link.peer << ", " << strerror(err) << std::endl;
+		closeLink(link);
+		return;
+	}
+	std::cout << "RELAY LINK UP " << link.peer << std::endl;
+	openLink(link);
+}
+
+void WSRelay::handleAccept(int listen, bool local)
+{
+	while(true)
+	{
+		int fd = ::accept4(listen, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(fd < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN)
+				std::cerr << "RELAY ACCEPT ERROR, " << errno << std::endl;
+			return;
+		}
+		// 被动接入的链路断开后槽位留给下一个接入
+		Link* link = nullptr;
+		size_t accepted = 0;
+		for(auto& item : links)
+		{
+			if(!item->peer.empty())
+				continue;
+			if(item->fd >= 0)
+				++accepted;
+			else if(!link)
+				link = item.get();
+		}
+		if(accepted >= RELAY_MAX_LINKS)
+		{
+			std::cerr << "RELAY TOO MANY LINKS" << std::endl;
+			::close(fd);
+			continue;
+		}
+		int one = 1;
+		if(!local)
+			::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if(!link)
+		{
+			link = links.emplace_back(std::make_unique<Link>()).get();
+			link->index = links.size() - 1;
+		}
+		link->fd = fd;
+		link->local = local;
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+		if(!local)
+			ev.events |= EPOLLOUT;
+		ev.data.u64 = link->index;
+		::epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+		// 同机链路等对端传来通道的fd再打开
+		if(local)
+			handleLocal(*link);
+		else
+		{
+			std::cout << "RELAY LINK ACCEPTED" << std::endl;
+			openLink(*link);
+		}
+	}
+}
+
+// 链路可用: 先报节点号和口令, 订阅的主题等对端 HELLO 验过再同步
+void WSRelay::openLink(Link& link)
+{
+	link.connected = true;
+	std::string hello(sizeof(uint64_t), '\0');
+	uint64_t id = htobe64(nodeId);
+	std::memcpy(hello.data(), &id, sizeof(id));
+	hello += secret;
+	appendRecord(link, RELAY_HELLO, 0, std::string_view(), hello.data(), hello.size());
+	endBatch(link);
+	handleWrite(link);
+}
+
+void WSRelay::closeLink(Link& link, uint32_t retryMs)
+{
+	if(link.fd >= 0)
+	{
+		::epoll_ctl(epfd, EPOLL_CTL_DEL, link.fd, nullptr);
+		::close(link.fd);
+		link.fd = -1;
+		if(link.connected)
+			std::cout << "RELAY LINK DOWN " << (link.peer.empty() ? "ACCEPTED" : link.peer) << std::endl;
+	}
+	if(link.shm)
+	{
+		::epoll_ctl(epfd, EPOLL_CTL_DEL, link.shm->wakeFd(), nullptr);
+		link.shm.reset();
+	}
+	link.connected = false;
+	link.nodeId = 0;
+	link.in.clear();
+	link.out.clear();
+	link.outOffset = 0;
+	link.batchStart = std::string::npos;
+	link.interest.clear();
+	if(link.peer.empty())
+		return;
+
+	// 退避重连, 和 WSClient 一样加抖动, 避免全部节点同时重启后一齐重连
+	if(!retryMs)
+	{
+		uint32_t ceiling = std::min<uint64_t>(RELAY_RECONNECT_MAX_MS, static_cast<uint64_t>(RELAY_RECONNECT_MIN_MS) << std::min(link.attempts, 16u));
+		uint32_t jitter = 0;
+		while(::getrandom(&jitter, sizeof(jitter), 0) != sizeof(jitter));
+		retryMs = ceiling / 2 + jitter % (ceiling / 2 + 1);
+	}
+	++link.attempts;
+	link.retryAt = wsNowMs() + retryMs;
+}
+
+void WSRelay::poll()
+{
+	struct epoll_event events[RELAY_MAXEVENTS];
+	int num = ::epoll_wait(epfd, events, RELAY_MAXEVENTS, 0);
+	for(int i = 0; i < num; ++i)
+	{
+		uint64_t data = events[i].data.u64;
+		if(data == RELAY_LISTEN_TAG)
+			handleAccept(listenfd, false);
+		else if(data == RELAY_LOCAL_LISTEN_TAG)
+			handleAccept(localListenfd, true);
+		else if(data & RELAY_WAKE_FLAG)
+			handleWake(*links[data & ~RELAY_WAKE_FLAG]);
+		else
+			handleEvent(*links[data], events[i].events);
+	}
+}
+
+void WSRelay::handleEvent(Link& link, uint32_t events)
+{
+	if(link.fd < 0)
+		return;
+	if(link.local)
+	{
+		handleLocal(link);
+		return;
+	}
+	if(!link.connected)
+	{
+		handleConnected(link);
+		if(!link.connected)
+			return;
+	}
+	if(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+		handleRead(link);
+	if(link.fd >= 0 && (events & EPOLLOUT))
+		handleWrite(link);
+}
+
+// 同机链路的 unix socket: 通道建好前收对端传来的fd, 之后可读只意味着对端退出
+void WSRelay::handleLocal(Link& link)
+{
+	if(link.shm)
+	{
+		char c;
+		ssize_t ret = ::recv(link.fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+		if(ret == 0 || (ret < 0 && errno != EAGAIN && errno != EINTR))
+			closeLink(link);
+		return;
+	}
+	link.shm = std::make_unique<WSShmChannel>();
+	if(!link.shm->recvFrom(link.fd))
+	{
+		if(errno == EAGAIN)
+			link.shm.reset();
+		else
+			closeLink(link);
+		return;
+	}
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.u64 = link.index | RELAY_WAKE_FLAG;
+	::epoll_ctl(epfd, EPOLL_CTL_ADD, link.shm->wakeFd(), &ev);
+	std::cout << "RELAY LOCAL LINK ACCEPTED" << std::endl;
+	openLink(link);
+	// 对端在我们接上之前可能已经写了, 读空同时置上等待标志
+	handleRead(link);
+}
+
+// 共享内存通道有数据进来或出方向有了空间
+void WSRelay::handleWake(Link& link)
+{
+	if(!link.shm || !link.connected)
+		return;
+	link.shm->clearWake();
+	handleRead(link);
+	if(link.connected)
+		handleWrite(link);
+}
+
+void WSRelay::handleTimers()
+{
+	uint64_t now = 0;
+	for(auto& link : links)
+	{
+		if(!link->retryAt)
+			continue;
+		if(!now)
+			now = wsNowMs();
+		if(link->retryAt > now)
+			continue;
+		link->retryAt = 0;
+		++stats.reconnects;
+		startConnect(*link);
+	}
+}
+
+int WSRelay::nextTimeout(int limit) const
+{
+	uint64_t now = 0;
+	for(auto& link : links)
+	{
+		if(!link->retryAt)
+			continue;
+		if(!now)
+			now = wsNowMs();
+		if(link->retryAt <= now)
+			return 0;
+		limit = std::min<uint64_t>(limit, link->retryAt - now);
+	}
+	return limit;
+}
+
+void WSRelay::handleRead(Link& link)
+{
+	char buff[64 * 1024];
+	while(true)
+	{
+		ssize_t ret = linkRecv(link, buff, sizeof(buff));
+		if(ret < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN)
+				closeLink(link);
+			return;
+		}
+		if(ret == 0)
+		{
+			closeLink(link);
+			return;
+		}
+		link.in.append(buff, ret);
+		// 每读一次就解析, 长度前缀一到就检查上限, 未认证的对端最多让缓冲超出上限一次读的量
+		if(!parseIn(link))
+			return;
+	}
+}
+
+bool WSRelay::parseIn(Link& link)
+{
+	size_t pos = 0;
+	while(link.in.size() - pos >= sizeof(uint32_t))
+	{
+		uint32_t len;
+		std::memcpy(&len, link.in.data() + pos, sizeof(len));
+		len = ntohl(len);
+		if(len > (link.nodeId ? RELAY_MAX_FRAME : RELAY_MAX_HELLO))
+		{
+			std::cerr << "RELAY BAD BATCH " << len << std::endl;
+			closeLink(link);
+			return false;
+		}
+		if(link.in.size() - pos - sizeof(len) < len)
+			break;
+		if(!parseBatch(link, link.in.data() + pos + sizeof(len), len))
+		{
+			// 重复链路在 parseBatch 里已按最长退避关掉, 再关一次会把 retryAt 改短并多计一次 attempts
+			if(link.fd >= 0)
+				closeLink(link);
+			return false;
+		}
+		pos += sizeof(len) + len;
+	}
+	link.in.erase(0, pos);
+	return true;
+}
+
+bool WSRelay::parseBatch(Link& link, const char* p, size_t len)
+{
+	const char* end = p + len;
+	while(p < end)
+	{
+		WSRelayRecord record;
+		if(static_cast<size_t>(end - p) < sizeof(record))
+			return false;
+		std::memcpy(&record, p, sizeof(record));
+		p += sizeof(record);
+		size_t topicLen = ntohs(record.topicLen);
+		size_t dataLen = ntohl(record.dataLen);
+		if(static_cast<size_t>(end - p) < topicLen + dataLen)
+			return false;
+		std::string_view topic(p, topicLen);
+		std::string_view data(p + topicLen, dataLen);
+		p += topicLen + dataLen;
+		if(!link.nodeId && record.kind != RELAY_HELLO)
+		{
+			std::cerr << "RELAY RECORD BEFORE HELLO" << std::endl;
+			return false;
+		}
+
+		switch(record.kind)
+		{
+			case RELAY_HELLO:
+			{
+				uint64_t id;
+				if(data.size() < sizeof(id) || !sameSecret(data.substr(sizeof(id)), secret))
+				{
+					std::cerr << "RELAY BAD HELLO " << (link.peer.empty() ? "ACCEPTED" : link.peer) << std::endl;
+					return false;
+				}
+				std::memcpy(&id, data.data(), sizeof(id));
+				id = be64toh(id);
+				if(id == nodeId)
+				{
+					std::cerr << "RELAY SELF LINK " << link.peer << std::endl;
+					return false;
+				}
+				// 两端都配置了对方时留发起方节点号小的那条, 两端判断一致
+				for(auto& other : links)
+				{
+					if(other.get() == &link || other->nodeId != id)
+						continue;
+					uint64_t keep = std::min(nodeId, id);
+					Link& loser = (other->peer.empty() ? id : nodeId) == keep ? link : *other;
+					std::cerr << "RELAY DUPLICATE LINK " << std::hex << id << std::dec << std::endl;
+					closeLink(loser, RELAY_RECONNECT_MAX_MS);
+					if(&loser == &link)
+						return false;
+					break;
+				}
+				// 验过口令才算连上, 退避从头算; 口令不对的对端重连间隔会一直加长
+				bool first = !link.nodeId;
+				link.nodeId = id;
+				link.attempts = 0;
+				if(first)
+					for(auto& [topic, handles] : topics)
+						appendRecord(link, RELAY_SUB, 0, topic, nullptr, 0);
+				break;
+			}
+			case RELAY_SUB:
+				link.interest.emplace(topic);
+				break;
+			case RELAY_UNSUB:
+			{
+				auto iter = link.interest.find(topic);
+				if(iter != link.interest.end())
+					link.interest.erase(iter);
+				break;
+			}
+			case RELAY_PUB:
+				++stats.relayedIn;
+				deliverLocal(topic, record.opcode, data);
+				break;
+			default:
+				std::cerr << "RELAY BAD RECORD " << static_cast<int>(record.kind) << std::endl;
+				return false;
+		}
+	}
+	return true;
+}
+
+void WSRelay::handleWrite(Link& link)
+{
+	// 没结束的批长度还没填, 只写到它前面
+	size_t limit = link.batchStart == std::string::npos ? link.out.size() : link.batchStart;
+	while(link.connected && link.outOffset < limit)
+	{
+		ssize_t ret = linkSend(link, link.out.data() + link.outOffset, limit - link.outOffset);
+		if(ret < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN)
+				closeLink(link);
+			return;
+		}
+		link.outOffset += ret;
+	}
+	if(!link.connected || !link.outOffset)
+		return;
+	if(link.outOffset == link.out.size())
+	{
+		link.out.clear();
+		link.outOffset = 0;
+	}
+	else if(link.outOffset >= RELAY_MAX_BATCH)
+	{
+		// 积压时前面写完的部分定期挪掉
+		link.out.erase(0, link.outOffset);
+		if(link.batchStart != std::string::npos)
+			link.batchStart -= link.outOffset;
+		link.outOffset = 0;
+	}
+}
+
+ssize_t WSRelay::linkRecv(Link& link, char* buf, size_t len)
+{
+	if(!link.shm)
+		return ::recv(link.fd, buf, len, 0);
+	size_t n = link.shm->in.read(buf, len);
+	if(!n)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+	return n;
+}
+
+ssize_t WSRelay::linkSend(Link& link, const char* data, size_t len)
+{
+	if(!link.shm)
+		return ::send(link.fd, data, len, MSG_NOSIGNAL);
+	size_t n = link.shm->out.write(data, len);
+	if(!n)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+	return n;
+}
+
+void WSRelay::appendRecord(Link& link, uint8_t kind, uint8_t opcode, std::string_view topic, const char* data, size_t len)
+{
+	if(link.batchStart == std::string::npos)
+	{
+		link.batchStart = link.out.size();
+		link.out.append(sizeof(uint32_t), '\0');
+	}
+	if(!link.dirty)
+	{
+		link.dirty = true;
+		dirtyLinks.push_back(link.index);
+	}
+	WSRelayRecord record;
+	record.kind = kind;
+	record.opcode = opcode;
+	record.topicLen = htons(topic.size());
+	record.dataLen = htonl(len);
+	link.out.append(reinterpret_cast<const char*>(&record), sizeof(record));
+	link.out.append(topic.data(), topic.size());
+	link.out.append(data, len);
+	if(link.out.size() - link.batchStart - sizeof(uint32_t) >= RELAY_MAX_BATCH)
+		endBatch(link);
+	if(link.out.size() - link.outOffset > RELAY_MAX_PENDING)
+	{
+		std::cerr << "RELAY PEER TOO SLOW " << (link.peer.empty() ? "ACCEPTED" : link.peer) << std::endl;
+		closeLink(link);
+	}
+}
+
+void WSRelay::endBatch(Link& link)
+{
+	if(link.batchStart == std::string::npos)
+		return;
+	uint32_t len = htonl(link.out.size() - link.batchStart - sizeof(uint32_t));
+	std::memcpy(link.out.data() + link.batchStart, &len, sizeof(len));
+	link.batchStart = std::string::npos;
+	++stats.batches;
+}
+
+void WSRelay::flush()
+{
+	for(uint32_t index : dirtyLinks)
+	{
+		Link& link = *links[index];
+		link.dirty = false;
+		if(!link.connected)
+			continue;
+		endBatch(link);
+		handleWrite(link);
+	}
+	dirtyLinks.clear();
+}
+
+void WSRelay::sendInterest(uint8_t kind, std::string_view topic)
+{
+	for(auto& link : links)
+		if(link->connected && link->nodeId)
+			appendRecord(*link, kind, 0, topic, nullptr, 0);
+}
+
+void WSRelay::subscribe(WSConnHandle handle, std::string_view topic)
+{
+	auto iter = topics.find(topic);
+	if(iter == topics.end())
+	{
+		iter = topics.emplace(std::string(topic), std::vector<WSConnHandle>()).first;
+		sendInterest(RELAY_SUB, topic);
+	}
+	else if(std::find(iter->second.begin(), iter->second.end(), handle) != iter->second.end())
+		return;
+	iter->second.push_back(handle);
+	subscriptions[handle].emplace_back(topic);
+}
+
+void WSRelay::removeSubscriber(WSConnHandle handle, std::string_view topic)
+{
+	auto iter = topics.find(topic);
+	if(iter == topics.end())
+		return;
+	auto& handles = iter->second;
+	auto pos = std::find(handles.begin(), handles.end(), handle);
+	if(pos == handles.end())
+		return;
+	*pos = handles.back();
+	handles.pop_back();
+	if(handles.empty())
+	{
+		sendInterest(RELAY_UNSUB, topic);
+		topics.erase(iter);
+	}
+}
+
+void WSRelay::unsubscribe(WSConnHandle handle, std::string_view topic)
+{
+	auto iter = subscriptions.find(handle);
+	if(iter == subscriptions.end())
+		return;
+	auto& list = iter->second;
+	auto pos = std::find(list.begin(), list.end(), topic);
+	if(pos == list.end())
+		return;
+	removeSubscriber(handle, topic);
+	list.erase(pos);
+	if(list.empty())
+		subscriptions.erase(iter);
+}
+
+void WSRelay::unsubscribeAll(WSConnHandle handle)
+{
+	auto iter = subscriptions.find(handle);
+	if(iter == subscriptions.end())
+		return;
+	for(const std::string& topic : iter->second)
+		removeSubscriber(handle, topic);
+	subscriptions.erase(iter);
+}
+
+void WSRelay::publish(std::string_view topic, uint8_t opcode, const char* data, size_t len)
+{
+	++stats.published;
+	deliverLocal(topic, opcode, std::string_view(data, len));
+	if(len > RELAY_MAX_MESSAGE)
+	{
+		std::cerr << "RELAY MESSAGE TOO BIG " << len << std::endl;
+		return;
+	}
+	for(auto& link : links)
+	{
+		if(!link->connected || link->interest.find(topic) == link->interest.end())
+			continue;
+		appendRecord(*link, RELAY_PUB, opcode, topic, data, len);
+		++stats.relayedOut;
+	}
+}
+
+void WSRelay::deliverLocal(std::string_view topic, uint8_t opcode, std::string_view msg)
+{
+	auto iter = topics.find(topic);
+	if(iter == topics.end() || !deliver)
+		return;
+	for(WSConnHandle handle : iter->second)
+	{
+		deliver(handle, opcode, msg);
+		++stats.delivered;
+	}
+}
+
+void WSRelay::printStats() const
+{
+	if(links.empty() && listenfd < 0)
+		return;
+	size_t up = 0;
+	for(auto& link : links)
+		up += link->connected;
+	std::cout << "RELAY STATS links " << up << "/" << links.size() << " topics " << topics.size() << " published " << stats.published
+		<< " delivered " << stats.delivered << " out " << stats.relayedOut << " in " << stats.relayedIn
+		<< " batches " << stats.batches << " reconnects " << stats.reconnects << std::endl;
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include "WSBuffer.h"
+#include "WSPost.h"
+#include "WSShm.h"
+
+// 节点间转发: 多个 TCPServer 实例用普通TCP两两直连(每对节点只在一端配置对端),
+// 本地发布的消息只转给对该主题有订阅的节点, 收到的转发只投给本地订阅者, 不再转出, 所以拓扑须是全连接.
+// 主题出现本地首个订阅/最后一个退订时通知所有节点, 链路建立时全量同步.
+// 链路上是长度前缀的批: [u32 批长度][记录...], 记录为 WSRelayRecord + 主题 + 负载, 多字节字段均为网络序;
+// 一轮事件循环里的记录攒成一批, 轮末 flush 一次写出.
+// 链路打开时两端各发 HELLO(节点号 + 共享口令), 收到对端口令相符的 HELLO 之前只认 HELLO, 也不把订阅同步过去.
+// 默认只监听回环地址, 跨机部署要显式指定监听地址并配置口令
+// relay 有自己的 epoll, fd() 加进 reactor 的 epoll, 可读时调用 poll()
+// 同机的节点可以配置为 "shm:端口": 经 unix socket 交换 memfd 后走共享内存环 (WSShmChannel), 协议不变, 不经网络栈;
+// unix socket 之后只用来发现对端进程退出
+
+#define RELAY_MAX_BATCH (1024 * 1024)	// 单批超过就结束当前批另起一批
+#define RELAY_MAX_PENDING (64 * 1024 * 1024)	// 对端跟不上时的积压上限, 超过断开重连
+#define RELAY_RECONNECT_MIN_MS 100
+#define RELAY_RECONNECT_MAX_MS 5000
+#define RELAY_MAXEVENTS 64
+#define RELAY_MAX_TOPIC 1024
+#define RELAY_MAX_MESSAGE (16 * 1024 * 1024)	// 超过的消息只投给本地订阅者, 不转出
+#define RELAY_MAX_SECRET 256
+#define RELAY_MAX_LINKS 64	// 被动接入的链路上限
+#define RELAY_DEFAULT_BIND "127.0.0.1"
+
+enum WSRelayKind : uint8_t
+{
+	RELAY_HELLO = 1,	// 负载为8字节节点号 + 共享口令
+	RELAY_SUB = 2,
+	RELAY_UNSUB = 3,
+	RELAY_PUB = 4,
+};
+
+#pragma pack(push, 1)
+struct WSRelayRecord
+{
+	uint8_t kind;
+	uint8_t opcode;
+	uint16_t topicLen;
+	uint32_t dataLen;
+};
+#pragma pack(pop)
+
+struct WSRelayStats
+{
+	uint64_t published = 0;		// 本地发布
+	uint64_t delivered = 0;		// 投给本地订阅者(含转发来的)
+	uint64_t relayedOut = 0;	// 转出的消息
+	uint64_t relayedIn = 0;
+	uint64_t batches = 0;		// 写出的批
+	uint64_t reconnects = 0;
+};
+
+// 主题表按 string_view 查找, 不构造临时 string
+struct WSTopicHash
+{
+	using is_transparent = void;
+	size_t operator () (std::string_view s) const { return std::hash<std::string_view>()(s); }
+};
+
+class WSRelay
+{
+	public:
+		using Deliver = std::function<void(WSConnHandle handle, uint8_t opcode, std::string_view msg)>;
+
+		WSRelay();
+		~WSRelay();
+		WSRelay(const WSRelay&) = delete;
+		WSRelay& operator = (const WSRelay&) = delete;
+
+		// port 为0时不监听, 否则在 bindAddress 上监听, 同时监听同号的抽象 unix socket 接受同机节点;
+		// peers 为 "ip:port" 或 "shm:port", 断开后自动重连; 所有节点须配置同一个 secret
+		bool start(unsigned short port, const std::vector<std::string>& peers, const std::string& bindAddress = RELAY_DEFAULT_BIND, std::string_view _secret = std::string_view());
+
+		// 本地订阅者的投递方式, 由 reactor 提供
+		void setDeliver(Deliver _deliver) { deliver = std::move(_deliver); }
+
+		int fd() const { return epfd; }
+
+		void subscribe(WSConnHandle handle, std::string_view topic);
+		void unsubscribe(WSConnHandle handle, std::string_view topic);
+		void unsubscribeAll(WSConnHandle handle); // 连接关闭时调用
+
+		// 投给本地订阅者, 再转给有订阅的节点
+		void publish(std::string_view topic, uint8_t opcode, const char* data, size_t len);
+
+		// 处理就绪事件
+		void poll();
+
+		// 到期的重连
+		void handleTimers();
+
+		// 轮末写出攒下的批
+		void flush();
+
+		// 距最近一次重连的毫秒数, 没有返回 limit
+		int nextTimeout(int limit) const;
+
+		const WSRelayStats& getStats() const { return stats; }
+		void printStats() const;
+
+	private:
+		struct Link
+		{
+			uint32_t index = 0;	// 在 links 里的下标, 也是 epoll 的 data
+			int fd = -1;
+			std::string peer;	// 主动连接的对端地址, 被动接入的为空
+			bool local = false;	// 同机共享内存链路, fd 为 unix socket
+			std::unique_ptr<WSShmChannel> shm; // 通道建好之前为空
+			bool connected = false;
+			uint64_t nodeId = 0;	// 对端 HELLO 之后才知道, 为0时只接受 HELLO
+			uint32_t attempts = 0;
+			uint64_t retryAt = 0;	// 下次重连时间(ms), 0表示不等重连
+			WSInBuffer in;
+			std::string out;
+			size_t outOffset = 0;
+			size_t batchStart = std::string::npos; // 当前未结束批的长度字段位置
+			bool dirty = false;	// 本轮有新记录, 轮末写出
+			std::unordered_set<std::string, WSTopicHash, std::equal_to<>> interest; // 对端订阅的主题
+		};
+
+		void handleAccept(int fd, bool local);
+		void handleEvent(Link& link, uint32_t events);
+		void handleLocal(Link& link);
+		void handleWake(Link& link);
+		void startConnect(Link& link);
+		void handleConnected(Link& link);
+		void handleRead(Link& link);
+		// 解析 link.in 里已收齐的批, 出错时关掉链路返回 false
+		bool parseIn(Link& link);
+		bool parseBatch(Link& link, const char* p, size_t len);
+		void handleWrite(Link& link);
+		void closeLink(Link& link, uint32_t retryMs = 0);
+		ssize_t linkRecv(Link& link, char* buf, size_t len);
+		ssize_t linkSend(Link& link, const char* data, size_t len);
+		void openLink(Link& link);
+
+		void appendRecord(Link& link, uint8_t kind, uint8_t opcode, std::string_view topic, const char* data, size_t len);
+		void endBatch(Link& link);
+		void sendInterest(uint8_t kind, std::string_view topic);
+		void removeSubscriber(WSConnHandle handle, std::string_view topic);
+		void deliverLocal(std::string_view topic, uint8_t opcode, std::string_view msg);
+
+		int epfd = -1;
+		int listenfd = -1;
+		int localListenfd = -1;
+		uint64_t nodeId = 0;
+		std::string secret;
+		std::vector<std::unique_ptr<Link>> links;
+		std::vector<uint32_t> dirtyLinks;
+		std::unordered_map<std::string, std::vector<WSConnHandle>, WSTopicHash, std::equal_to<>> topics;
+		std::unordered_map<WSConnHandle, std::vector<std::string>> subscriptions;
+		Deliver deliver;
+		WSRelayStats stats;
+};
+
+inline thread_local WSRelay* wsRelay = nullptr;
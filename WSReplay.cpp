@@ -0,0 +1,503 @@
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "WSCapture.h"
+
+// 重放 TCPServer 捕获的流量: 每个捕获连接开一个回环连接, 按原始间隔(可加速)发出同样的字节,
+// 统计回应吞吐和延迟, 可与之前一次的结果对比.
+//   WSReplay <捕获文件> [加速倍数, 默认1, 0表示不等待] [基线结果文件] [端口]
+// 结果以 "RESULT 名称 值" 行输出, 保存下来即可作为下次的基线文件
+
+#define REPLAY_MAXEVENTS 256
+#define REPLAY_IDLE_US (2 * 1000000) // 重放完后这么久没有回应就结束
+
+static uint64_t nowUs()
+{
+	using namespace std::chrono;
+	return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// 数帧: 跳过握手的HTTP头, 之后按帧头跳过负载, 返回完整消息(fin帧)个数
+struct FrameCounter
+{
+	bool http = true;
+	uint32_t httpMatch = 0;
+	uint8_t header[14];
+	size_t headerLen = 0;
+	uint64_t skip = 0;
+	bool fin = false;
+
+	static size_t headerSize(const uint8_t* header, size_t len)
+	{
+		if(len < 2)
+			return 2;
+		size_t size = 2 + ((header[1] & 0x80) ? 4 : 0);
+		uint8_t payloadLen = header[1] & 0x7F;
+		if(payloadLen == 126)
+			size += 2;
+		else if(payloadLen == 127)
+			size += 8;
+		return size;
+	}
+
+	size_t feed(const char* p, size_t n)
+	{
+		static const char end[] = "\r\n\r\n";
+		size_t done = 0;
+		while(n)
+		{
+			if(http)
+			{
+				char c = *p++;
+				--n;
+				httpMatch = c == end[httpMatch] ? httpMatch + 1 : (c == '\r' ? 1 : 0);
+				if(httpMatch == 4)
+					http = false;
+				continue;
+			}
+			if(skip)
+			{
+				size_t len = std::min<uint64_t>(skip, n);
+				p += len;
+				n -= len;
+				skip -= len;
+				if(!skip && fin)
+					++done;
+				continue;
+			}
+			header[headerLen++] = *p++;
+			--n;
+			if(headerLen < headerSize(header, headerLen))
+				continue;
+			fin = header[0] & 0x80;
+			uint64_t len = header[1] & 0x7F;
+			if(len == 126)
+				len = (uint64_t(header[2]) << 8) | header[3];
+			else if(len == 127)
+			{
+				len = 0;
+				for(int i = 0; i < 8; ++i)
+					len = (len << 8) | header[2 + i];
+			}
+			skip = len;
+			headerLen = 0;
+			if(!skip && fin)
+				++done;
+		}
+		return done;
+	}
+};
+
+struct ReplayConn
+{
+	int fd = -1;
+	bool connected = false;
+	bool closing = false;	// 捕获里连接已关闭, 发完并收齐回应后半关闭
+	std::string pending;
+	size_t pendingOffset = 0;
+	FrameCounter sendFrames;
+	FrameCounter recvFrames;
+	std::deque<uint64_t> sentAt; // 已发出的消息的发送时间, 按回应顺序取出
+};
+
+class Replayer
+{
+	public:
+		Replayer(unsigned short _port, double _speed) : port(_port), speed(_speed)
+		{
+			epfd = epoll_create1(EPOLL_CLOEXEC);
+		}
+		~Replayer()
+		{
+			for(auto& [id, conn] : conns)
+				if(conn.fd >= 0)
+					::close(conn.fd);
+			::close(epfd);
+			if(mapped)
+				::munmap(mapped, fileSize);
+		}
+
+		bool load(const char* path);
+		void run();
+		void report(const char* baseline);
+
+	private:
+		void apply(const WSCaptureRecord& rec, const char* data);
+		void openConn(uint32_t id);
+		void writeConn(ReplayConn& conn);
+		void readConn(ReplayConn& conn);
+		void closeConn(ReplayConn& conn);
+		void finishConn(ReplayConn& conn);
+
+		unsigned short port;
+		double speed;
+		int epfd = -1;
+
+		void* mapped = nullptr;
+		const char* begin = nullptr;
+		const char* end = nullptr;
+		size_t fileSize = 0;
+
+		std::unordered_map<uint32_t, ReplayConn> conns;
+		size_t openConns = 0;
+		size_t totalConns = 0;
+		size_t records = 0;
+		uint64_t sentBytes = 0;
+		uint64_t recvBytes = 0;
+		uint64_t recvMsgs = 0;
+		uint64_t failed = 0;
+		uint64_t startUs = 0;
+		uint64_t lastRecvUs = 0;
+		std::vector<uint32_t> latencies;
+};
+
+bool Replayer::load(const char* path)
+{
+	int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+	{
+		std::cerr << "OPEN FAIL, " << path << std::endl;
+		return false;
+	}
+	struct stat st;
+	if(::fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(WSCaptureHeader))
+	{
+		std::cerr << "BAD CAPTURE FILE, " << path << std::endl;
+		::close(fd);
+		return false;
+	}
+	fileSize = st.st_size;
+	void* p = ::mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if(p == MAP_FAILED)
+	{
+		std::cerr << "MMAP FAIL, " << errno << std::endl;
+		return false;
+	}
+	mapped = p;
+	begin = static_cast<const char*>(p);
+	end = begin + fileSize;
+	if(std::memcmp(begin, WS_CAPTURE_MAGIC, 8) != 0)
+	{
+		std::cerr << "BAD CAPTURE MAGIC, " << path << std::endl;
+		return false;
+	}
+	begin += sizeof(WSCaptureHeader);
+	return true;
+}
+
+void Replayer::openConn(uint32_t id)
+{
+	ReplayConn& conn = conns[id];
+	conn.fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	if(conn.fd < 0)
+	{
+		std::cerr << "SOCKET FAIL, " << errno << std::endl;
+		++failed;
+		return;
+	}
+	++openConns;
+	++totalConns;
+	int nodelay = 1;
+	::setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+	struct sockaddr_in addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if(::connect(conn.fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 && errno != EINPROGRESS)
+	{
+		std::cerr << "CONNECT FAIL, " << errno << std::endl;
+		closeConn(conn);
+		++failed;
+		return;
+	}
+	// 边沿触发, 可写时统一由 writeConn 续写
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.u64 = id;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, conn.fd, &ev);
+}
+
+void Replayer::closeConn(ReplayConn& conn)
+{
+	if(conn.fd < 0)
+		return;
+	::close(conn.fd);
+	conn.fd = -1;
+	conn.connected = false;
+	--openConns;
+}
+
+void Replayer::writeConn(ReplayConn& conn)
+{
+	if(conn.fd < 0 || !conn.connected)
+		return;
+	while(conn.pendingOffset < conn.pending.size())
+	{
+		const char* p = conn.pending.data() + conn.pendingOffset;
+		ssize_t ret = ::send(conn.fd, p, conn.pending.size() - conn.pendingOffset, MSG_NOSIGNAL);
+		if(ret < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN)
+				closeConn(conn);
+			return;
+		}
+		// 发完一条消息才开始计延迟
+		uint64_t now = nowUs();
+		for(size_t n = conn.sendFrames.feed(p, ret); n; --n)
+			conn.sentAt.push_back(now);
+		conn.pendingOffset += ret;
+		sentBytes += ret;
+	}
+	conn.pending.clear();
+	conn.pendingOffset = 0;
+	finishConn(conn);
+}
+
+// 不加速时过早半关闭, 服务器会丢掉还没写出的回应
+void Replayer::finishConn(ReplayConn& conn)
+{
+	if(conn.closing && conn.fd >= 0 && conn.pending.empty() && conn.sentAt.empty())
+		::shutdown(conn.fd, SHUT_WR);
+}
+
+void Replayer::readConn(ReplayConn& conn)
+{
+	char buff[256 * 1024];
+	while(conn.fd >= 0)
+	{
+		ssize_t ret = ::recv(conn.fd, buff, sizeof(buff), 0);
+		if(ret < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN)
+				closeConn(conn);
+			return;
+		}
+		if(ret == 0)
+		{
+			closeConn(conn);
+			return;
+		}
+		uint64_t now = nowUs();
+		lastRecvUs = now;
+		recvBytes += ret;
+		for(size_t n = conn.recvFrames.feed(buff, ret); n; --n)
+		{
+			++recvMsgs;
+			// 服务器主动推送的消息没有对应的请求, 不计延迟
+			if(conn.sentAt.empty())
+				continue;
+			latencies.push_back(static_cast<uint32_t>(std::min<uint64_t>(now - conn.sentAt.front(), UINT32_MAX)));
+			conn.sentAt.pop_front();
+		}
+		finishConn(conn);
+	}
+}
+
+void Replayer::apply(const WSCaptureRecord& rec, const char* data)
+{
+	++records;
+	if(rec.kind == CAPTURE_OPEN)
+	{
+		openConn(rec.conn);
+		return;
+	}
+	auto iter = conns.find(rec.conn);
+	if(iter == conns.end())
+		return;
+	ReplayConn& conn = iter->second;
+	if(rec.kind == CAPTURE_DATA)
+		conn.pending.append(data, rec.len);
+	else if(rec.kind == CAPTURE_CLOSE)
+		conn.closing = true;
+	writeConn(conn);
+}
+
+void Replayer::run()
+{
+	std::vector<epoll_event> events(REPLAY_MAXEVENTS);
+	const char* p = begin;
+	uint64_t captureUs = 0; // 下一条记录在捕获中的时间
+	startUs = lastRecvUs = nowUs();
+	while(true)
+	{
+		const WSCaptureRecord* rec = nullptr;
+		if(p + sizeof(WSCaptureRecord) <= end)
+		{
+			rec = reinterpret_cast<const WSCaptureRecord*>(p);
+			if(rec->kind == CAPTURE_END || p + sizeof(WSCaptureRecord) + rec->len > end)
+				rec = nullptr;
+		}
+
+		uint64_t now = nowUs();
+		int64_t waitUs = 0;
+		if(rec)
+		{
+			uint64_t due = startUs + (speed > 0 ? static_cast<uint64_t>((captureUs + rec->deltaUs) / speed) : 0);
+			if(due <= now)
+			{
+				captureUs += rec->deltaUs;
+				apply(*rec, p + sizeof(WSCaptureRecord));
+				p += sizeof(WSCaptureRecord) + rec->len;
+				continue;
+			}
+			waitUs = due - now;
+		}
+		else
+		{
+			// 记录放完, 等剩下的回应
+			if(!openConns || now - lastRecvUs > REPLAY_IDLE_US)
+				break;
+			waitUs = REPLAY_IDLE_US - (now - lastRecvUs);
+		}
+
+		struct timespec timeout;
+		timeout.tv_sec = waitUs / 1000000;
+		timeout.tv_nsec = waitUs % 1000000 * 1000;
+		int num = epoll_pwait2(epfd, events.data(), events.size(), &timeout, nullptr);
+		if(num < 0 && errno == ENOSYS)
+			num = epoll_wait(epfd, events.data(), events.size(), (waitUs + 999) / 1000);
+		for(int i = 0; i < num; ++i)
+		{
+			uint32_t id = events[i].data.u64;
+			ReplayConn& conn = conns[id];
+			if(conn.fd < 0)
+				continue;
+			if(!conn.connected && (events[i].events & (EPOLLOUT | EPOLLERR)))
+			{
+				int err = 0;
+				socklen_t len = sizeof(err);
+				::getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+				if(err)
+				{
+					std::cerr << "CONNECT FAIL, " << err << std::endl;
+					++failed;
+					closeConn(conn);
+					continue;
+				}
+				conn.connected = true;
+			}
+			if(events[i].events & EPOLLIN)
+				readConn(conn);
+			if(events[i].events & EPOLLOUT)
+				writeConn(conn);
+			if(events[i].events & (EPOLLERR | EPOLLHUP))
+				closeConn(conn);
+		}
+	}
+}
+
+static uint64_t percentile(const std::vector<uint32_t>& sorted, double q)
+{
+	if(sorted.empty())
+		return 0;
+	size_t index = std::min(sorted.size() - 1, static_cast<size_t>(q * sorted.size()));
+	return sorted[index];
+}
+
+void Replayer::report(const char* baseline)
+{
+	double seconds = (lastRecvUs > startUs ? lastRecvUs - startUs : 1) / 1e6;
+	std::sort(latencies.begin(), latencies.end());
+
+	std::vector<std::pair<std::string, double>> results =
+	{
+		{"seconds", seconds},
+		{"conns", static_cast<double>(totalConns)},
+		{"failed", static_cast<double>(failed)},
+		{"sent_bytes", static_cast<double>(sentBytes)},
+		{"recv_bytes", static_cast<double>(recvBytes)},
+		{"recv_msgs", static_cast<double>(recvMsgs)},
+		{"recv_mb_per_sec", recvBytes / seconds / (1024 * 1024)},
+		{"msgs_per_sec", recvMsgs / seconds},
+		{"latency_p50_us", static_cast<double>(percentile(latencies, 0.50))},
+		{"latency_p99_us", static_cast<double>(percentile(latencies, 0.99))},
+		{"latency_p999_us", static_cast<double>(percentile(latencies, 0.999))},
+		{"latency_max_us", latencies.empty() ? 0.0 : static_cast<double>(latencies.back())},
+	};
+	std::cout << "REPLAY records:" << records << " speed:" << speed << std::endl;
+	for(auto& [name, value] : results)
+		std::cout << "RESULT " << name << " " << value << std::endl;
+
+	if(!baseline)
+		return;
+	std::ifstream in(baseline);
+	if(!in)
+	{
+		std::cerr << "OPEN BASELINE FAIL, " << baseline << std::endl;
+		return;
+	}
+	std::map<std::string, double> base;
+	std::string line;
+	while(std::getline(in, line))
+	{
+		std::istringstream fields(line);
+		std::string tag, name;
+		double value;
+		if(fields >> tag >> name >> value && tag == "RESULT")
+			base[name] = value;
+	}
+	for(auto& [name, value] : results)
+	{
+		auto iter = base.find(name);
+		if(iter == base.end())
+			continue;
+		std::cout << "DELTA " << name << " " << iter->second << " -> " << value;
+		if(iter->second != 0)
+			std::cout << " (" << (value - iter->second) / iter->second * 100 << "%)";
+		std::cout << std::endl;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if(argc < 2)
+	{
+		std::cerr << "usage: " << argv[0] << " <capture file> [speed, 0 = no wait] [baseline result file] [port]" << std::endl;
+		return 1;
+	}
+	double speed = argc > 2 ? std::atof(argv[2]) : 1.0;
+	const char* baseline = argc > 3 ? argv[3] : nullptr;
+	unsigned short port = argc > 4 ? std::atoi(argv[4]) : 8500;
+
+	// 捕获里有多少连接就开多少
+	struct rlimit limit;
+	if(::getrlimit(RLIMIT_NOFILE, &limit) == 0)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		::setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	Replayer replayer(port, speed);
+	if(!replayer.load(argv[1]))
+		return 1;
+	replayer.run();
+	replayer.report(baseline);
+	return 0;
+}
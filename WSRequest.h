@@ -1,44 +1,49 @@
 #include <string>
-#include <map>
+#include <string_view>
+#include <functional>
+#include <memory>
 #include <algorithm>
 #include <cctype>
 #include <cstring>
+#include <charconv>
 #include "sha1.h"
 #include "base64.h"
-
-#undef htonll
-#define htonll(x) ((1 == htonl(1)) ? (x) : ((uint64_t)htonl((x)&0xFFFFFFFF) << 32) | htonl((x) >> 32))
-#undef ntohll
-#define ntohll(x) htonll(x)
-
-#define WS_KEY "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
-
-std::string str_tolower(std::string str)
-{
-	std::transform(str.begin(), str.end(), str.begin(), [](unsigned char c){ return std::tolower(c); });
-	return str;
-}
+#include "utf8.h"
+#include "WSBuffer.h"
+#include "WSProtocol.h"
+#include "WSRouter.h"
+#include "WSBatch.h"
+#include "WSPost.h"
+#include "WSConflate.h"
+#include "WSRelay.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define WS_FRAGMENT_SIZE (64 * 1024) // 发送分片大小, 也是outBuffer的低水位
+#define WS_MAX_REQUEST 8192 // 握手请求头上限
 
 enum WSState 
 {
-	WS_PARSING_URI = 0,	// 处理请求行
-	WS_PARSING_HEADERS = 1,	// 处理请求头
+	WS_PARSING_URI = 0,	// 等待并解析完整请求头
 	WS_VERIFYING_KEY = 2,	// KEY验证
 	WS_HAND_SHAKING = 3,	// 握手回应
 	WS_TRANSMISSION = 4	// 通信
 };
 
-enum HeaderState 
-{
-	H_START = 0,
-	H_KEY = 1,	// KEY
-	H_COLON = 2,	// KEY后冒号
-	H_SPACE_AFTER_COLON = 3, // KEY后冒号的空格
-	H_VALUE = 4,	// VALUE
-	H_LINE_CR = 5,	// 键值行 \r
-	H_LINE_LF = 6,	// 键值行 \n
-	H_END_CR = 7,	// 尾行 \r
-	H_END_LF = 8,	// 尾行 \n
+// 只关心的请求头, 解析后按槽位存放
+enum WSHeaderSlot
+{
+	HDR_HOST = 0,
+	HDR_UPGRADE = 1,
+	HDR_CONNECTION = 2,
+	HDR_ORIGIN = 3,
+	HDR_WS_KEY = 4,
+	HDR_WS_VERSION = 5,
+	HDR_WS_PROTOCOL = 6,
+	HDR_WS_EXTENSIONS = 7,
+	HDR_SLOT_COUNT = 8
 };
 
 enum ParseResult
@@ -54,16 +59,7 @@ enum WSFrameType
 	RECV_SEGMENT = 1,
 	ERROR = 2,
 	SUCCESS = 3,
-};
-
-enum WSOpcode
-{
-	CONTINUE = 0x0,
-	TEXT = 0x1,
-	BINARY = 0x2,
-	CLOSE = 0x8,
-	PING = 0x9,
-	PONG = 0xA
+	RECV_CONTROL = 4,
 };
 
 struct WSFlag
@@ -72,37 +68,62 @@ struct WSFlag
 	unsigned char payload_len:7, masked:1;
 };
 
+// 流式发送: 向buf写入至多cap字节, 返回写入长度, 写完最后一块时置fin
+using WSProducer = std::function<size_t(char* buf, size_t cap, bool& fin)>;
+
+struct WSOutMsg
+{
+	uint8_t opcode = WSOpcode::TEXT;
+	WSFrameBuffer data;
+	WSProducer producer;
+	WSSpill file; // 转存memfd的大消息
+	size_t offset = 0;
+	bool started = false; // 已发出首个分片
+};
+
 struct WSHttpURI
 {
-	ParseResult parse(std::string& inBuffer);
+	ParseResult parse(std::string_view requestLine);
 
-	std::string resource;
+	std::string_view resource;
 };
 
 struct WSHttpHeaders
 {
-	ParseResult parse(std::string& inBuffer);
-
-	std::map<std::string, std::string> headerMap;
+	ParseResult parse(std::string_view block);
 
-	HeaderState headerState = H_START; 
+	std::string_view slots[HDR_SLOT_COUNT];
 
 	void printHeaders();
 
-	std::string findValue(const std::string&);
+	std::string_view findValue(WSHeaderSlot slot) const { return slots[slot]; }
 };
 
-struct WSSocket
+// 增量解析: 每次只扫描新到的字节找 \r\n\r\n, 请求头完整后一次解析, 结果都是指向inBuffer的视图
+struct WSHttpRequest
 {
+	ParseResult parse(WSInBuffer& inBuffer);
+
 	WSHttpURI uri;
 	WSHttpHeaders headers;
 
-	bool parseBuffer(std::string& inBuffer, std::string& outBuffer);
+	size_t scanned = 0;	// 已确认不含结束符的字节数
+	size_t length = 0;	// 完整请求头长度
+};
+
+// 字段按冷热排列: 收发路径常用的在前; 握手状态和UTF-8校验状态只在需要时从池里借
+struct WSSocket
+{
+	~WSSocket();
+
+	WSHttpRequest* request = nullptr; // 升级完成后归还
+
+	bool parseBuffer(WSInBuffer& inBuffer, WSOutQueue& outBuffer);
 
 	WSState state = WS_PARSING_URI;
 
 	template <typename Parser>
-	bool parse(Parser& parser, std::string& inBuffer, WSState nextState) 
+	bool parse(Parser& parser, WSInBuffer& inBuffer, WSState nextState) 
 	{
 		auto result = parser.parse(inBuffer);
 		if(result == ParseResult::R_SUCCESS) 
@@ -112,69 +133,644 @@ struct WSSocket
 		return true;
 	}
 
-	bool handshake(std::string& outBuffer);
+	bool handshake(WSOutQueue& outBuffer);
 
-	WSFrameType handleMsg(std::string& inBuffer);
+	WSFrameType handleMsg(WSInBuffer& inBuffer);
+	WSFrameType handlePayload(WSInBuffer& inBuffer);
 
-	void sendMsg(std::string& outBuffer);
+	// 处理器回调, 按路由选定的处理器展开成直接调用
+	void onOpen(WSOutQueue& outBuffer);
+	void onMessage(WSOutQueue& outBuffer);
+	void onClose(uint16_t code); // 每个连接只通知一次
 
-	std::string msgQueue;
-	std::string sendQueue;
+	// 协程: 挂起点记在 waiting, 由 parseBuffer / reactor 的定时器和可写事件恢复
+	void wait(WSWait kind, std::coroutine_handle<> h) { waitKind = kind; waiting = h; }
+	void resumeTask();
+	bool sendReady() const { return !hasPendingOutput() && output->size() < fragmentSize; }
+	bool receiving() const { return !task || waitKind == WAIT_RECV; }
+
+	void sendClose(WSOutQueue& outBuffer, uint16_t code);
+
+	// 发送队列: 控制帧严格优先, 可插在分片之间; 数据消息按优先级类别排队, 类别间按权重轮转
+	// msg 在headroom里原地写帧头后直接进入outBuffer, 负载不再拷贝
+	void queueMsg(uint8_t opcode, WSFrameBuffer msg, WSPriority priority = WS_PRIO_AUTO);
+	void queueMsg(uint8_t opcode, const char* data, size_t len, WSPriority priority = WS_PRIO_AUTO);
+	void queueFile(uint8_t opcode, WSSpill file, WSPriority priority = WS_PRIO_AUTO);
+	void queueStream(uint8_t opcode, WSProducer producer, WSPriority priority = WS_PRIO_AUTO);
+	void queueControl(uint8_t opcode, const char* data, size_t len);
+	void queueData(WSOutMsg&& msg, WSPriority priority);
+	void conflate(uint64_t key, uint8_t opcode, WSFrameBuffer msg);
+	bool classPending(uint8_t c) const { return !dataQueues[c].empty() || (c == WS_PRIO_NORMAL && conflator && !conflator->empty()); }
+	uint8_t pickClass();
+
+	// 积压(outBuffer + 排队消息)超过 slowBytes 开始计时, 降回去清零; 返回是否已持续 slowMs
+	bool lagging(size_t outBytes, uint64_t now);
+
+	void pumpOutput(WSOutQueue& outBuffer);
+
+	// 输入读空后调用, 把空闲时用不到的内存还给池
+	void compact();
+	void releaseRequest();
+	void releaseUtf8();
+
+	bool hasPendingOutput() const { return !controlQueue.empty() || pendingMsgs; }
+
+	WSFrameBuffer msgQueue; // 消息交给处理器后清空复用, 除非被 echo 接管
+	WSSpill spill; // 超过 spillSize 的消息写进memfd, 不进msgQueue
+
+	size_t messageSize() const { return msgQueue.size() + spill.size(); }
+	std::string_view message() const { return spill.active() ? spill.view() : std::string_view(msgQueue.data(), msgQueue.size()); }
+	// 消息交出后调用, 下一帧必须是新消息的首帧
+	void clearMessage()
+	{
+		msgQueue.clear();
+		spill.reset();
+		msgOpcode = 0;
+	}
+
+	size_t fragmentSize = WS_FRAGMENT_SIZE;
+	WSRing<WSOutMsg> controlQueue;
+	WSRing<WSOutMsg> dataQueues[WS_PRIORITY_CLASSES];
+	size_t pendingMsgs = 0;
+	int64_t deficit[WS_PRIORITY_CLASSES] = {}; // 本轮剩余额度(字节), 大消息发完可为负
+	uint32_t quantum[WS_PRIORITY_CLASSES] = {8 * WS_DRR_QUANTUM, 4 * WS_DRR_QUANTUM, WS_DRR_QUANTUM};
+	uint8_t activeClass = WS_PRIO_AUTO; // 正在分片发送的消息所属类别
+	uint8_t drrCursor = 0;
+	std::unique_ptr<WSConflator> conflator; // 按键合并的消息, 属于 NORMAL 类, 首次使用时创建
+	size_t queuedBytes = 0; // 排队中还没进outBuffer的字节, 流式消息不计
+	size_t slowBytes = 0;
+	uint32_t slowMs = 0;
+	uint64_t lagSince = 0; // 积压超过阈值的起始时间(ms), 0表示没有
+	uint64_t lagToken = 0;
+	bool closing = false;
+
+	const WSRoute* route = nullptr; // 握手时按路径选定
+	bool opened = false;
+	uint32_t batched = 0; // 在批量队列里等待轮末分派的消息数
+	std::string query;
+
+	uint8_t msgOpcode = 0; // 当前消息的首帧opcode, 续帧沿用; 0 表示没有收到一半的消息
+	bool validateUtf8 = true;
+	bool frameFin = false;
+	bool frameMasked = false;
+	uint8_t frameMask[4] = {0};
+	uint64_t frameRemain = 0; // 大帧边收边处理, 当前帧还没收到的负载字节
+	uint64_t frameOffset = 0; // 当前帧已处理的负载字节, 决定掩码相位
+	size_t maxMessageSize = 0;
+	size_t spillSize = WS_SPILL_SIZE;
+	UTF8Validator* utf8 = nullptr; // 只在TEXT消息收到一半时持有
+	uint16_t closeCode = 0;
+
+	int fd = -1;
+	WSConnHandle handle = 0; // 交给其他线程, 用 wsSend 向本连接投递
+	WSOutQueue* output = nullptr; // 协程在 parseBuffer 之外发送时使用
+	WSWait waitKind = WAIT_NONE;
+	std::coroutine_handle<> waiting;
+	uint64_t sleepToken = 0;
+	WSMessage recvMsg;
+	WSTask task; // 最后声明, 最先销毁, 帧内对象析构时连接状态仍有效
 };
 
-void WSSocket::sendMsg(std::string& outBuffer)
+void WSSocket::sendClose(WSOutQueue& outBuffer, uint16_t code)
 {
-	// std::string respond = "Hi, receive your message!";
-	std::string respond = sendQueue;
+	uint16_t payload = htons(code);
+	queueControl(WSOpcode::CLOSE, reinterpret_cast<const char*>(&payload), sizeof(payload));
+	pumpOutput(outBuffer);
+}
+
+WSSocket::~WSSocket()
+{
+	releaseRequest();
+	releaseUtf8();
+}
 
-	// outBuffer足够大 不分片
-	uint8_t header[14] = {0};
-	int headerLen = 2; 
+void WSSocket::releaseRequest()
+{
+	if(!request)
+		return;
+	*request = WSHttpRequest();
+	WSObjectPool<WSHttpRequest>::release(request);
+	request = nullptr;
+}
 
-	bool masked = false;
-	header[0] = WSOpcode::TEXT | (0x1 << 7); 
-	if(masked)
-		header[1] = 0x1 << 7;
-	size_t len = respond.size();
+void WSSocket::releaseUtf8()
+{
+	if(!utf8)
+		return;
+	utf8->reset();
+	WSObjectPool<UTF8Validator>::release(utf8);
+	utf8 = nullptr;
+}
 
-	if(len < 126)
+void WSSocket::compact()
+{
+	// 消息收到一半时不动
+	if(msgQueue.empty())
+		WSSpareBuffers::give(std::move(msgQueue), fragmentSize);
+}
+
+void WSSocket::onOpen(WSOutQueue& outBuffer)
+{
+	opened = true;
+	WSReply reply(*this, outBuffer);
+	WSHandlers::dispatch(route->handler, [&](auto* handler)
 	{
-		header[1] |= (uint8_t)len;
+		using Handler = std::remove_pointer_t<decltype(handler)>;
+		if constexpr (requires { &Handler::onOpen; })
+			Handler::onOpen(*this, reply);
+		if constexpr (requires { &Handler::run; })
+			task = Handler::run(WSConn{this});
+	});
+	if(task && !closing)
+	{
+		task.resume(); // 跑到第一个挂起点
+		if(task.done())
+			WSReply(*this, outBuffer).close(WS_CLOSE_NORMAL);
 	}
-	else if(len < 65536)
+}
+
+void WSSocket::onMessage(WSOutQueue& outBuffer)
+{
+	std::string_view msg = message();
+	uint8_t opcode = msgOpcode;
+	if(task)
 	{
-		header[1] |= 126;
-		*(uint16_t*)(header + 2) = htons((uint16_t)len);
-		headerLen += 2;
+		// 下一次 recv 时才清空msgQueue, 协程在此之前可一直使用视图
+		recvMsg = {msg, opcode};
+		resumeTask();
+		return;
 	}
-	else 
+	WSReply reply(*this, outBuffer);
+	WSHandlers::dispatch(route->handler, [&](auto* handler)
 	{
-		header[1] |= 127;
-		*(uint64_t*)(header + 2) = htonll((uint64_t)len);
-		headerLen += 8;
+		using Handler = std::remove_pointer_t<decltype(handler)>;
+		if constexpr (requires { &Handler::onBatch; })
+		{
+			if(wsBatch)
+			{
+				wsBatch->push(route->handler, this, opcode);
+				return;
+			}
+		}
+		if constexpr (requires { &Handler::onMessage; })
+			Handler::onMessage(*this, msg, opcode, reply);
+		else if constexpr (requires { &Handler::onBatch; })
+		{
+			WSBatchItem item{this, msg, opcode};
+			Handler::onBatch(std::span<WSBatchItem>(&item, 1));
+		}
+	});
+	clearMessage();
+}
+
+void WSSocket::onClose(uint16_t code)
+{
+	if(!opened)
+		return;
+	opened = false;
+	WSHandlers::dispatch(route->handler, [&](auto* handler)
+	{
+		using Handler = std::remove_pointer_t<decltype(handler)>;
+		if constexpr (requires { &Handler::onClose; })
+			Handler::onClose(*this, code);
+	});
+}
+
+void WSSocket::resumeTask()
+{
+	auto h = waiting;
+	waiting = nullptr;
+	waitKind = WAIT_NONE;
+	h.resume();
+	// 协程返回即正常关闭连接
+	if(task.done() && !closing)
+		WSReply(*this, *output).close(WS_CLOSE_NORMAL);
+}
+
+bool WSRecvAwaiter::await_ready()
+{
+	ws.clearMessage();
+	return false;
+}
+
+void WSRecvAwaiter::await_suspend(std::coroutine_handle<> h)
+{
+	ws.wait(WAIT_RECV, h);
+}
+
+WSMessage WSRecvAwaiter::await_resume()
+{
+	return ws.recvMsg;
+}
+
+bool WSSendAwaiter::await_ready()
+{
+	return ws.sendReady();
+}
+
+void WSSendAwaiter::await_suspend(std::coroutine_handle<> h)
+{
+	ws.wait(WAIT_SEND, h);
+}
+
+void WSSleepAwaiter::await_suspend(std::coroutine_handle<> h)
+{
+	ws.sleepToken = ++wsReactor->nextToken;
+	wsReactor->timers.push({wsNowMs() + ms, ws.sleepToken, ws.fd});
+	ws.wait(WAIT_SLEEP, h);
+}
+
+WSSendAwaiter WSConn::send(uint8_t opcode, std::string_view msg, WSPriority priority)
+{
+	WSReply(*socket, *socket->output).send(opcode, msg.data(), msg.size(), priority);
+	socket->pumpOutput(*socket->output);
+	return {*socket};
+}
+
+void WSConn::close(uint16_t code)
+{
+	WSReply(*socket, *socket->output).close(code);
+}
+
+void WSReply::send(uint8_t opcode, const char* data, size_t len, WSPriority priority)
+{
+	// 有排队消息时直接写会打乱顺序或插进分片之间
+	if(len <= ws.fragmentSize && !ws.hasPendingOutput())
+	{
+		out.appendFrame(opcode, data, len);
+		++wsIoStats.msgs;
+	}
+	else
+		ws.queueMsg(opcode, data, len, priority);
+}
+
+void WSReply::send(uint8_t opcode, WSFrameBuffer&& msg, WSPriority priority)
+{
+	ws.queueMsg(opcode, std::move(msg), priority);
+}
+
+void WSReply::send(uint8_t opcode, WSSpill&& file, WSPriority priority)
+{
+	ws.queueFile(opcode, std::move(file), priority);
+}
+
+void WSReply::conflate(uint64_t key, uint8_t opcode, const char* data, size_t len)
+{
+	ws.conflate(key, opcode, WSFrameBuffer(data, len));
+}
+
+void WSReply::echo()
+{
+	uint8_t opcode = ws.msgOpcode == WSOpcode::BINARY ? WSOpcode::BINARY : WSOpcode::TEXT;
+	if(ws.spill.active())
+		ws.queueFile(opcode, std::move(ws.spill));
+	else
+		ws.queueMsg(opcode, std::move(ws.msgQueue));
+}
+
+void WSReply::close(uint16_t code)
+{
+	uint16_t payload = htons(code);
+	ws.queueControl(WSOpcode::CLOSE, reinterpret_cast<const char*>(&payload), sizeof(payload));
+	ws.closeCode = code;
+	ws.closing = true;
+}
+
+void PubSubHandler::onMessage(WSSocket& ws, std::string_view msg, uint8_t opcode, WSReply& reply)
+{
+	size_t space = msg.find(' ');
+	std::string_view command = msg.substr(0, space);
+	std::string_view rest = space == std::string_view::npos ? std::string_view() : msg.substr(space + 1);
+	std::string_view topic = rest.substr(0, rest.find(' '));
+	if(!wsRelay || topic.empty() || topic.size() > RELAY_MAX_TOPIC)
+	{
+		reply.close(WS_CLOSE_POLICY_VIOLATION);
+		return;
+	}
+	if(command == "SUB")
+		wsRelay->subscribe(ws.handle, topic);
+	else if(command == "UNSUB")
+		wsRelay->unsubscribe(ws.handle, topic);
+	else if(command == "PUB")
+	{
+		std::string_view payload = topic.size() < rest.size() ? rest.substr(topic.size() + 1) : std::string_view();
+		wsRelay->publish(topic, opcode, payload.data(), payload.size());
+	}
+	else
+		reply.close(WS_CLOSE_POLICY_VIOLATION);
+}
+
+WSTask DelayHandler::run(WSConn ws)
+{
+	while(true)
+	{
+		WSMessage msg = co_await ws.recv();
+		size_t space = msg.data.find(' ');
+		std::string_view delay = msg.data.substr(0, space);
+		uint64_t ms = 0;
+		auto [end, error] = std::from_chars(delay.data(), delay.data() + delay.size(), ms);
+		if(delay.empty() || error != std::errc() || end != delay.data() + delay.size() || ms > WS_DELAY_MAX_MS)
+		{
+			ws.close(WS_CLOSE_POLICY_VIOLATION);
+			co_return;
+		}
+		// 睡眠期间不 recv, msg.data 一直有效
+		co_await ws.sleep(ms);
+		co_await ws.send(msg.opcode, space == std::string_view::npos ? std::string_view() : msg.data.substr(space + 1));
+	}
+}
+
+void BatchEchoHandler::onBatch(std::span<WSBatchItem> items)
+{
+	char prefix[24];
+	char* end = std::to_chars(prefix, prefix + sizeof(prefix) - 1, items.size()).ptr;
+	*end++ = ':';
+	size_t prefixLen = end - prefix;
+	for(WSBatchItem& item : items)
+	{
+		// 帧头写在缓冲的 headroom, 回应整帧一次进队列
+		WSFrameBuffer msg(prefixLen + item.msg.size());
+		msg.append(prefix, prefixLen);
+		msg.append(item.msg.data(), item.msg.size());
+		item.reply().send(item.opcode, std::move(msg));
+	}
+}
+
+WSReply WSBatchItem::reply() const
+{
+	return WSReply(*ws, *ws->output);
+}
+
+void WSBatchQueue::push(uint8_t handler, WSSocket* ws, uint8_t opcode)
+{
+	if(items.size() <= handler)
+		items.resize(handler + 1);
+	items[handler].push_back({ws, ws->message(), opcode});
+	// 移动不搬数据, 视图仍然有效
+	if(ws->spill.active())
+		spills.push_back(std::move(ws->spill));
+	else
+	{
+		held.push_back(std::move(ws->msgQueue));
+		ws->msgQueue = WSSpareBuffers::take();
+	}
+	if(!ws->batched++)
+		touched.push_back(ws);
+	++pending;
+}
+
+void WSBatchQueue::drop(WSSocket* ws)
+{
+	for(auto& group : items)
+	{
+		auto end = std::remove_if(group.begin(), group.end(), [ws](const WSBatchItem& item) { return item.ws == ws; });
+		group.erase(end, group.end());
+	}
+	touched.erase(std::remove(touched.begin(), touched.end(), ws), touched.end());
+	pending -= ws->batched;
+	ws->batched = 0;
+}
+
+void WSBatchQueue::flush()
+{
+	for(size_t id = 0; id < items.size(); ++id)
+	{
+		auto& group = items[id];
+		if(group.empty())
+			continue;
+		WSHandlers::dispatch(id, [&](auto* handler)
+		{
+			using Handler = std::remove_pointer_t<decltype(handler)>;
+			if constexpr (requires { &Handler::onBatch; })
+				Handler::onBatch(std::span<WSBatchItem>(group));
+		});
+		group.clear();
 	}
+	for(WSSocket* ws : touched)
+	{
+		ws->batched = 0;
+		ws->pumpOutput(*ws->output);
+	}
+	for(auto& buffer : held)
+		WSSpareBuffers::give(std::move(buffer), WS_FRAGMENT_SIZE);
+	held.clear();
+	spills.clear();
+	pending = 0;
+}
+
+void WSSocket::queueData(WSOutMsg&& msg, WSPriority priority)
+{
+	++wsIoStats.msgs;
+	if(priority >= WS_PRIORITY_CLASSES)
+		priority = !msg.file.active() && !msg.producer && msg.data.size() <= fragmentSize ? WS_PRIO_NORMAL : WS_PRIO_BULK;
+	queuedBytes += msg.file.active() ? msg.file.size() : msg.data.size();
+	dataQueues[priority].push_back(std::move(msg));
+	++pendingMsgs;
+}
+
+void WSSocket::conflate(uint64_t key, uint8_t opcode, WSFrameBuffer msg)
+{
+	if(!conflator)
+		conflator = std::make_unique<WSConflator>();
+	// 替换旧消息时只记大小差, 和 pumpOutput 里的扣减对上
+	size_t size = msg.size();
+	size_t replacedSize = 0;
+	bool replaced = conflator->push(key, opcode, std::move(msg), replacedSize);
+	queuedBytes += size;
+	queuedBytes -= std::min(queuedBytes, replacedSize);
+	if(replaced)
+	{
+		++wsIoStats.conflated;
+		return;
+	}
+	++wsIoStats.msgs;
+	++pendingMsgs;
+}
+
+bool WSSocket::lagging(size_t outBytes, uint64_t now)
+{
+	if(!slowBytes || outBytes + queuedBytes < slowBytes)
+	{
+		lagSince = 0;
+		return false;
+	}
+	if(!lagSince)
+	{
+		lagSince = now;
+		// 之后不再有新数据也要到点检查
+		if(wsReactor)
+		{
+			lagToken = ++wsReactor->nextToken;
+			wsReactor->timers.push({now + slowMs, lagToken, fd});
+		}
+	}
+	return now - lagSince >= slowMs;
+}
 
-	if(masked)
+void WSSocket::queueMsg(uint8_t opcode, WSFrameBuffer msg, WSPriority priority)
+{
+	WSOutMsg out;
+	out.opcode = opcode;
+	out.data = std::move(msg);
+	queueData(std::move(out), priority);
+}
+
+void WSSocket::queueMsg(uint8_t opcode, const char* data, size_t len, WSPriority priority)
+{
+	// 大消息不拷进堆, 先写进memfd再用 sendfile 发
+	if(len > spillSize)
 	{
-		uint8_t maskKey[4] = {0};
-		*(uint8_t*)(header + headerLen) = maskKey[0] = 1;
-		*(uint8_t*)(header + headerLen + 1) = maskKey[1] = 2;
-		*(uint8_t*)(header + headerLen + 2) = maskKey[2] = 3;
-		*(uint8_t*)(header + headerLen + 3) = maskKey[3] = 4;
-		headerLen += 4;
+		WSSpill file;
+		if(file.append(data, len))
+		{
+			queueFile(opcode, std::move(file), priority);
+			return;
+		}
+	}
+	queueMsg(opcode, WSFrameBuffer(data, len), priority);
+}
+
+void WSSocket::queueFile(uint8_t opcode, WSSpill file, WSPriority priority)
+{
+	WSOutMsg out;
+	out.opcode = opcode;
+	out.file = std::move(file);
+	queueData(std::move(out), priority);
+}
 
-		for(int i = 0; i < respond.size(); ++i)
-			respond[i] = respond[i] ^ maskKey[i % 4];
+void WSSocket::queueStream(uint8_t opcode, WSProducer producer, WSPriority priority)
+{
+	WSOutMsg out;
+	out.opcode = opcode;
+	out.producer = std::move(producer);
+	queueData(std::move(out), priority);
+}
+
+void WSSocket::queueControl(uint8_t opcode, const char* data, size_t len)
+{
+	++wsIoStats.msgs;
+	WSOutMsg out;
+	out.opcode = opcode;
+	out.data.append(data, len > 125 ? 125 : len);
+	controlQueue.push_back(std::move(out));
+}
+
+// 赤字轮转(DRR): 从上次的类别起找有消息且额度为正的类; 都用完时按权重给非空类补额度, 空类额度清零
+uint8_t WSSocket::pickClass()
+{
+	while(true)
+	{
+		for(uint8_t i = 0; i < WS_PRIORITY_CLASSES; ++i)
+		{
+			uint8_t c = (drrCursor + i) % WS_PRIORITY_CLASSES;
+			if(classPending(c) && deficit[c] > 0)
+			{
+				drrCursor = c;
+				return c;
+			}
+		}
+		// 大消息欠下的额度可能要补好几轮, 一次补到至少有一个类为正
+		int64_t rounds = INT64_MAX;
+		for(int c = 0; c < WS_PRIORITY_CLASSES; ++c)
+		{
+			if(classPending(c))
+				rounds = std::min<int64_t>(rounds, -deficit[c] / quantum[c] + 1);
+		}
+		for(int c = 0; c < WS_PRIORITY_CLASSES; ++c)
+			deficit[c] = classPending(c) ? deficit[c] + rounds * quantum[c] : 0;
 	}
+}
 
-	outBuffer += std::string(reinterpret_cast<char*>(header), headerLen);
-	outBuffer += respond;
+void WSSocket::pumpOutput(WSOutQueue& outBuffer)
+{
+	while(outBuffer.size() < fragmentSize && hasPendingOutput())
+	{
+		while(!controlQueue.empty())
+		{
+			auto& msg = controlQueue.front();
+			msg.data.encodeHeader(msg.opcode, true);
+			outBuffer.push(std::move(msg.data));
+			controlQueue.pop_front();
+		}
+
+		if(!pendingMsgs)
+			break;
+
+		// 分片中的消息不能插入其他数据帧(RFC 6455 5.4), 只在消息边界换类别
+		if(activeClass == WS_PRIO_AUTO)
+			activeClass = pickClass();
+		auto& queue = dataQueues[activeClass];
+		if(queue.empty())
+		{
+			// 合并队列的消息到这里才定下来, 之后不再被替换
+			WSOutMsg& out = queue.emplace_back();
+			conflator->pop(out.opcode, out.data);
+		}
+		auto& msg = queue.front();
+		size_t before = outBuffer.size();
+		uint8_t opcode = msg.started ? static_cast<uint8_t>(WSOpcode::CONTINUE) : msg.opcode;
+		bool fin = false;
+		if(msg.producer)
+		{
+			// 生产者直接写进新缓冲, 帧头写在其headroom
+			WSFrameBuffer chunk;
+			chunk.resize(fragmentSize);
+			chunk.resize(msg.producer(chunk.data(), fragmentSize, fin));
+			chunk.encodeHeader(opcode, fin);
+			outBuffer.push(std::move(chunk));
+		}
+		else if(msg.file.active())
+		{
+			size_t len = std::min(fragmentSize, msg.file.size() - msg.offset);
+			fin = msg.offset + len == msg.file.size();
+			uint8_t header[WS_HEADROOM];
+			size_t headerLen = writeFrameHeader(header, opcode, fin, len);
+			outBuffer.pushFile(header, headerLen, msg.file, msg.offset, len, fin);
+			msg.offset += len;
+		}
+		else if(!msg.started)
+		{
+			// 首个分片的帧头写在整条消息的headroom里
+			size_t len = std::min(fragmentSize, msg.data.size());
+			fin = len == msg.data.size();
+			msg.data.encodeHeader(opcode, fin, len, nullptr);
+			if(fin)
+				outBuffer.push(std::move(msg.data));
+			else
+				outBuffer.pushFragment(nullptr, 0, msg.data.frameData(), msg.data.headerSize() + len);
+			msg.offset = len;
+		}
+		else
+		{
+			size_t len = std::min(fragmentSize, msg.data.size() - msg.offset);
+			fin = msg.offset + len == msg.data.size();
+			uint8_t header[WS_HEADROOM];
+			size_t headerLen = writeFrameHeader(header, opcode, fin, len);
+			const char* payload = msg.data.data() + msg.offset;
+			msg.offset += len;
+			// 最后一个分片接管内存, 之前的分片先于它发出
+			outBuffer.pushFragment(header, headerLen, payload, len, fin ? &msg.data : nullptr);
+		}
+		msg.started = true;
+		deficit[activeClass] -= outBuffer.size() - before;
+		queuedBytes -= std::min(queuedBytes, outBuffer.size() - before);
+		if(fin)
+		{
+			queue.pop_front();
+			--pendingMsgs;
+			activeClass = WS_PRIO_AUTO;
+			if(!pendingMsgs)
+				queuedBytes = 0;
+		}
+	}
 }
 
-WSFrameType WSSocket::handleMsg(std::string& inBuffer)
+WSFrameType WSSocket::handleMsg(WSInBuffer& inBuffer)
 {
-	int bufferSize = inBuffer.size();
-	if(bufferSize < 2)
+	if(frameRemain)
+		return handlePayload(inBuffer);
+
+	if(inBuffer.size() < 2)
 		return INCOMPLETE_DATA;
 
 	const char* buffer = inBuffer.c_str();
@@ -183,11 +779,28 @@ WSFrameType WSSocket::handleMsg(std::string& inBuffer)
 	std::memcpy(&flag, buffer, 2);
 
 	if((flag.opcode > WSOpcode::BINARY && flag.opcode < WSOpcode::CLOSE) || (flag.opcode > WSOpcode::PONG))
+	{
+		closeCode = WS_CLOSE_PROTOCOL_ERROR;
 		return ERROR;
+	}
 
+	// 没有协商扩展, RSV必须为0; 控制帧不能分片, 负载不超过125, 在读扩展长度之前就拒绝, 不会按声明长度缓存
+	if(flag.rsv1 || flag.rsv2 || flag.rsv3 || (flag.opcode >= WSOpcode::CLOSE && (!flag.fin || flag.payload_len > 125)))
+	{
+		closeCode = WS_CLOSE_PROTOCOL_ERROR;
+		return ERROR;
+	}
 
-	int dataLen = 0;
-	int headerLen = 2;
+	// 数据帧顺序 (RFC 6455 5.4): 续帧只能接在没收完的消息后面, 没收完时不能开始新消息; 控制帧可插在分片之间
+	if(flag.opcode < WSOpcode::CLOSE && (flag.opcode == WSOpcode::CONTINUE) == (msgOpcode == 0))
+	{
+		closeCode = WS_CLOSE_PROTOCOL_ERROR;
+		return ERROR;
+	}
+
+	size_t bufferSize = inBuffer.size();
+	uint64_t dataLen = 0;
+	size_t headerLen = 2;
 
 	if(flag.payload_len <= 125)
 	{
@@ -208,291 +821,425 @@ WSFrameType WSSocket::handleMsg(std::string& inBuffer)
 			return INCOMPLETE_DATA;
 
 		dataLen = ntohll(*(uint64_t*)(buffer + 2));
+		// 64位长度最高位必须为0
+		if(dataLen >> 63)
+		{
+			closeCode = WS_CLOSE_PROTOCOL_ERROR;
+			return ERROR;
+		}
 	}
 
 	std::cout << "handleMsg opcode:" << (int)flag.opcode << " fin:" << (int)flag.fin << " plen:" << (int)flag.payload_len << " masked:" << (int)flag.masked << " dataLen:" << dataLen << " bufferSize:" << bufferSize << std::endl;
 
-	int totalLen = headerLen + dataLen + (flag.masked ? 4 : 0); 
-	if(totalLen > bufferSize)
+	// 按声明长度提前拒绝, 不必等整帧收完; 已收的部分不会超过 maxMessageSize, 用减法不会回绕
+	if(flag.opcode < WSOpcode::CLOSE && dataLen > maxMessageSize - messageSize())
 	{
-		std::cout << "INCOMPLETE_DATA, headerLen:" << headerLen << ", dataLen:" << dataLen << ", masked:" << (int)flag.masked << ",bufferSize:" << bufferSize << " maskKey:";
-
-		if(flag.masked && headerLen + 4 <= bufferSize)
-		{
-			uint8_t maskKey[4] = {0};
-			*(uint32_t*)maskKey = *(uint32_t*)(buffer + headerLen);
-			std::cout << (int)maskKey[0] << " " << (int)maskKey[1] << " " << (int)maskKey[2] << " " << (int)maskKey[3] << std::endl;
-		}
+		std::cout << "handleMsg message too big, route:" << route->path << std::endl;
+		closeCode = WS_CLOSE_MESSAGE_TOO_BIG;
+		return ERROR;
+	}
 
+	uint64_t payloadPos = headerLen + (flag.masked ? 4 : 0);
+	uint64_t totalLen = payloadPos + dataLen; 
+	// 超过一个分片的数据帧不等整帧收齐, 已到的负载先处理掉, inBuffer 不随帧长增长
+	bool streaming = flag.opcode < WSOpcode::CLOSE && dataLen > fragmentSize && payloadPos <= bufferSize;
+	if(totalLen > bufferSize && !streaming)
+	{
+		std::cout << "INCOMPLETE_DATA, headerLen:" << headerLen << ", dataLen:" << dataLen << ", masked:" << (int)flag.masked << ",bufferSize:" << bufferSize << std::endl;
 		return INCOMPLETE_DATA;
 	}
 
 	uint8_t maskKey[4] = {0};
-	unsigned char data[dataLen] = {0};
-	std::memcpy(data, buffer + headerLen + (flag.masked ? 4 : 0), dataLen);
-	
 	if(flag.masked)
-	{
-		*(uint32_t*)maskKey = *(uint32_t*)(buffer + headerLen);
-		for(int i = 0; i < dataLen; ++i)
-			data[i] ^= maskKey[i % 4];
-	}
+		std::memcpy(maskKey, buffer + headerLen, 4);
+	const char* payload = buffer + headerLen + (flag.masked ? 4 : 0);
 
 	auto result = static_cast<WSFrameType>(flag.opcode);
 
-	msgQueue += std::string(reinterpret_cast<const char*>(data), dataLen);
+	// 控制帧不进msgQueue, 回应走控制队列, 可插在正在发送的分片之间
+	if(flag.opcode >= WSOpcode::CLOSE)
+	{
+		char data[125];
+		std::memcpy(data, payload, dataLen);
+		if(flag.masked)
+			maskPayload(data, dataLen, maskKey);
+		inBuffer.erase(0, totalLen);
+
+		if(flag.opcode == WSOpcode::PING)
+			queueControl(WSOpcode::PONG, data, dataLen);
+		else if(flag.opcode == WSOpcode::CLOSE)
+		{
+			uint16_t code = htons(WS_CLOSE_NORMAL);
+			queueControl(WSOpcode::CLOSE, reinterpret_cast<const char*>(&code), sizeof(code));
+			closeCode = WS_CLOSE_NO_STATUS;
+			if(dataLen >= 2)
+			{
+				std::memcpy(&code, data, 2);
+				closeCode = ntohs(code);
+			}
+			closing = true;
+		}
+		return RECV_CONTROL;
+	}
 
-	inBuffer = inBuffer.substr(totalLen); 
+	if(flag.opcode != WSOpcode::CONTINUE)
+	{
+		// 新消息不继承上一条的校验状态
+		releaseUtf8();
+		msgOpcode = flag.opcode;
+	}
 
-	if(flag.fin)
+	// 消息超过阈值后改存memfd, 已收的部分一并搬过去; 同样用减法比较, 流式分片的 frameRemain 已受上面 maxMessageSize 限制
+	if(!spill.active() && (messageSize() > spillSize || dataLen > spillSize - messageSize()))
 	{
-		std::cout << "handleMsg COMPLETE DATA, size:" << msgQueue.size() << ",maskKey:" << (int)maskKey[0] << std::endl;
+		if(!spill.append(msgQueue.data(), msgQueue.size()))
+		{
+			closeCode = WS_CLOSE_INTERNAL_ERROR;
+			return ERROR;
+		}
+		WSSpareBuffers::give(std::move(msgQueue), fragmentSize);
+	}
 
-		sendQueue = msgQueue;
-		msgQueue.clear();
+	std::memcpy(frameMask, maskKey, 4);
+	frameMasked = flag.masked;
+	frameFin = flag.fin;
+	frameRemain = dataLen;
+	frameOffset = 0;
+	inBuffer.erase(0, payloadPos);
+	result = handlePayload(inBuffer);
+
+	std::cout << "Finish handleMsg, leftSize:" << inBuffer.size() << " queueSize:" << messageSize() << " totalLen:" << totalLen << " handerLen:" << headerLen << " dataLen:" << dataLen << " result:" << result << std::endl;
 
-		result = SUCCESS;
+	return result;
+}
+
+// 处理当前帧已到的负载, 帧没收完返回 INCOMPLETE_DATA
+WSFrameType WSSocket::handlePayload(WSInBuffer& inBuffer)
+{
+	size_t len = std::min<uint64_t>(frameRemain, inBuffer.size());
+
+	// 直接解掩码到msgQueue, 回显时连同headroom整块交给发送队列; memfd则在inBuffer里原地解掩码再写入
+	char* data = inBuffer.data();
+	if(!spill.active())
+	{
+		if(!msgQueue.capacity())
+			msgQueue = WSSpareBuffers::take();
+		data = msgQueue.grow(len);
+		if(len)
+			std::memcpy(data, inBuffer.data(), len);
 	}
-	else
-       	{
-		std::cout << "handleMsg SEGMENT" << ",maskKey:" << (int)maskKey[0] <<std::endl;
-		
-		result = RECV_SEGMENT;
+	if(frameMasked)
+		maskPayload(data, len, frameMask, frameOffset);
+
+	// TEXT消息逐帧流式校验, 多字节字符可跨分片
+	bool last = frameRemain == len;
+	if(msgOpcode == WSOpcode::TEXT && validateUtf8)
+	{
+		if(!utf8)
+			utf8 = WSObjectPool<UTF8Validator>::borrow();
+		bool valid = utf8->feed(data, len);
+		if(valid && last && frameFin)
+			valid = utf8->finish();
+		if(!valid || (last && frameFin))
+			releaseUtf8();
+		if(!valid)
+		{
+			std::cout << "handleMsg invalid utf8" << std::endl;
+			closeCode = WS_CLOSE_INVALID_PAYLOAD;
+			return ERROR;
+		}
 	}
 
-	std::cout << "Finish handleMsg, leftSize:" << inBuffer.size() << " queueSize:" << msgQueue.size() << " totalLen:" << totalLen << " handerLen:" << headerLen << " dataLen:" << dataLen << " result:" << result << std::endl;
+	if(spill.active() && !spill.append(data, len))
+	{
+		closeCode = WS_CLOSE_INTERNAL_ERROR;
+		return ERROR;
+	}
 
-	return result;
+	inBuffer.erase(0, len);
+	frameRemain -= len;
+	frameOffset += len;
+	if(!last)
+		return INCOMPLETE_DATA;
+
+	if(!frameFin)
+	{
+		std::cout << "handleMsg SEGMENT" << std::endl;
+		return RECV_SEGMENT;
+	}
+
+	std::cout << "handleMsg COMPLETE DATA, size:" << messageSize() << std::endl;
+	// 收齐后只读映射给处理器
+	if(spill.active() && !spill.map())
+	{
+		closeCode = WS_CLOSE_INTERNAL_ERROR;
+		return ERROR;
+	}
+	return SUCCESS;
 }
 
-bool WSSocket::parseBuffer(std::string& inBuffer, std::string& outBuffer)
+bool WSSocket::parseBuffer(WSInBuffer& inBuffer, WSOutQueue& outBuffer)
 {
 	if(state == WS_PARSING_URI)
 	{
-		if(!parse(uri, inBuffer, WS_PARSING_HEADERS))
+		if(!request)
+			request = WSObjectPool<WSHttpRequest>::borrow();
+		if(!parse(*request, inBuffer, WS_VERIFYING_KEY))
 			return false;
 	}
-	if(state == WS_PARSING_HEADERS)
+	if(state == WS_VERIFYING_KEY)
 	{
-		if(!parse(headers, inBuffer, WS_VERIFYING_KEY))
+		if(!handshake(outBuffer))
 			return false;
+		inBuffer.erase(0, request->length);
+		releaseRequest();
+		onOpen(outBuffer);
 	}
-	if(state == WS_VERIFYING_KEY)
+	if(state == WS_TRANSMISSION)
 	{
-		if(!handshake(outBuffer))
+		while(!closing && receiving())
+		{
+			auto result = handleMsg(inBuffer);
+			if(result == WSFrameType::INCOMPLETE_DATA)
+				break;
+			if(result == WSFrameType::SUCCESS)
+			{
+				onMessage(outBuffer);
+				pumpOutput(outBuffer);
+			}
+			else if(result == WSFrameType::ERROR)
+			{
+				releaseUtf8();
+				sendClose(outBuffer, closeCode);
+				onClose(closeCode);
+				return false;
+			}
+		}
+		pumpOutput(outBuffer);
+		if(closing)
+		{
+			releaseUtf8();
+			onClose(closeCode);
 			return false;
+		}
+		if(inBuffer.empty())
+			compact();
 	}
-	else if(state == WS_TRANSMISSION)
+	return true;
+}
+
+// 返回 [p, end) 中第一个 a 或 b 的位置, 没有则返回 end
+inline const char* findEither(const char* p, const char* end, char a, char b)
+{
+#if defined(__SSE2__)
+	const __m128i va = _mm_set1_epi8(a);
+	const __m128i vb = _mm_set1_epi8(b);
+	for(; p + 16 <= end; p += 16)
 	{
-		if(handleMsg(inBuffer) == WSFrameType::SUCCESS)
-			sendMsg(outBuffer);
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+		int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+		if(mask)
+			return p + __builtin_ctz(mask);
+	}
+#endif
+	for(; p < end; ++p)
+	{
+		if(*p == a || *p == b)
+			return p;
+	}
+	return end;
+}
+
+inline bool equalsLower(std::string_view value, std::string_view lower)
+{
+	if(value.size() != lower.size())
+		return false;
+	for(size_t i = 0; i < value.size(); ++i)
+	{
+		if((value[i] | 0x20) != lower[i] && value[i] != lower[i])
+			return false;
 	}
 	return true;
 }
 
-bool WSSocket::handshake(std::string& outBuffer)
+// 逗号分隔的token列表中是否有 token (忽略大小写), 如 "keep-alive, Upgrade"
+inline bool tokenListContains(std::string_view value, std::string_view token)
+{
+	while(!value.empty())
+	{
+		size_t comma = value.find(',');
+		std::string_view item = value.substr(0, comma);
+		while(!item.empty() && (item.front() == ' ' || item.front() == '\t'))
+			item.remove_prefix(1);
+		while(!item.empty() && (item.back() == ' ' || item.back() == '\t'))
+			item.remove_suffix(1);
+		if(equalsLower(item, token))
+			return true;
+		if(comma == std::string_view::npos)
+			break;
+		value.remove_prefix(comma + 1);
+	}
+	return false;
+}
+
+// 请求头名长度互不相同, 先按长度分派再比较一次
+inline int headerSlot(std::string_view name)
+{
+	switch(name.size())
+	{
+		case 4: return equalsLower(name, "host") ? HDR_HOST : -1;
+		case 6: return equalsLower(name, "origin") ? HDR_ORIGIN : -1;
+		case 7: return equalsLower(name, "upgrade") ? HDR_UPGRADE : -1;
+		case 10: return equalsLower(name, "connection") ? HDR_CONNECTION : -1;
+		case 17: return equalsLower(name, "sec-websocket-key") ? HDR_WS_KEY : -1;
+		case 21: return equalsLower(name, "sec-websocket-version") ? HDR_WS_VERSION : -1;
+		case 22: return equalsLower(name, "sec-websocket-protocol") ? HDR_WS_PROTOCOL : -1;
+		case 24: return equalsLower(name, "sec-websocket-extensions") ? HDR_WS_EXTENSIONS : -1;
+		default: return -1;
+	}
+}
+
+bool WSSocket::handshake(WSOutQueue& outBuffer)
 {
-	std::string value = headers.findValue("upgrade");
-	if(value.empty() || str_tolower(value) != "websocket")
+	const auto& headers = request->headers;
+	if(!tokenListContains(headers.findValue(HDR_UPGRADE), "websocket"))
 		return false;
-	value = headers.findValue("connection");
-	if(value.empty() || str_tolower(value) != "upgrade")
+	if(!tokenListContains(headers.findValue(HDR_CONNECTION), "upgrade"))
 		return false;
-	value = headers.findValue("sec-websocket-version");
-	if(value.empty() || value != "13")
+	if(headers.findValue(HDR_WS_VERSION) != "13")
 		return false;
 	
-	std::string secretKey = headers.findValue("sec-websocket-key");
-	if(secretKey.empty())
+	char accept[WS_ACCEPT_LEN];
+	if(!wsAcceptKey(headers.findValue(HDR_WS_KEY), accept))
 		return false;
-	secretKey += WS_KEY;
 
-	SHA1 sha;
-	unsigned int digest[5];
-	sha.Reset();
-	sha << secretKey.c_str();
-	sha.Result(digest);
-	for(int i = 0; i < 5; i++)
-		digest[i] = htonl(digest[i]);
-	secretKey = base64_encode(reinterpret_cast<const unsigned char*>(digest), 20);
-
-	std::string respond;
-	respond += "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: upgrade\r\nSec-WebSocket-Accept: ";
-	respond += secretKey;
-	respond += "\r\n\r\n";
-
-	outBuffer += respond;
+	std::string_view queryString;
+	route = findRoute(request->uri.resource, &queryString);
+	if(!route)
+	{
+		static const char notFound[] = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+		outBuffer.append(notFound, sizeof(notFound) - 1);
+		std::cout << "handshake no route: " << request->uri.resource << std::endl;
+		return false;
+	}
+	query.assign(queryString);
+	validateUtf8 = route->settings.validateUtf8;
+	maxMessageSize = route->settings.maxMessageSize;
+	fragmentSize = route->settings.fragmentSize;
+	spillSize = route->settings.spillSize;
+	slowBytes = route->settings.slowBytes;
+	slowMs = route->settings.slowMs;
+	for(int i = 0; i < WS_PRIORITY_CLASSES; ++i)
+		quantum[i] = std::max<uint32_t>(route->settings.priorityWeights[i], 1) * WS_DRR_QUANTUM;
+
+	static const char prefix[] = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: upgrade\r\nSec-WebSocket-Accept: ";
+	WSFrameBuffer respond(sizeof(prefix) - 1 + WS_ACCEPT_LEN + 4);
+	respond.append(prefix, sizeof(prefix) - 1);
+	respond.append(accept, WS_ACCEPT_LEN);
+	respond.append("\r\n\r\n", 4);
+	outBuffer.push(std::move(respond));
 
 	state = WS_TRANSMISSION;
-	std::cout << "FINISH handshake, return key: " << secretKey << std::endl;
+	std::cout << "FINISH handshake, return key: " << std::string_view(accept, WS_ACCEPT_LEN) << std::endl;
 
 	return true;
 }
 
-ParseResult WSHttpURI::parse(std::string& inBuffer)
+ParseResult WSHttpRequest::parse(WSInBuffer& inBuffer)
 {
-	auto pos = inBuffer.find('\r');	
-	if(pos == std::string::npos)
-		return R_WAITING;
-	std::string requestLine = inBuffer.substr(0, pos);
+	const char* begin = inBuffer.data();
+	const char* end = begin + inBuffer.size();
 
-	if(inBuffer.size() >= pos + 1)
-		inBuffer = inBuffer.substr(pos + 1); // exclude \r
-	else
-		inBuffer.clear();
+	// 从上次扫描位置继续找结束符, 回退3字节以覆盖跨读的 \r\n\r\n
+	const char* p = begin + (scanned > 3 ? scanned - 3 : 0);
+	while(true)
+	{
+		p = findEither(p, end, '\r', '\r');
+		if(end - p < 4)
+			break;
+		if(p[1] == '\n' && p[2] == '\r' && p[3] == '\n')
+		{
+			length = p + 4 - begin;
+			break;
+		}
+		++p;
+	}
+	if(!length)
+	{
+		scanned = inBuffer.size();
+		return scanned > WS_MAX_REQUEST ? R_ERROR : R_WAITING;
+	}
 
-	if(requestLine.substr(0, 3).compare("GET"))
+	std::string_view head(begin, length - 2); // 保留最后一行的 \r\n
+	size_t lineEnd = head.find("\r\n");
+	if(uri.parse(head.substr(0, lineEnd)) != R_SUCCESS)
 		return R_ERROR;
-
-	pos = requestLine.find("/ws"); // router
-	if(pos == std::string::npos)
+	if(headers.parse(head.substr(lineEnd + 2)) != R_SUCCESS)
 		return R_ERROR;
 
-	auto spacePos = requestLine.find(' ', pos);
-	if(spacePos == std::string::npos)
+	std::cout << "FINISH WSHttpRequest" << std::endl;
+	return R_SUCCESS;
+}
+
+ParseResult WSHttpURI::parse(std::string_view requestLine)
+{
+	if(requestLine.substr(0, 4) != "GET ")
 		return R_ERROR;
+	requestLine.remove_prefix(4);
 
-	resource = requestLine.substr(pos, spacePos);
-	pos = spacePos + 1;
+	auto spacePos = requestLine.find(' ');
+	if(spacePos == std::string_view::npos)
+		return R_ERROR;
 
-	pos = requestLine.find("/", pos);
-	if(pos == std::string::npos || requestLine.size() - pos <= 3)
+	resource = requestLine.substr(0, spacePos);
+	if(resource.empty() || resource[0] != '/') // 路由在握手时匹配
 		return R_ERROR;
-	std::string version = requestLine.substr(pos + 1, 3);
-	if(version != "1.1")
+
+	if(requestLine.substr(spacePos + 1) != "HTTP/1.1")
 		return R_ERROR;
 
-	std::cout << "FINISH WSHttpURI" << std::endl;
 	return R_SUCCESS;
 }
 	
-ParseResult WSHttpHeaders::parse(std::string& inBuffer)
+ParseResult WSHttpHeaders::parse(std::string_view block)
 {
-	int keyBegin = -1, keyEnd = -1, valueBegin = -1, valueEnd = -1;
-	int readPos = 0;
+	const char* p = block.data();
+	const char* end = p + block.size();
 
-	size_t i = 0;
-	for(; i < inBuffer.size() && headerState != H_END_LF; ++i)
+	while(p < end)
 	{
-		switch(headerState)
+		const char* colon = findEither(p, end, ':', '\r');
+		if(colon == end || *colon != ':' || colon == p)
+			return R_ERROR;
+		std::string_view name(p, colon - p);
+
+		const char* valueBegin = colon + 1;
+		const char* cr = findEither(valueBegin, end, '\r', '\r');
+		if(end - cr < 2 || cr[1] != '\n')
+			return R_ERROR;
+
+		int slot = headerSlot(name);
+		if(slot >= 0)
 		{
-			case H_START:
-				{
-					if(inBuffer[i] == '\r' || inBuffer[i] == '\n')
-						break;
-					headerState = H_KEY;
-					keyBegin = i;
-					readPos = i;
-				}
-				break;
-			case H_KEY:
-				{
-					if(inBuffer[i] == '\r' || inBuffer[i] == '\n')
-						return R_ERROR;
-					if(inBuffer[i] == ':')
-					{
-						keyEnd = i;
-						if(keyEnd - keyBegin <= 0)
-							return R_ERROR;
-						headerState = H_COLON;
-					}
-				}
-				break;
-			case H_COLON:
-				{
-					if(inBuffer[i] == ' ')
-						headerState = H_SPACE_AFTER_COLON;
-					else
-						return R_ERROR;
-				}
-				break;
-			case H_SPACE_AFTER_COLON:
-				{
-					headerState = H_VALUE;
-					valueBegin = i;
-				}
-				break;
-			case H_VALUE:
-				{
-					if(inBuffer[i] == '\r')
-					{
-						headerState = H_LINE_CR;
-						valueEnd = i;
-						if(valueEnd - valueBegin <= 0)
-							return R_ERROR;
-					}
-					else if(i - valueBegin > 255)
-						return R_ERROR;
-				}
-				break;
-			case H_LINE_CR:
-				{
-					if(inBuffer[i] == '\n')
-					{
-						headerState = H_LINE_LF;
-						std::string key(inBuffer.begin() + keyBegin, inBuffer.begin() + keyEnd);
-						std::string value(inBuffer.begin() + valueBegin, inBuffer.begin() + valueEnd);
-						headerMap[str_tolower(key)] = value;
-						readPos = i;
-						keyBegin = keyEnd = valueBegin = valueEnd = -1;
-					}
-					else
-						return R_ERROR;
-				}
-				break;
-			case H_LINE_LF:
-				{
-					if(inBuffer[i] == '\r')
-						headerState = H_END_CR;
-					else
-					{
-						headerState = H_KEY;
-						keyBegin = i;
-					}
-				}
-				break;
-			case H_END_CR:
-				{
-					if(inBuffer[i] == '\n')
-						headerState = H_END_LF;
-					else
-						return R_ERROR;
-				}
-				break;
-			default:
-				break;
+			std::string_view value(valueBegin, cr - valueBegin);
+			while(!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+				value.remove_prefix(1);
+			while(!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+				value.remove_suffix(1);
+			slots[slot] = value;
 		}
+		p = cr + 2;
 	}
-	if(headerState == H_END_LF)
-	{
-		std::cout << "FINISH WSHttpHeaders" << std::endl;
-		inBuffer = inBuffer.substr(i);
-
-		std::cout << "InBuffer:" << inBuffer << std::endl;
-
-		// printHeaders();
-
-		return R_SUCCESS;
-	}
-	else
-		inBuffer = inBuffer.substr(readPos);
-
-	return R_WAITING;
+	return R_SUCCESS;
 }
 
 void WSHttpHeaders::printHeaders()
 {
+	static const char* names[HDR_SLOT_COUNT] = {"host", "upgrade", "connection", "origin", "sec-websocket-key", "sec-websocket-version", "sec-websocket-protocol", "sec-websocket-extensions"};
 	std::cout << "Headers:" << std::endl;
-	for(const auto& [key, value] : headerMap)
+	for(int i = 0; i < HDR_SLOT_COUNT; ++i)
 	{
-		std::cout << key << " : " << value << std::endl;
+		if(!slots[i].empty())
+			std::cout << names[i] << " : " << slots[i] << std::endl;
 	}
 }
-
-std::string WSHttpHeaders::findValue(const std::string& header)
-{
-	auto iter = headerMap.find(header);
-	if(iter != headerMap.end())
-		return iter->second;
-	return "";
-}
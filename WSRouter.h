@@ -0,0 +1,134 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string_view>
+#include <iterator>
+#include "WSHandler.h"
+
+// 所有处理器, 路由表按类型引用
+using WSHandlers = WSHandlerList<EchoHandler, PubSubHandler, DelayHandler, BatchEchoHandler>;
+
+struct WSRouteSettings
+{
+	size_t maxMessageSize = 16 * 1024 * 1024;
+	size_t fragmentSize = 64 * 1024;
+	bool validateUtf8 = true; // 内部可信客户端可跳过UTF-8校验
+	size_t spillSize = WS_SPILL_SIZE; // 超过后消息转存memfd, 不占堆
+	uint8_t priorityWeights[WS_PRIORITY_CLASSES] = {8, 4, 1}; // 按 WSPriority 下标, 0 按 1 算
+	size_t slowBytes = 8 * 1024 * 1024; // 待发送积压超过此值持续 slowMs 即断开, 0 不检查
+	uint32_t slowMs = 10 * 1000;
+};
+
+struct WSRoute
+{
+	std::string_view path;
+	uint8_t handler; // WSHandlers 中的下标
+	WSRouteSettings settings;
+};
+
+constexpr WSRouteSettings trustedSettings()
+{
+	WSRouteSettings settings;
+	settings.validateUtf8 = false;
+	return settings;
+}
+
+// 路由表, 编译期生成完美哈希
+inline constexpr WSRoute wsRoutes[] =
+{
+	{"/ws", WSHandlers::id<EchoHandler>(), {}},
+	{"/ws/internal", WSHandlers::id<EchoHandler>(), trustedSettings()},
+	{"/ws/pubsub", WSHandlers::id<PubSubHandler>(), {}},
+	{"/ws/delay", WSHandlers::id<DelayHandler>(), {}},
+	{"/ws/batch", WSHandlers::id<BatchEchoHandler>(), {}},
+};
+
+constexpr uint32_t routeHash(std::string_view path, uint32_t seed)
+{
+	uint32_t hash = 2166136261u ^ seed;
+	for(char c : path)
+	{
+		hash ^= static_cast<uint8_t>(c);
+		hash *= 16777619u;
+	}
+	// 乘法只往高位进位, 低位只取决于种子的低位, 槽位按低位取, 要把高位折下来
+	return hash ^ (hash >> 16);
+}
+
+// 编译期找一个让所有路径落到不同槽位的种子, 查找时一次哈希 + 一次比较
+template <size_t N>
+struct WSRouteTable
+{
+	static constexpr size_t slotCount()
+	{
+		size_t size = 1;
+		while(size < N * 2)
+			size <<= 1;
+		return size;
+	}
+
+	const WSRoute* routes;
+	uint32_t seed = 0;
+	int16_t slots[slotCount()] = {};
+
+	constexpr explicit WSRouteTable(const WSRoute (&table)[N]) : routes(table)
+	{
+		for(; seed < 100000; ++seed)
+		{
+			for(auto& slot : slots)
+				slot = -1;
+			bool collision = false;
+			for(size_t i = 0; i < N && !collision; ++i)
+			{
+				auto index = routeHash(table[i].path, seed) & (slotCount() - 1);
+				if(slots[index] != -1)
+					collision = true;
+				else
+					slots[index] = static_cast<int16_t>(i);
+			}
+			if(!collision)
+				return;
+		}
+		throw "no perfect hash seed for route table";
+	}
+
+	const WSRoute* find(std::string_view path) const
+	{
+		int16_t index = slots[routeHash(path, seed) & (slotCount() - 1)];
+		if(index < 0 || routes[index].path != path)
+			return nullptr;
+		return &routes[index];
+	}
+};
+
+inline constexpr WSRouteTable<std::size(wsRoutes)> wsRouteTable(wsRoutes);
+
+// resource 拆成路径和查询串
+inline const WSRoute* findRoute(std::string_view resource, std::string_view* query = nullptr)
+{
+	auto queryPos = resource.find('?');
+	if(query)
+		*query = queryPos == std::string_view::npos ? std::string_view() : resource.substr(queryPos + 1);
+	return wsRouteTable.find(resource.substr(0, queryPos));
+}
+
+// 查询串中取参数值, 不做百分号解码
+inline bool findQueryParam(std::string_view query, std::string_view name, std::string_view& value)
+{
+	while(!query.empty())
+	{
+		auto amp = query.find('&');
+		std::string_view pair = query.substr(0, amp);
+		auto eq = pair.find('=');
+		if(pair.substr(0, eq) == name)
+		{
+			value = eq == std::string_view::npos ? std::string_view() : pair.substr(eq + 1);
+			return true;
+		}
+		if(amp == std::string_view::npos)
+			break;
+		query.remove_prefix(amp + 1);
+	}
+	return false;
+}
@@ -0,0 +1,283 @@
+#include "WSShm.h"
+#include <iostream>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#define SHM_HEADER_SIZE 4096 // 每个环的头部占一页, 数据页对齐
+
+static void wake(int fd)
+{
+	uint64_t one = 1;
+	while(::write(fd, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+// 抽象 unix socket 没有文件权限, 谁都能连或抢先监听; 只和同一用户的进程交换共享内存
+static bool samePeerUser(int sock)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	if(::getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+		return false;
+	if(cred.uid != ::geteuid())
+	{
+		std::cerr << "SHM PEER UID " << cred.uid << " PID " << cred.pid << " REFUSED" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// 出错时把收到的fd都关掉, 不管有几个控制消息
+static void closeReceived(struct msghdr& msg)
+{
+	for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for(size_t i = 0; i < count; ++i)
+		{
+			int fd;
+			std::memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(fd));
+			::close(fd);
+		}
+	}
+}
+
+void WSShmRing::attach(WSShmRingHeader* _header, int _wakeReader, int _wakeWriter)
+{
+	header = _header;
+	data = reinterpret_cast<char*>(header) + SHM_HEADER_SIZE;
+	mask = header->capacity - 1;
+	cachedHead = header->head.load(std::memory_order_acquire);
+	cachedTail = header->tail.load(std::memory_order_acquire);
+	wakeReader = _wakeReader;
+	wakeWriter = _wakeWriter;
+	waiting = false;
+}
+
+size_t WSShmRing::write(const char* src, size_t len)
+{
+	uint64_t head = header->head.load(std::memory_order_relaxed);
+	uint64_t capacity = mask + 1;
+	if(head - cachedTail + len > capacity)
+		cachedTail = header->tail.load(std::memory_order_acquire);
+	if(head - cachedTail == capacity)
+	{
+		if(waiting)
+			return 0;
+		// 置标志后复查, 和消费者的 tail 更新配对, 不会漏掉唤醒
+		header->writerWaiting.store(1, std::memory_order_relaxed);
+		waiting = true;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		cachedTail = header->tail.load(std::memory_order_acquire);
+		if(head - cachedTail == capacity)
+			return 0;
+	}
+	if(waiting)
+	{
+		header->writerWaiting.store(0, std::memory_order_relaxed);
+		waiting = false;
+	}
+
+	size_t n = std::min<uint64_t>(len, capacity - (head - cachedTail));
+	size_t offset = head & mask;
+	size_t first = std::min<size_t>(n, capacity - offset);
+	std::memcpy(data + offset, src, first);
+	std::memcpy(data, src + first, n - first);
+	header->head.store(head + n, std::memory_order_release);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if(header->readerWaiting.load(std::memory_order_relaxed))
+		wake(wakeReader);
+	return n;
+}
+
+size_t WSShmRing::read(char* buf, size_t len)
+{
+	uint64_t tail = header->tail.load(std::memory_order_relaxed);
+	if(cachedHead == tail)
+		cachedHead = header->head.load(std::memory_order_acquire);
+	if(cachedHead == tail)
+	{
+		if(waiting)
+			return 0;
+		header->readerWaiting.store(1, std::memory_order_relaxed);
+		waiting = true;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		cachedHead = header->head.load(std::memory_order_acquire);
+		if(cachedHead == tail)
+			return 0;
+	}
+	if(waiting)
+	{
+		header->readerWaiting.store(0, std::memory_order_relaxed);
+		waiting = false;
+	}
+
+	size_t n = std::min<uint64_t>(len, cachedHead - tail);
+	size_t offset = tail & mask;
+	size_t first = std::min<size_t>(n, mask + 1 - offset);
+	std::memcpy(buf, data + offset, first);
+	std::memcpy(buf + first, data, n - first);
+	header->tail.store(tail + n, std::memory_order_release);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if(header->writerWaiting.load(std::memory_order_relaxed))
+		wake(wakeWriter);
+	return n;
+}
+
+WSShmChannel::~WSShmChannel()
+{
+	if(base)
+		::munmap(base, size);
+	for(int fd : {memfd, efd[0], efd[1]})
+		if(fd >= 0)
+			::close(fd);
+}
+
+bool WSShmChannel::create(size_t ringSize)
+{
+	if(ringSize & (ringSize - 1))
+	{
+		std::cerr << "SHM RING SIZE NOT POWER OF 2, " << ringSize << std::endl;
+		return false;
+	}
+	memfd = ::memfd_create("ws-shm", MFD_CLOEXEC);
+	efd[0] = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	efd[1] = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(memfd < 0 || efd[0] < 0 || efd[1] < 0)
+	{
+		std::cerr << "SHM CREATE ERROR, " << errno << std::endl;
+		return false;
+	}
+	size = 2 * (SHM_HEADER_SIZE + ringSize);
+	if(::ftruncate(memfd, size) < 0)
+	{
+		std::cerr << "SHM FTRUNCATE ERROR, " << errno << std::endl;
+		return false;
+	}
+	side = 0;
+	if(!map())
+		return false;
+	// memfd 初始全零, 只需写容量
+	for(int i = 0; i < 2; ++i)
+		reinterpret_cast<WSShmRingHeader*>(base + i * (SHM_HEADER_SIZE + ringSize))->capacity = ringSize;
+	return attachRings();
+}
+
+bool WSShmChannel::map()
+{
+	void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if(p == MAP_FAILED)
+	{
+		std::cerr << "SHM MMAP ERROR, " << errno << std::endl;
+		return false;
+	}
+	base = static_cast<char*>(p);
+	return true;
+}
+
+// 环0由发起方写, 环1由接受方写; 环的读者等在自己那端的 eventfd 上
+bool WSShmChannel::attachRings()
+{
+	WSShmRingHeader* rings[2];
+	rings[0] = reinterpret_cast<WSShmRingHeader*>(base);
+	uint64_t capacity = rings[0]->capacity;
+	if(!capacity || (capacity & (capacity - 1)) || size != 2 * (SHM_HEADER_SIZE + capacity))
+	{
+		std::cerr << "SHM BAD LAYOUT" << std::endl;
+		return false;
+	}
+	rings[1] = reinterpret_cast<WSShmRingHeader*>(base + SHM_HEADER_SIZE + capacity);
+	out.attach(rings[side], efd[1 - side], efd[side]);
+	in.attach(rings[1 - side], efd[side], efd[1 - side]);
+	return true;
+}
+
+void WSShmChannel::clearWake()
+{
+	uint64_t count;
+	while(::read(efd[side], &count, sizeof(count)) < 0 && errno == EINTR);
+}
+
+bool WSShmChannel::sendTo(int sock) const
+{
+	if(!samePeerUser(sock))
+	{
+		errno = EACCES;
+		return false;
+	}
+	int fds[3] = {memfd, efd[0], efd[1]};
+	char control[CMSG_SPACE(sizeof(fds))];
+	std::memset(control, 0, sizeof(control));
+	char tag = 'S';
+	struct iovec iov = {&tag, 1};
+	struct msghdr msg;
+	std::memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	ssize_t ret;
+	while((ret = ::sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+	return ret == 1;
+}
+
+bool WSShmChannel::recvFrom(int sock)
+{
+	int fds[3];
+	char control[CMSG_SPACE(sizeof(fds))];
+	char tag;
+	struct iovec iov = {&tag, 1};
+	struct msghdr msg;
+	std::memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	ssize_t ret;
+	while((ret = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+	if(ret <= 0)
+	{
+		if(ret == 0)
+			errno = ECONNRESET;
+		return false;
+	}
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if(tag != 'S' || (msg.msg_flags & MSG_CTRUNC) || !cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+			|| cmsg->cmsg_len != CMSG_LEN(sizeof(fds)) || CMSG_NXTHDR(&msg, cmsg) || !samePeerUser(sock))
+	{
+		std::cerr << "SHM BAD HANDSHAKE" << std::endl;
+		closeReceived(msg);
+		errno = EPROTO;
+		return false;
+	}
+	std::memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	memfd = fds[0];
+	efd[0] = fds[1];
+	efd[1] = fds[2];
+	side = 1;
+	struct stat st;
+	if(::fstat(memfd, &st) < 0)
+	{
+		errno = EPROTO;
+		return false;
+	}
+	size = st.st_size;
+	if(!map() || !attachRings())
+	{
+		errno = EPROTO;
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+
+// 同机进程间的共享内存通道: 一个memfd里放两个单生产者单消费者字节环, 各管一个方向, 加两个 eventfd 唤醒.
+// 环当作字节流用, 接口和 send/recv 一样可以只写/读一部分, 上层协议不用改.
+// 读空/写满时先置等待标志再复查一次, 对端只在看到标志时写 eventfd, 持续有数据时两边都不进内核
+
+#define WS_SHM_RING_SIZE (4 * 1024 * 1024) // 每个方向的容量, 须为2的幂
+
+struct WSShmRingHeader
+{
+	alignas(64) std::atomic<uint64_t> head; // 写入总字节数, 只有生产者改
+	alignas(64) std::atomic<uint64_t> tail; // 读出总字节数, 只有消费者改
+	alignas(64) std::atomic<uint32_t> readerWaiting;
+	std::atomic<uint32_t> writerWaiting;
+	uint64_t capacity;
+};
+
+class WSShmRing
+{
+	public:
+		// header 之后紧跟 capacity 字节数据; 读写两端唤醒对方用的 eventfd
+		void attach(WSShmRingHeader* _header, int _wakeReader, int _wakeWriter);
+
+		// 返回实际写入的字节数, 写满返回0并等消费者唤醒
+		size_t write(const char* data, size_t len);
+
+		// 返回实际读出的字节数, 读空返回0并等生产者唤醒
+		size_t read(char* buf, size_t len);
+
+	private:
+		WSShmRingHeader* header = nullptr;
+		char* data = nullptr;
+		uint64_t mask = 0;
+		uint64_t cachedHead = 0; // 消费者缓存的对端位置, 不够时才去读共享的
+		uint64_t cachedTail = 0; // 生产者缓存的对端位置
+		int wakeReader = -1;
+		int wakeWriter = -1;
+		bool waiting = false; // 本端已置等待标志, 有进展后自己清掉
+};
+
+// 发起方 create 后 sendTo, 对端 recvFrom; 两端的 in/out 方向相反
+class WSShmChannel
+{
+	public:
+		WSShmChannel() = default;
+		~WSShmChannel();
+		WSShmChannel(const WSShmChannel&) = delete;
+		WSShmChannel& operator = (const WSShmChannel&) = delete;
+
+		bool create(size_t ringSize = WS_SHM_RING_SIZE);
+
+		// 本端的 eventfd, 可读表示有数据进来或出方向有了空间; 读之前先 clearWake
+		int wakeFd() const { return efd[side]; }
+		void clearWake();
+
+		// memfd 和两个 eventfd 经 unix socket 用 SCM_RIGHTS 传给对端; 还没收到时 recvFrom 返回 false 且 errno 为 EAGAIN
+		bool sendTo(int sock) const;
+		bool recvFrom(int sock);
+
+		WSShmRing in;
+		WSShmRing out;
+
+	private:
+		bool map();
+		bool attachRings();
+
+		int memfd = -1;
+		int efd[2] = {-1, -1};
+		int side = 0; // 0 发起方, 1 接受方
+		char* base = nullptr;
+		size_t size = 0;
+};
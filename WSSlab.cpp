@@ -0,0 +1,222 @@
+#include "WSSlab.h"
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sys/mman.h>
+
+namespace
+{
+	struct FreeNode
+	{
+		FreeNode* next;
+	};
+
+	struct Pool;
+
+	// 放在chunk末尾, 块从chunk开头切
+	struct alignas(64) ChunkHeader
+	{
+		Pool* owner;
+		uint32_t sizeClass;
+	};
+
+	struct Pool
+	{
+		FreeNode* local[WS_SLAB_CLASSES] = {};
+		std::atomic<FreeNode*> remote[WS_SLAB_CLASSES] = {};
+
+		// 当前chunk里还没切出去的部分
+		char* bump[WS_SLAB_CLASSES] = {};
+		char* bumpEnd[WS_SLAB_CLASSES] = {};
+
+		size_t chunks[WS_SLAB_CLASSES] = {};
+		size_t inUse[WS_SLAB_CLASSES] = {};
+		size_t freeCount[WS_SLAB_CLASSES] = {};
+		std::atomic<uint64_t> remoteFrees{0};
+	};
+
+	std::atomic<int> hugePageMode{WS_HUGEPAGE_NONE};
+
+	// 大块可能在任意线程释放, 计数放全局
+	std::atomic<size_t> largeInUse{0};
+	std::atomic<size_t> largeBytes{0};
+
+	// 线程退出时可能还有块在别的线程手里, Pool 不释放
+	thread_local Pool* localPool = nullptr;
+
+	Pool* pool()
+	{
+		if(!localPool)
+			localPool = new Pool();
+		return localPool;
+	}
+
+	inline size_t classIndex(size_t n)
+	{
+		if(n <= (size_t(1) << WS_SLAB_MIN_SHIFT))
+			return 0;
+		return 64 - __builtin_clzll(n - 1) - WS_SLAB_MIN_SHIFT;
+	}
+
+	inline ChunkHeader* chunkOf(void* p)
+	{
+		uintptr_t base = reinterpret_cast<uintptr_t>(p) & ~uintptr_t(WS_SLAB_CHUNK - 1);
+		return reinterpret_cast<ChunkHeader*>(base + WS_SLAB_CHUNK - sizeof(ChunkHeader));
+	}
+
+	char* mapChunk()
+	{
+		if(hugePageMode == WS_HUGEPAGE_HUGETLB)
+		{
+			// 2MB大页天然2MB对齐
+			void* p = ::mmap(nullptr, WS_SLAB_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if(p != MAP_FAILED)
+				return static_cast<char*>(p);
+		}
+
+		// 多映射一个chunk再裁掉两头, 得到2MB对齐的区域
+		void* raw = ::mmap(nullptr, WS_SLAB_CHUNK * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(raw == MAP_FAILED)
+			abort();
+		uintptr_t begin = reinterpret_cast<uintptr_t>(raw);
+		uintptr_t aligned = (begin + WS_SLAB_CHUNK - 1) & ~uintptr_t(WS_SLAB_CHUNK - 1);
+		if(aligned > begin)
+			::munmap(raw, aligned - begin);
+		if(aligned + WS_SLAB_CHUNK < begin + WS_SLAB_CHUNK * 2)
+			::munmap(reinterpret_cast<void*>(aligned + WS_SLAB_CHUNK), begin + WS_SLAB_CHUNK * 2 - aligned - WS_SLAB_CHUNK);
+		if(hugePageMode != WS_HUGEPAGE_NONE)
+			::madvise(reinterpret_cast<void*>(aligned), WS_SLAB_CHUNK, MADV_HUGEPAGE);
+		return reinterpret_cast<char*>(aligned);
+	}
+
+	void* refill(Pool* p, size_t index)
+	{
+		// 先取回其他线程还回来的块
+		FreeNode* remote = p->remote[index].exchange(nullptr, std::memory_order_acquire);
+		if(remote)
+		{
+			size_t count = 0;
+			for(FreeNode* node = remote; node; node = node->next)
+				++count;
+			p->inUse[index] -= count;
+			p->freeCount[index] += count - 1;
+			p->local[index] = remote->next;
+			return remote;
+		}
+
+		size_t size = size_t(1) << (index + WS_SLAB_MIN_SHIFT);
+		if(p->bump[index] + size > p->bumpEnd[index])
+		{
+			char* chunk = mapChunk();
+			ChunkHeader* header = chunkOf(chunk);
+			header->owner = p;
+			header->sizeClass = index;
+			p->bump[index] = chunk;
+			p->bumpEnd[index] = reinterpret_cast<char*>(header);
+			++p->chunks[index];
+		}
+		// 按需切分, 没用到的页不会计入RSS
+		void* block = p->bump[index];
+		p->bump[index] += size;
+		return block;
+	}
+}
+
+void wsSlabConfigure(WSHugePage mode)
+{
+	hugePageMode = mode;
+}
+
+void* wsSlabAlloc(size_t n)
+{
+	if(n > (size_t(1) << WS_SLAB_MAX_SHIFT))
+	{
+		void* block = ::malloc(n);
+		if(!block)
+			abort();
+		largeInUse.fetch_add(1, std::memory_order_relaxed);
+		largeBytes.fetch_add(n, std::memory_order_relaxed);
+		return block;
+	}
+
+	Pool* p = pool();
+	size_t index = classIndex(n);
+	++p->inUse[index];
+	FreeNode* node = p->local[index];
+	if(node)
+	{
+		p->local[index] = node->next;
+		--p->freeCount[index];
+		return node;
+	}
+	return refill(p, index);
+}
+
+void wsSlabFree(void* block, size_t n)
+{
+	if(!block)
+		return;
+	if(n > (size_t(1) << WS_SLAB_MAX_SHIFT))
+	{
+		::free(block);
+		largeInUse.fetch_sub(1, std::memory_order_relaxed);
+		largeBytes.fetch_sub(n, std::memory_order_relaxed);
+		return;
+	}
+
+	ChunkHeader* header = chunkOf(block);
+	Pool* owner = header->owner;
+	size_t index = header->sizeClass;
+	FreeNode* node = static_cast<FreeNode*>(block);
+	if(owner == localPool)
+	{
+		node->next = owner->local[index];
+		owner->local[index] = node;
+		++owner->freeCount[index];
+		--owner->inUse[index];
+		return;
+	}
+
+	// 跨线程释放: 压进所属线程的无锁栈; 所属线程只会整批 exchange 取走, 没有ABA问题
+	FreeNode* head = owner->remote[index].load(std::memory_order_relaxed);
+	do
+	{
+		node->next = head;
+	} while(!owner->remote[index].compare_exchange_weak(head, node, std::memory_order_release, std::memory_order_relaxed));
+	owner->remoteFrees.fetch_add(1, std::memory_order_relaxed);
+}
+
+void wsSlabStats(WSSlabStats& stats)
+{
+	std::memset(&stats, 0, sizeof(stats));
+	Pool* p = pool();
+	for(size_t i = 0; i < WS_SLAB_CLASSES; ++i)
+	{
+		auto& cls = stats.classes[i];
+		cls.blockSize = size_t(1) << (i + WS_SLAB_MIN_SHIFT);
+		cls.chunks = p->chunks[i];
+		cls.free = p->freeCount[i] + (p->bumpEnd[i] - p->bump[i]) / cls.blockSize;
+		// 其他线程还回来但还没取回的块仍记在 inUse 里
+		cls.inUse = p->inUse[i];
+		stats.mappedBytes += cls.chunks * WS_SLAB_CHUNK;
+		stats.inUseBytes += cls.inUse * cls.blockSize;
+	}
+	stats.largeInUse = largeInUse.load(std::memory_order_relaxed);
+	stats.largeBytes = largeBytes.load(std::memory_order_relaxed);
+	stats.remoteFrees = p->remoteFrees.load(std::memory_order_relaxed);
+}
+
+void wsSlabPrintStats()
+{
+	WSSlabStats stats;
+	wsSlabStats(stats);
+	std::cout << "SLAB STATS mapped:" << stats.mappedBytes << " inUse:" << stats.inUseBytes
+		<< " large:" << stats.largeInUse << "/" << stats.largeBytes << " remoteFrees:" << stats.remoteFrees << std::endl;
+	for(const auto& cls : stats.classes)
+	{
+		if(!cls.chunks)
+			continue;
+		std::cout << "  " << cls.blockSize << "B chunks:" << cls.chunks << " inUse:" << cls.inUse << " free:" << cls.free << std::endl;
+	}
+}
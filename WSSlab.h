@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// 缓冲区slab分配器: 按2的幂分级(64B ~ 256KB), 每个线程(reactor)一套空闲链表,
+// 2MB对齐的chunk只切一种大小, chunk尾部记录所属线程和级别.
+// 其他线程释放的块压进所属线程的无锁栈, 由所属线程分配时整批取回.
+// 超过最大级别的直接走 malloc.
+
+#define WS_SLAB_MIN_SHIFT 6
+#define WS_SLAB_MAX_SHIFT 18
+#define WS_SLAB_CLASSES (WS_SLAB_MAX_SHIFT - WS_SLAB_MIN_SHIFT + 1)
+#define WS_SLAB_CHUNK (2 * 1024 * 1024)
+
+enum WSHugePage
+{
+	WS_HUGEPAGE_NONE = 0,
+	WS_HUGEPAGE_THP = 1,	// madvise(MADV_HUGEPAGE), 由内核透明大页决定
+	WS_HUGEPAGE_HUGETLB = 2,	// MAP_HUGETLB, 失败时退回 THP
+};
+
+// 进程启动时设置一次, 只影响之后新映射的chunk
+void wsSlabConfigure(WSHugePage mode);
+
+// 返回至少n字节的块, 分配失败直接 abort, 不返回空; 释放时传同样的n
+__attribute__((returns_nonnull)) void* wsSlabAlloc(size_t n);
+void wsSlabFree(void* p, size_t n);
+
+// n 实际会占用的大小, 调用方可以把多出的部分当容量用
+inline size_t wsSlabRound(size_t n)
+{
+	if(n <= (size_t(1) << WS_SLAB_MIN_SHIFT))
+		return size_t(1) << WS_SLAB_MIN_SHIFT;
+	if(n > (size_t(1) << WS_SLAB_MAX_SHIFT))
+		return n;
+	return size_t(1) << (64 - __builtin_clzll(n - 1));
+}
+
+struct WSSlabClassStats
+{
+	size_t blockSize;
+	size_t chunks;
+	size_t inUse;
+	size_t free;	// 空闲链表 + 未切分的部分
+};
+
+struct WSSlabStats
+{
+	WSSlabClassStats classes[WS_SLAB_CLASSES];
+	size_t mappedBytes;
+	size_t inUseBytes;
+	size_t largeInUse;	// 走 malloc 的块
+	size_t largeBytes;
+	uint64_t remoteFrees;
+};
+
+// 当前线程的占用统计
+void wsSlabStats(WSSlabStats& stats);
+void wsSlabPrintStats();
+
+// 供标准容器使用, 如接收缓冲的 basic_string
+template <typename T>
+struct WSSlabAllocator
+{
+	using value_type = T;
+
+	WSSlabAllocator() = default;
+	template <typename U>
+	WSSlabAllocator(const WSSlabAllocator<U>&) {}
+
+	T* allocate(size_t n) { return static_cast<T*>(wsSlabAlloc(n * sizeof(T))); }
+	void deallocate(T* p, size_t n) { wsSlabFree(p, n * sizeof(T)); }
+
+	template <typename U>
+	bool operator == (const WSSlabAllocator<U>&) const { return true; }
+	template <typename U>
+	bool operator != (const WSSlabAllocator<U>&) const { return false; }
+};
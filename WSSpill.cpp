@@ -0,0 +1,82 @@
+#include "WSSpill.h"
+#include <iostream>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+
+WSSpill::WSSpill(WSSpill&& other) noexcept
+	: fd(other.fd), len(other.len), mapped(other.mapped)
+{
+	other.fd = -1;
+	other.len = 0;
+	other.mapped = nullptr;
+}
+
+WSSpill& WSSpill::operator = (WSSpill&& other) noexcept
+{
+	if(this != &other)
+	{
+		reset();
+		fd = other.fd;
+		len = other.len;
+		mapped = other.mapped;
+		other.fd = -1;
+		other.len = 0;
+		other.mapped = nullptr;
+	}
+	return *this;
+}
+
+bool WSSpill::append(const char* data, size_t n)
+{
+	if(fd < 0)
+	{
+		fd = ::memfd_create("ws-spill", MFD_CLOEXEC);
+		if(fd < 0)
+		{
+			std::cerr << "SPILL memfd_create ERROR, " << errno << std::endl;
+			return false;
+		}
+	}
+	while(n)
+	{
+		ssize_t ret = ::write(fd, data, n);
+		if(ret < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			std::cerr << "SPILL WRITE ERROR, " << errno << std::endl;
+			return false;
+		}
+		data += ret;
+		n -= ret;
+		len += ret;
+	}
+	return true;
+}
+
+bool WSSpill::map()
+{
+	if(mapped || !len)
+		return fd >= 0;
+	void* p = ::mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+	if(p == MAP_FAILED)
+	{
+		std::cerr << "SPILL MMAP ERROR, " << errno << std::endl;
+		return false;
+	}
+	mapped = static_cast<char*>(p);
+	return true;
+}
+
+void WSSpill::reset()
+{
+	if(mapped)
+		::munmap(mapped, len);
+	if(fd >= 0)
+		::close(fd);
+	fd = -1;
+	len = 0;
+	mapped = nullptr;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+
+#define WS_SPILL_SIZE (1024 * 1024) // 默认超过1MB的消息转存memfd
+
+// 大消息的memfd存储: 收的时候顺序写入, 收齐后只读映射给处理器; 发送时用 sendfile 直接从文件发
+// 内容在 tmpfs 里, 不占堆, 内存紧张时可被换出
+class WSSpill
+{
+	public:
+		WSSpill() = default;
+		~WSSpill() { reset(); }
+		WSSpill(WSSpill&& other) noexcept;
+		WSSpill& operator = (WSSpill&& other) noexcept;
+		WSSpill(const WSSpill&) = delete;
+		WSSpill& operator = (const WSSpill&) = delete;
+
+		bool active() const { return fd >= 0; }
+		int fileFd() const { return fd; }
+		size_t size() const { return len; }
+
+		// 首次追加时创建memfd; 失败返回 false
+		bool append(const char* data, size_t n);
+
+		// 只读映射全部内容, 之后 view() 有效
+		bool map();
+		std::string_view view() const { return std::string_view(mapped, mapped ? len : 0); }
+
+		void reset();
+
+	private:
+		int fd = -1;
+		size_t len = 0;
+		char* mapped = nullptr;
+};
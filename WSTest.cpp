@@ -0,0 +1,502 @@
+#include <string>
+#include <string_view>
+#include <iostream>
+#include <vector>
+#include <tuple>
+#include <functional>
+#include <algorithm>
+#include <cstdlib>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "WSClient.h"
+#include "WSCoroutine.h"
+
+// 端到端测试: 起一个 TCPServer 子进程, 用 WSClient 连上去检查服务端和客户端库的行为, 由 ctest 运行.
+//   WSTest <TCPServer 路径> [端口, 默认 18500]
+// 某项失败时打印出错的检查, 继续跑下一项, 有失败返回 1
+
+#define TEST_CHECK(cond) do { if(!(cond)) { std::cerr << "CHECK FAIL line " << __LINE__ << ": " << #cond << std::endl; return false; } } while(0)
+#define TEST_WAIT_MS 3000
+
+static const char* serverPath = nullptr;
+static unsigned short port = 18500;
+static pid_t server = -1;
+
+static void startServer()
+{
+	server = ::fork();
+	if(server == 0)
+	{
+		// 服务器的调试输出很多, 不混进测试结果
+		int null = ::open("/dev/null", O_WRONLY);
+		::dup2(null, STDOUT_FILENO);
+		::dup2(null, STDERR_FILENO);
+		std::string portArg = std::to_string(port);
+		::execl(serverPath, serverPath, "-p", portArg.c_str(), nullptr);
+		_exit(127);
+	}
+}
+
+static void stopServer()
+{
+	if(server <= 0)
+		return;
+	::kill(server, SIGKILL);
+	::waitpid(server, nullptr, 0);
+	server = -1;
+}
+
+// 处理事件直到 done 为真, 超时返回 false
+static bool pollUntil(WSClientReactor& reactor, uint64_t timeoutMs, const std::function<bool()>& done)
+{
+	uint64_t deadline = wsNowMs() + timeoutMs;
+	while(!done())
+	{
+		uint64_t now = wsNowMs();
+		if(now >= deadline)
+			return false;
+		reactor.poll(reactor.nextTimeout(std::min<uint64_t>(deadline - now, 50)));
+	}
+	return true;
+}
+
+static WSClientConfig testConfig(const char* path)
+{
+	WSClientConfig config;
+	config.port = port;
+	config.path = path;
+	config.reconnectMinMs = 50;
+	config.reconnectMaxMs = 400;
+	return config;
+}
+
+struct Received
+{
+	std::vector<std::pair<std::string, uint8_t>> msgs;
+	std::vector<uint16_t> closes;
+	int opens = 0;
+
+	void attach(WSClient* ws)
+	{
+		ws->onOpen = [this](WSClient&) { ++opens; };
+		ws->onMessage = [this](WSClient&, std::string_view msg, uint8_t opcode) { msgs.emplace_back(msg, opcode); };
+		ws->onClose = [this](WSClient&, uint16_t code) { closes.push_back(code); };
+	}
+};
+
+// 回显: 文本原样返回, 客户端分片发出的二进制消息由服务端拼好整条回来; 主动关闭收到对端的 1000
+static bool testEcho()
+{
+	WSClientReactor reactor;
+	WSClientConfig config = testConfig("/ws");
+	config.fragmentSize = 1000;
+	WSClient* ws = reactor.connect(config);
+	Received got;
+	got.attach(ws);
+	TEST_CHECK(pollUntil(reactor, TEST_WAIT_MS, [&]() { return ws->isOpen(); }));
+
+	std::string blob(5000, '\0');
+	for(size_t i = 0; i < blob.size(); ++i)
+		blob[i] = static_cast<char>(i * 7);
+	TEST_CHECK(ws->text("hello"));
+	TEST_CHECK(ws->binary(blob));
+	TEST_CHECK(pollUntil(reactor, TEST_WAIT_MS, [&]() { return got.msgs.size() >= 2; }));
+	TEST_CHECK(got.msgs[0].first == "hello" && got.msgs[0].second == WSOpcode::TEXT);
+	TEST_CHECK(got.msgs[1].first == blob && got.msgs[1].second == WSOpcode::BINARY);
+
+	ws->close();
+	TEST_CHECK(pollUntil(reactor, TEST_WAIT_MS, [&]() { return ws->getState() == CLIENT_IDLE; }));
+	TEST_CHECK(got.closes.size() == 1 && got.closes[0] == WS_CLOSE_NORMAL);
+	TEST_CHECK(!ws->text("late"));
+	return true;
+}
+
+// 服务端按策略关闭时带上关闭码; 在 onClose 里 remove, 不再重连也不再回调
+static bool testPolicyClose()
+{
+	WSClientReactor reactor;
+	WSClient* ws = reactor.connect(testConfig("/ws/pubsub"));
+	Received got;
+	got.attach(ws);
+	ws->onClose = [&](WSClient& client, uint16_t code)
+	{
+		got.closes.push_back(code);
+		reactor.remove(&client);
+	};
+	TEST_CHECK(pollUntil(reactor, TEST_WAIT_MS, [&]() { return ws->isOpen(); }));
+	TEST_CHECK(ws->text("BOGUS x"));
+	TEST_CHECK(pollUntil(reactor, TEST_WAIT_MS, [&]() { return !got.closes.empty(); }));
+	TEST_CHECK(got.closes[0] == WS_CLOSE_POLICY_VIOLATION);
+	TEST_CHECK(reactor.size() == 0);
+	// 重连的退避时间过了也没有新连接
+	pollUntil(reactor, 300, []() { return false; });
+	TEST_CHECK(got.opens == 1 && got.closes.size() == 1);
+	return true;
+}
+
+// remove 后槽位给新连接, 旧连接残留的定时器和事件不会落到新连接上
+static bool testRemove()
+{
+	WSClientReactor reactor;
+	std::vector<WSClient*> clients;
+	std::vector<Received> got(4);
+	for(int i = 0; i < 3; ++i)
+	{
+		clients.push_back(reactor.connect(testConfig("/ws")));
+		got[i].attach(clients.back());
+	}
+	// 第一个在自己的 onOpen 里移除
+	clients[0]->onOpen = [&](WSClient& ws) { ++got[0].opens; reactor.remove(&ws); };
+	TEST_CHECK(pollUntil(reactor, TEST_WAIT_MS, [&]() { return got[0].opens && clients[1]->isOpen() && clients[2]->isOpen(); }));
+	TEST_CHECK(reactor.size() == 2);
+
+	// 在回调之外移除一个已连上的
+	reactor.remove(clients[1]);
+	TEST_CHECK(reactor.size() == 1);
+	reactor.poll(0);
+
+	WSClient* fresh = reactor.connect(testConfig("/ws"));
+	got[3].attach(fresh);
+	TEST_CHECK(reactor.size() == 2);
+	TEST_CHECK(pollUntil(reactor, TEST_WAIT_MS, [&]() { return fresh->isOpen(); }));
+	TEST_CHECK(fresh->text("fresh") && clients[2]->text("old"));
+	TEST_CHECK(pollUntil(reactor, TEST_WAIT_MS, [&]() { return got[3].msgs.size() == 1 && got[2].msgs.size() == 1; }));
+	TEST_CHECK(got[3].msgs[0].first == "fresh" && got[2].msgs[0].first == "old");
+	TEST_CHECK(got[0].msgs.empty() && got[1].msgs.empty() && got[1].closes.empty());
+	return true;
+}
+
+// 协程处理器: 按请求睡眠后回发, 后一条等前一条睡完, 回应同序; 睡眠中断开不影响别的连接; 格式不对按策略关闭
+static bool testDelay()
+{
+	WSClientReactor reactor;
+	WSClient* ws = reactor.connect(testConfig("/ws/delay"));
+	Received got;
+	got.attach(ws);
+	std::vector<uint64_t> arrived;
+	ws->onMessage = [&](WSClient&, std::string_view msg, uint8_t opcode)
+	{
+		got.msgs.emplace_back(msg, opcode);
+		arrived.push_back(wsNowMs());
+	};
+	TEST_CHECK(pollUntil(reactor, TEST_WAIT_MS, [&]() { return ws->isOpen(); }));
+
+	uint64_t start = wsNowMs();
+	TEST_CHECK(ws->text("300 slow") && ws->text("0 fast") && ws->binary("100 \x01\x02"));
+	TEST_CHECK(pollUntil(reactor, TEST_WAIT_MS, [&]() { return got.msgs.size() == 3; }));
+	TEST_CHECK(got.msgs[0].first == "slow" && got.msgs[1].first == "fast" && got.msgs[2].first == "\x01\x02");
+	TEST_CHECK(got.msgs[2].second == WSOpcode::BINARY);
+	std::cout << "DELAYED " << arrived[0] - start << "ms " << arrived[1] - start << "ms " << arrived[2] - start << "ms" << std::endl;
+	TEST_CHECK(arrived[0] - start >= 300 && arrived[2] - start >= 400);
+
+	// 另一个连接在睡眠中断开, 定时器到期时连接已不在
+	WSClient* gone = reactor.connect(testConfig("/ws/delay"));
+	TEST_CHECK(pollUntil(reactor, TEST_WAIT_MS, [&]() { return gone->isOpen(); }));
+	TEST_CHECK(gone->text("200 never"));
+	pollUntil(reactor, 50, []() { return false; });
+	reactor.remove(gone);
+	pollUntil(reactor, 300, []() { return false; });
+	TEST_CHECK(ws->text("0 alive"));
+	TEST_CHECK(pollUntil(reactor, TEST_WAIT_MS, [&]() { return got.msgs.size() == 4; }));
+	TEST_CHECK(got.msgs[3].first == "alive");
+
+	TEST_CHECK(ws->text("soon x"));
+	TEST_CHECK(pollUntil(reactor, TEST_WAIT_MS, [&]() { return !got.closes.empty(); }));
+	TEST_CHECK(got.closes[0] == WS_CLOSE_POLICY_VIOLATION);
+	return true;
+}
+
+// 裸连接: 握手后把一串帧用一次 write 发出, 保证服务端在同一轮 epoll 里读到; 读回服务端的帧直到对端关闭
+struct RawConn
+{
+	int fd = -1;
+
+	~RawConn() { if(fd >= 0) ::close(fd); }
+
+	bool open(const char* path)
+	{
+		fd = ::socket(AF_INET, SOCK_STREAM, 0);
+		struct timeval timeout = {TEST_WAIT_MS / 1000, 0};
+		::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		struct sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if(::connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0)
+			return false;
+		std::string request = std::string("GET ") + path + " HTTP/1.1\r\nHost: 127.0.0.1\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+		if(::write(fd, request.data(), request.size()) != static_cast<ssize_t>(request.size()))
+			return false;
+		// 服务端握手完才回应, 之前不会有帧跟在响应后面
+		std::string response;
+		char c;
+		while(response.find("\r\n\r\n") == std::string::npos && ::read(fd, &c, 1) == 1)
+			response += c;
+		return response.starts_with("HTTP/1.1 101");
+	}
+
+	bool write(const std::string& frames)
+	{
+		return ::write(fd, frames.data(), frames.size()) == static_cast<ssize_t>(frames.size());
+	}
+
+	// 服务端发来的帧都不分片, 负载不超过 64K
+	bool readAll(Received& got)
+	{
+		std::string in;
+		char buffer[4096];
+		ssize_t n;
+		while((n = ::read(fd, buffer, sizeof(buffer))) > 0)
+			in.append(buffer, n);
+		if(n < 0)
+			return false;
+		size_t pos = 0;
+		while(in.size() - pos >= 2)
+		{
+			uint8_t opcode = in[pos] & 0x0F;
+			size_t len = in[pos + 1] & 0x7F;
+			size_t header = 2;
+			if(len == 126)
+			{
+				len = (static_cast<uint8_t>(in[pos + 2]) << 8) | static_cast<uint8_t>(in[pos + 3]);
+				header = 4;
+			}
+			if(in.size() - pos < header + len)
+				return false;
+			std::string payload = in.substr(pos + header, len);
+			if(opcode == WSOpcode::CLOSE)
+				got.closes.push_back(len >= 2 ? (static_cast<uint8_t>(payload[0]) << 8) | static_cast<uint8_t>(payload[1]) : WS_CLOSE_NO_STATUS);
+			else
+				got.msgs.emplace_back(payload, opcode);
+			pos += header + len;
+		}
+		return pos == in.size();
+	}
+};
+
+static void appendFrame(std::string& frames, uint8_t opcode, std::string_view payload, bool fin = true)
+{
+	uint8_t maskKey[4];
+	wsMaskKey(maskKey);
+	WSFrameBuffer frame;
+	frame.encodeMasked(opcode, fin, payload.data(), payload.size(), maskKey);
+	frames.append(frame.frameData(), frame.frameSize());
+}
+
+static std::string closeFrame()
+{
+	uint16_t normal = htons(WS_CLOSE_NORMAL);
+	std::string frame;
+	appendFrame(frame, WSOpcode::CLOSE, std::string_view(reinterpret_cast<const char*>(&normal), sizeof(normal)));
+	return frame;
+}
+
+// 一次写出 frames, 收下服务端回的所有帧
+static bool exchange(const char* path, const std::string& frames, Received& got)
+{
+	RawConn conn;
+	return conn.open(path) && conn.write(frames) && conn.readAll(got);
+}
+
+// 接收路径: UTF-8 跨分片流式校验, 非法时 1007; 分片之间的 PING 照常回应; 数据帧顺序不对时 1002, 不回显任何部分, 校验状态不带进下一条消息
+static bool testReceive()
+{
+	std::string frames;
+	appendFrame(frames, WSOpcode::TEXT, "\xe2\x82", false);
+	appendFrame(frames, WSOpcode::CONTINUE, "\xac!");
+	appendFrame(frames, WSOpcode::BINARY, "\xff", false);
+	appendFrame(frames, WSOpcode::CONTINUE, "\xfe");
+	Received split;
+	TEST_CHECK(exchange("/ws", frames + closeFrame(), split));
+	TEST_CHECK(split.msgs.size() == 2);
+	TEST_CHECK(split.msgs[0].first == "\xe2\x82\xac!" && split.msgs[0].second == WSOpcode::TEXT);
+	TEST_CHECK(split.msgs[1].first == "\xff\xfe" && split.msgs[1].second == WSOpcode::BINARY);
+	TEST_CHECK(split.closes.size() == 1 && split.closes[0] == WS_CLOSE_NORMAL);
+
+	// 控制帧可插在分片之间, 先回 PONG, 不打断消息拼接
+	frames.clear();
+	appendFrame(frames, WSOpcode::TEXT, "he", false);
+	appendFrame(frames, WSOpcode::PING, "p");
+	appendFrame(frames, WSOpcode::CONTINUE, "llo");
+	Received pinged;
+	TEST_CHECK(exchange("/ws", frames + closeFrame(), pinged));
+	TEST_CHECK(pinged.msgs.size() == 2);
+	TEST_CHECK(pinged.msgs[0].first == "p" && pinged.msgs[0].second == WSOpcode::PONG);
+	TEST_CHECK(pinged.msgs[1].first == "hello" && pinged.msgs[1].second == WSOpcode::TEXT);
+	TEST_CHECK(pinged.closes.size() == 1 && pinged.closes[0] == WS_CLOSE_NORMAL);
+
+	frames.clear();
+	appendFrame(frames, WSOpcode::TEXT, "ok");
+	appendFrame(frames, WSOpcode::TEXT, "\xe2\x82", false);
+	appendFrame(frames, WSOpcode::CONTINUE, "x");
+	Received invalid;
+	TEST_CHECK(exchange("/ws", frames, invalid));
+	TEST_CHECK(invalid.msgs.size() == 1 && invalid.msgs[0].first == "ok");
+	TEST_CHECK(invalid.closes.size() == 1 && invalid.closes[0] == WS_CLOSE_INVALID_PAYLOAD);
+
+	struct
+	{
+		const char* name;
+		std::vector<std::tuple<uint8_t, std::string, bool>> frames;
+		size_t echoed;
+	} cases[] =
+	{
+		{"continue without message", {{WSOpcode::CONTINUE, "x", true}}, 0},
+		{"continue after complete message", {{WSOpcode::TEXT, "a", true}, {WSOpcode::CONTINUE, "b", true}}, 1},
+		{"text inside text", {{WSOpcode::TEXT, "ab", false}, {WSOpcode::TEXT, "cd", true}}, 0},
+		{"binary inside text", {{WSOpcode::TEXT, "\xe2\x82", false}, {WSOpcode::BINARY, "zz", true}, {WSOpcode::TEXT, "ok", true}}, 0},
+	};
+	for(auto& test : cases)
+	{
+		frames.clear();
+		for(auto& [opcode, payload, fin] : test.frames)
+			appendFrame(frames, opcode, payload, fin);
+		Received got;
+		bool ok = exchange("/ws", frames, got);
+		if(!ok || got.msgs.size() != test.echoed || got.closes.size() != 1 || got.closes[0] != WS_CLOSE_PROTOCOL_ERROR)
+			std::cerr << "CASE " << test.name << ": " << got.msgs.size() << " ECHOED, CLOSE " << (got.closes.empty() ? 0 : got.closes[0]) << std::endl;
+		TEST_CHECK(ok && got.msgs.size() == test.echoed);
+		TEST_CHECK(got.closes.size() == 1 && got.closes[0] == WS_CLOSE_PROTOCOL_ERROR);
+	}
+
+	// 被拒绝的连接不影响下一条连接
+	Received after;
+	frames.clear();
+	appendFrame(frames, WSOpcode::TEXT, "ok");
+	TEST_CHECK(exchange("/ws", frames + closeFrame(), after));
+	TEST_CHECK(after.msgs.size() == 1 && after.msgs[0].first == "ok");
+	return true;
+}
+
+// 批量处理器: 同一轮到达的消息攒成一批, 回应按到达顺序; 批内有关闭帧时整批丢弃, 只回关闭
+static bool testBatch()
+{
+	std::string frames;
+	for(int i = 0; i < 50; ++i)
+		appendFrame(frames, i % 2 ? WSOpcode::BINARY : WSOpcode::TEXT, "m" + std::to_string(i));
+
+	// 先发消息, 收齐回应后再单独关闭
+	RawConn ordered;
+	TEST_CHECK(ordered.open("/ws/batch"));
+	TEST_CHECK(ordered.write(frames));
+	::usleep(200 * 1000);
+	TEST_CHECK(ordered.write(closeFrame()));
+	Received got;
+	TEST_CHECK(ordered.readAll(got));
+	TEST_CHECK(got.msgs.size() == 50);
+	size_t largest = 0;
+	for(int i = 0; i < 50; ++i)
+	{
+		const std::string& msg = got.msgs[i].first;
+		size_t colon = msg.find(':');
+		TEST_CHECK(colon != std::string::npos && msg.substr(colon + 1) == "m" + std::to_string(i));
+		TEST_CHECK(got.msgs[i].second == (i % 2 ? WSOpcode::BINARY : WSOpcode::TEXT));
+		largest = std::max<size_t>(largest, std::stoul(msg.substr(0, colon)));
+	}
+	std::cout << "LARGEST BATCH " << largest << std::endl;
+	TEST_CHECK(largest > 1);
+	TEST_CHECK(got.closes.size() == 1 && got.closes[0] == WS_CLOSE_NORMAL);
+
+	// 消息和关闭帧一次写出, 连接在轮末之前关掉, 消息不交给处理器
+	RawConn dropped;
+	TEST_CHECK(dropped.open("/ws/batch"));
+	TEST_CHECK(dropped.write(frames + closeFrame()));
+	Received none;
+	TEST_CHECK(dropped.readAll(none));
+	TEST_CHECK(none.msgs.empty());
+	TEST_CHECK(none.closes.size() == 1 && none.closes[0] == WS_CLOSE_NORMAL);
+
+	// 服务端还在
+	RawConn after;
+	TEST_CHECK(after.open("/ws/batch"));
+	std::string one;
+	appendFrame(one, WSOpcode::TEXT, "after");
+	TEST_CHECK(after.write(one + closeFrame()));
+	Received last;
+	TEST_CHECK(after.readAll(last));
+	TEST_CHECK(last.closes.size() == 1);
+	return true;
+}
+
+// 服务器不在时按指数退避重连, 起来后连上; 被杀掉后以 1006 通知, 连上过一次退避从头算, 很快重连上
+static bool testReconnect()
+{
+	stopServer();
+	WSClientReactor reactor;
+	WSClientConfig config = testConfig("/ws");
+	config.reconnectMinMs = 100;
+	config.reconnectMaxMs = 800;
+	WSClient* ws = reactor.connect(config);
+	Received got;
+	got.attach(ws);
+
+	// 退避依次为 50-100, 100-200, 200-400, 400-800...: 2秒里 4 到 7 次, 不退避的话是 20 次
+	pollUntil(reactor, 2000, []() { return false; });
+	uint32_t attempts = ws->getReconnects();
+	std::cout << "RECONNECTS WHILE DOWN " << attempts << std::endl;
+	TEST_CHECK(attempts >= 3 && attempts <= 8);
+	TEST_CHECK(got.opens == 0 && got.closes.empty());
+
+	startServer();
+	TEST_CHECK(pollUntil(reactor, TEST_WAIT_MS, [&]() { return ws->isOpen(); }));
+
+	stopServer();
+	TEST_CHECK(pollUntil(reactor, TEST_WAIT_MS, [&]() { return !got.closes.empty(); }));
+	TEST_CHECK(got.closes[0] == WS_CLOSE_ABNORMAL);
+	uint64_t down = wsNowMs();
+	uint32_t before = ws->getReconnects();
+	startServer();
+	TEST_CHECK(pollUntil(reactor, TEST_WAIT_MS, [&]() { return ws->isOpen(); }));
+	std::cout << "REOPENED AFTER " << wsNowMs() - down << "ms, " << ws->getReconnects() - before << " RECONNECTS" << std::endl;
+	TEST_CHECK(ws->getReconnects() - before <= 3);
+	TEST_CHECK(got.opens == 2);
+
+	TEST_CHECK(ws->text("again"));
+	TEST_CHECK(pollUntil(reactor, TEST_WAIT_MS, [&]() { return !got.msgs.empty(); }));
+	TEST_CHECK(got.msgs[0].first == "again");
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	if(argc < 2)
+	{
+		std::cerr << "usage: " << argv[0] << " <TCPServer> [port]" << std::endl;
+		return 1;
+	}
+	serverPath = argv[1];
+	if(argc > 2)
+		port = std::atoi(argv[2]);
+	std::signal(SIGPIPE, SIG_IGN);
+
+	startServer();
+	struct
+	{
+		const char* name;
+		bool (*run)();
+	} tests[] =
+	{
+		{"echo", testEcho},
+		{"policy close", testPolicyClose},
+		{"remove", testRemove},
+		{"delay", testDelay},
+		{"batch", testBatch},
+		{"receive", testReceive},
+		{"reconnect", testReconnect},
+	};
+	int failed = 0;
+	for(auto& test : tests)
+	{
+		bool ok = test.run();
+		std::cout << "TEST " << test.name << (ok ? " OK" : " FAIL") << std::endl;
+		failed += !ok;
+	}
+	stopServer();
+	return failed ? 1 : 0;
+}
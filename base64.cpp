@@ -27,6 +27,7 @@
 
 #include "base64.h"
 #include <iostream>
+#include <cstring>
 
 static const std::string base64_chars = 
              "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
@@ -121,3 +122,244 @@ std::string base64_decode(std::string const& encoded_string) {
 
   return ret;
 }
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BASE64_HAVE_X86 1
+#endif
+
+// 调用方缓冲区版本: 标量 12 位查表兜底, SSSE3/AVX2 按 CPU 选择
+// 编码用 Muła/Lemire 的 mulhi/mullo 拆分6位组 + pshufb 转 ASCII, 解码用高低半字节查表校验
+namespace {
+
+// 12位一查: 每3字节拆成两个12位索引, 各查出2个字符, 循环内无分支
+struct Base64Table12 {
+  char pairs[4096][2];
+  constexpr Base64Table12() : pairs() {
+    const char* chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    for (int i = 0; i < 4096; i++) {
+      pairs[i][0] = chars[i >> 6];
+      pairs[i][1] = chars[i & 0x3f];
+    }
+  }
+};
+
+constexpr Base64Table12 base64_table12;
+
+// 字符 -> 6位值, 非法为 0xff
+struct Base64DecodeTable {
+  unsigned char values[256];
+  constexpr Base64DecodeTable() : values() {
+    const char* chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    for (int i = 0; i < 256; i++)
+      values[i] = 0xff;
+    for (int i = 0; i < 64; i++)
+      values[static_cast<unsigned char>(chars[i])] = i;
+  }
+};
+
+constexpr Base64DecodeTable base64_decode_table;
+
+size_t encode_scalar(unsigned char const* in, size_t len, char* out) {
+  char* p = out;
+  size_t i = 0;
+
+  for (; i + 3 <= len; i += 3) {
+    unsigned int v = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+    std::memcpy(p, base64_table12.pairs[v >> 12], 2);
+    std::memcpy(p + 2, base64_table12.pairs[v & 0xfff], 2);
+    p += 4;
+  }
+
+  size_t rest = len - i;
+  if (rest) {
+    unsigned int v = (in[i] << 16) | (rest == 2 ? in[i + 1] << 8 : 0);
+    std::memcpy(p, base64_table12.pairs[v >> 12], 2);
+    p[2] = rest == 2 ? base64_table12.pairs[v & 0xfff][0] : '=';
+    p[3] = '=';
+    p += 4;
+  }
+
+  return p - out;
+}
+
+// 完整4字符组解码, 返回 false 表示有非法字符; in 与 out 可相同
+bool decode_scalar(const char* in, size_t groups, unsigned char* out) {
+  unsigned int bad = 0;
+  for (size_t i = 0; i < groups; i++) {
+    unsigned int a = base64_decode_table.values[static_cast<unsigned char>(in[i * 4])];
+    unsigned int b = base64_decode_table.values[static_cast<unsigned char>(in[i * 4 + 1])];
+    unsigned int c = base64_decode_table.values[static_cast<unsigned char>(in[i * 4 + 2])];
+    unsigned int d = base64_decode_table.values[static_cast<unsigned char>(in[i * 4 + 3])];
+    bad |= a | b | c | d;
+    unsigned int v = (a << 18) | (b << 12) | (c << 6) | d;
+    out[i * 3] = static_cast<unsigned char>(v >> 16);
+    out[i * 3 + 1] = static_cast<unsigned char>(v >> 8);
+    out[i * 3 + 2] = static_cast<unsigned char>(v);
+  }
+  return !(bad & 0x80);
+}
+
+#ifdef BASE64_HAVE_X86
+
+const bool has_avx2 = __builtin_cpu_supports("avx2");
+const bool has_ssse3 = __builtin_cpu_supports("ssse3");
+
+__attribute__((target("ssse3"))) inline __m128i enc_translate_sse(__m128i in) {
+  const __m128i lut = _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+  __m128i indices = _mm_subs_epu8(in, _mm_set1_epi8(51));
+  indices = _mm_sub_epi8(indices, _mm_cmpgt_epi8(in, _mm_set1_epi8(25)));
+  return _mm_add_epi8(in, _mm_shuffle_epi8(lut, indices));
+}
+
+// 每次读16字节用12字节, 写16字符
+__attribute__((target("ssse3"))) size_t encode_sse(unsigned char const* in, size_t len, char* out) {
+  size_t i = 0, o = 0;
+  for (; i + 16 <= len; i += 12, o += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+    v = _mm_shuffle_epi8(v, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    __m128i t0 = _mm_mulhi_epu16(_mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+    __m128i t1 = _mm_mullo_epi16(_mm_and_si128(v, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + o), enc_translate_sse(_mm_or_si128(t0, t1)));
+  }
+  return o + encode_scalar(in + i, len - i, out + o);
+}
+
+__attribute__((target("avx2"))) inline __m256i enc_translate_avx2(__m256i in) {
+  const __m256i lut = _mm256_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+                                       65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+  __m256i indices = _mm256_subs_epu8(in, _mm256_set1_epi8(51));
+  indices = _mm256_sub_epi8(indices, _mm256_cmpgt_epi8(in, _mm256_set1_epi8(25)));
+  return _mm256_add_epi8(in, _mm256_shuffle_epi8(lut, indices));
+}
+
+// 每次读32字节用24字节, 写32字符
+__attribute__((target("avx2"))) size_t encode_avx2(unsigned char const* in, size_t len, char* out) {
+  size_t i = 0, o = 0;
+  for (; i + 32 <= len; i += 24, o += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+    v = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 0, 1, 2, 3, 4, 5, 6));
+    v = _mm256_shuffle_epi8(v, _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+                                               14, 15, 13, 14, 11, 12, 10, 11, 8, 9, 7, 8, 5, 6, 4, 5));
+    __m256i t0 = _mm256_mulhi_epu16(_mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040));
+    __m256i t1 = _mm256_mullo_epi16(_mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + o), enc_translate_avx2(_mm256_or_si256(t0, t1)));
+  }
+  return o + encode_sse(in + i, len - i, out + o);
+}
+
+// 解码: 返回已处理的输入字节数(4的倍数), 遇到非法字符提前停下交给标量
+__attribute__((target("ssse3"))) size_t decode_sse(const char* in, size_t len, unsigned char* out) {
+  const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+  const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i mask_2f = _mm_set1_epi8(0x2f);
+
+  size_t i = 0, o = 0;
+  // 写16字节只有12字节有效, 留足余量保证不越过输出末尾, 原地解码时也不会覆盖未读的输入
+  for (; i + 24 <= len; i += 16, o += 12) {
+    __m128i str = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+    __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+    __m128i lo_nibbles = _mm_and_si128(str, mask_2f);
+    __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+    __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0xffff)
+      break;
+    __m128i eq_2f = _mm_cmpeq_epi8(str, mask_2f);
+    __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+    str = _mm_add_epi8(str, roll);
+    str = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+    str = _mm_madd_epi16(str, _mm_set1_epi32(0x00011000));
+    str = _mm_shuffle_epi8(str, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + o), str);
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) size_t decode_avx2(const char* in, size_t len, unsigned char* out) {
+  const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+                                          0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+  const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                          0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                            0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+
+  size_t i = 0, o = 0;
+  for (; i + 48 <= len; i += 32, o += 24) {
+    __m256i str = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+    __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+    __m256i lo_nibbles = _mm256_and_si256(str, mask_2f);
+    __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+    __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+    if (!_mm256_testz_si256(lo, hi))
+      break;
+    __m256i eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+    __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+    str = _mm256_add_epi8(str, roll);
+    str = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+    str = _mm256_madd_epi16(str, _mm256_set1_epi32(0x00011000));
+    str = _mm256_shuffle_epi8(str, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                                    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    str = _mm256_permutevar8x32_epi32(str, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + o), str);
+  }
+  return i + decode_sse(in + i, len - i, out + o);
+}
+
+#endif
+
+}
+
+size_t base64_encode(unsigned char const* in, size_t len, char* out) {
+#ifdef BASE64_HAVE_X86
+  if (has_avx2)
+    return encode_avx2(in, len, out);
+  if (has_ssse3)
+    return encode_sse(in, len, out);
+#endif
+  return encode_scalar(in, len, out);
+}
+
+bool base64_decode(const char* in, size_t len, unsigned char* out, size_t* out_len) {
+  // 末尾 '=' 不参与向量部分; 允许省略填充
+  size_t pad = 0;
+  while (len && in[len - 1] == '=' && pad < 2) {
+    --len;
+    ++pad;
+  }
+  if ((len + pad) % 4 && pad)
+    return false;
+
+  size_t done = 0;
+#ifdef BASE64_HAVE_X86
+  if (has_avx2)
+    done = decode_avx2(in, len, out);
+  else if (has_ssse3)
+    done = decode_sse(in, len, out);
+#endif
+
+  size_t groups = (len - done) / 4;
+  if (!decode_scalar(in + done, groups, out + done / 4 * 3))
+    return false;
+
+  size_t o = done / 4 * 3 + groups * 3;
+  size_t i = done + groups * 4;
+  size_t rest = len - i;
+  if (rest == 1)
+    return false;
+  if (rest) {
+    unsigned int a = base64_decode_table.values[static_cast<unsigned char>(in[i])];
+    unsigned int b = base64_decode_table.values[static_cast<unsigned char>(in[i + 1])];
+    unsigned int c = rest == 3 ? base64_decode_table.values[static_cast<unsigned char>(in[i + 2])] : 0;
+    if ((a | b | c) & 0x80)
+      return false;
+    unsigned int v = (a << 18) | (b << 12) | (c << 6);
+    out[o++] = static_cast<unsigned char>(v >> 16);
+    if (rest == 3)
+      out[o++] = static_cast<unsigned char>(v >> 8);
+  }
+
+  *out_len = o;
+  return true;
+}
@@ -4,3 +4,13 @@
 
 std::string base64_encode(unsigned char const* , unsigned int len);
 std::string base64_decode(std::string const& s);
+
+constexpr size_t base64_encoded_size(size_t len) { return (len + 2) / 3 * 4; }
+
+constexpr size_t base64_decoded_max(size_t len) { return (len + 3) / 4 * 3; }
+
+// 写入调用方缓冲区, out 至少 base64_encoded_size(len) 字节, 返回写入长度
+size_t base64_encode(unsigned char const* in, size_t len, char* out);
+
+// out 至少 base64_decoded_max(len) 字节, 可与 in 相同(原地解码); 非法输入返回 false
+bool base64_decode(const char* in, size_t len, unsigned char* out, size_t* out_len);
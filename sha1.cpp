@@ -588,3 +588,300 @@ unsigned SHA1::CircularShift(int bits, unsigned word)
 {
     return ((word << bits) & 0xFFFFFFFF) | ((word & 0xFFFFFFFF) >> (32-bits));
 }
+
+/*
+ *  sha1_digest
+ *
+ *  Description:
+ *      One-shot variant used on the handshake path.  The message is
+ *      hashed in place, the padding block(s) live on the stack, and the
+ *      compression function is chosen once per process: SHA-NI on x86,
+ *      the ARMv8 crypto extension on AArch64, portable code otherwise.
+ *
+ *  Parameters:
+ *      message_array: [in]
+ *          The message to hash.
+ *      length: [in]
+ *          The length of message_array in bytes.
+ *      digest: [out]
+ *          20 bytes receiving the big-endian digest.
+ *
+ *  Returns:
+ *      Nothing.
+ *
+ */
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include <cpuid.h>
+#define SHA1_HAVE_SHANI 1
+#elif defined(__aarch64__) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2))
+#include <arm_neon.h>
+#define SHA1_HAVE_ARMV8 1
+#endif
+
+namespace
+{
+
+inline uint32_t rol32(uint32_t word, int bits)
+{
+    return (word << bits) | (word >> (32 - bits));
+}
+
+inline uint32_t load_be32(const unsigned char *p)
+{
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+           (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+void compress_portable(uint32_t state[5], const unsigned char *data, size_t blocks)
+{
+    while(blocks--)
+    {
+        uint32_t W[16];
+        for(int t = 0; t < 16; t++)
+        {
+            W[t] = load_be32(data + t * 4);
+        }
+
+        uint32_t A = state[0], B = state[1], C = state[2], D = state[3], E = state[4];
+
+#define SHA1_W(t) (W[(t) & 15] = rol32(W[((t) + 13) & 15] ^ W[((t) + 8) & 15] ^ W[((t) + 2) & 15] ^ W[(t) & 15], 1))
+#define SHA1_ROUND(a, b, c, d, e, f, k, w) \
+        e += rol32(a, 5) + (f) + (k) + (w); \
+        b = rol32(b, 30);
+
+        for(int t = 0; t < 20; t += 5)
+        {
+            SHA1_ROUND(A, B, C, D, E, D ^ (B & (C ^ D)), 0x5A827999, t + 0 < 16 ? W[t + 0] : SHA1_W(t + 0));
+            SHA1_ROUND(E, A, B, C, D, C ^ (A & (B ^ C)), 0x5A827999, t + 1 < 16 ? W[t + 1] : SHA1_W(t + 1));
+            SHA1_ROUND(D, E, A, B, C, B ^ (E & (A ^ B)), 0x5A827999, t + 2 < 16 ? W[t + 2] : SHA1_W(t + 2));
+            SHA1_ROUND(C, D, E, A, B, A ^ (D & (E ^ A)), 0x5A827999, t + 3 < 16 ? W[t + 3] : SHA1_W(t + 3));
+            SHA1_ROUND(B, C, D, E, A, E ^ (C & (D ^ E)), 0x5A827999, t + 4 < 16 ? W[t + 4] : SHA1_W(t + 4));
+        }
+        for(int t = 20; t < 40; t += 5)
+        {
+            SHA1_ROUND(A, B, C, D, E, B ^ C ^ D, 0x6ED9EBA1, SHA1_W(t + 0));
+            SHA1_ROUND(E, A, B, C, D, A ^ B ^ C, 0x6ED9EBA1, SHA1_W(t + 1));
+            SHA1_ROUND(D, E, A, B, C, E ^ A ^ B, 0x6ED9EBA1, SHA1_W(t + 2));
+            SHA1_ROUND(C, D, E, A, B, D ^ E ^ A, 0x6ED9EBA1, SHA1_W(t + 3));
+            SHA1_ROUND(B, C, D, E, A, C ^ D ^ E, 0x6ED9EBA1, SHA1_W(t + 4));
+        }
+        for(int t = 40; t < 60; t += 5)
+        {
+            SHA1_ROUND(A, B, C, D, E, (B & C) | (D & (B | C)), 0x8F1BBCDC, SHA1_W(t + 0));
+            SHA1_ROUND(E, A, B, C, D, (A & B) | (C & (A | B)), 0x8F1BBCDC, SHA1_W(t + 1));
+            SHA1_ROUND(D, E, A, B, C, (E & A) | (B & (E | A)), 0x8F1BBCDC, SHA1_W(t + 2));
+            SHA1_ROUND(C, D, E, A, B, (D & E) | (A & (D | E)), 0x8F1BBCDC, SHA1_W(t + 3));
+            SHA1_ROUND(B, C, D, E, A, (C & D) | (E & (C | D)), 0x8F1BBCDC, SHA1_W(t + 4));
+        }
+        for(int t = 60; t < 80; t += 5)
+        {
+            SHA1_ROUND(A, B, C, D, E, B ^ C ^ D, 0xCA62C1D6, SHA1_W(t + 0));
+            SHA1_ROUND(E, A, B, C, D, A ^ B ^ C, 0xCA62C1D6, SHA1_W(t + 1));
+            SHA1_ROUND(D, E, A, B, C, E ^ A ^ B, 0xCA62C1D6, SHA1_W(t + 2));
+            SHA1_ROUND(C, D, E, A, B, D ^ E ^ A, 0xCA62C1D6, SHA1_W(t + 3));
+            SHA1_ROUND(B, C, D, E, A, C ^ D ^ E, 0xCA62C1D6, SHA1_W(t + 4));
+        }
+
+#undef SHA1_ROUND
+#undef SHA1_W
+
+        state[0] += A;
+        state[1] += B;
+        state[2] += C;
+        state[3] += D;
+        state[4] += E;
+
+        data += 64;
+    }
+}
+
+#ifdef SHA1_HAVE_SHANI
+
+bool cpu_has_shani()
+{
+    unsigned eax, ebx, ecx, edx;
+    if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1) || !(ecx & bit_SSSE3))
+    {
+        return false;
+    }
+    if(!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    {
+        return false;
+    }
+    return ebx & bit_SHA;
+}
+
+const bool has_shani = cpu_has_shani();
+
+/*
+ *  Four rounds per sha1rnds4; F selects the round function and must be an
+ *  immediate.  M[j] = msg2(msg1(M[j-4], M[j-3]) ^ M[j-2], M[j-1]).
+ */
+template <int F>
+__attribute__((target("sha,sse4.1"))) inline void shani_group(__m128i &ABCD, __m128i &E_cur, __m128i &E_next, __m128i *M, int j)
+{
+    if(j >= 4)
+    {
+        M[j & 3] = _mm_sha1msg2_epu32(_mm_xor_si128(_mm_sha1msg1_epu32(M[j & 3], M[(j + 1) & 3]), M[(j + 2) & 3]), M[(j + 3) & 3]);
+    }
+    if(j > 0)
+    {
+        E_cur = _mm_sha1nexte_epu32(E_cur, M[j & 3]);
+    }
+    else
+    {
+        E_cur = _mm_add_epi32(E_cur, M[0]);
+    }
+    E_next = ABCD;
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E_cur, F);
+}
+
+__attribute__((target("sha,sse4.1"))) void compress_shani(uint32_t state[5], const unsigned char *data, size_t blocks)
+{
+    const __m128i MASK = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+    __m128i ABCD = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state)), 0x1B);
+    __m128i E0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+    while(blocks--)
+    {
+        __m128i ABCD_SAVE = ABCD;
+        __m128i E0_SAVE = E0;
+        __m128i M[4];
+        for(int i = 0; i < 4; i++)
+        {
+            M[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i * 16)), MASK);
+        }
+
+        __m128i E1 = _mm_setzero_si128();
+        int j = 0;
+        for(; j < 5; j++)
+        {
+            (j & 1) ? shani_group<0>(ABCD, E1, E0, M, j) : shani_group<0>(ABCD, E0, E1, M, j);
+        }
+        for(; j < 10; j++)
+        {
+            (j & 1) ? shani_group<1>(ABCD, E1, E0, M, j) : shani_group<1>(ABCD, E0, E1, M, j);
+        }
+        for(; j < 15; j++)
+        {
+            (j & 1) ? shani_group<2>(ABCD, E1, E0, M, j) : shani_group<2>(ABCD, E0, E1, M, j);
+        }
+        for(; j < 20; j++)
+        {
+            (j & 1) ? shani_group<3>(ABCD, E1, E0, M, j) : shani_group<3>(ABCD, E0, E1, M, j);
+        }
+
+        // 20 groups: the last one consumed E1 and left the rotation source in E0
+        E0 = _mm_sha1nexte_epu32(E0, E0_SAVE);
+        ABCD = _mm_add_epi32(ABCD, ABCD_SAVE);
+
+        data += 64;
+    }
+
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state), _mm_shuffle_epi32(ABCD, 0x1B));
+    state[4] = _mm_extract_epi32(E0, 3);
+}
+
+#endif // SHA1_HAVE_SHANI
+
+#ifdef SHA1_HAVE_ARMV8
+
+void compress_armv8(uint32_t state[5], const unsigned char *data, size_t blocks)
+{
+    uint32x4_t ABCD = vld1q_u32(state);
+    uint32_t E0 = state[4];
+
+    while(blocks--)
+    {
+        uint32x4_t ABCD_SAVE = ABCD;
+        uint32_t E0_SAVE = E0;
+        uint32x4_t M[4];
+        for(int i = 0; i < 4; i++)
+        {
+            M[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + i * 16)));
+        }
+
+        static const uint32_t K[4] = {0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6};
+        for(int j = 0; j < 20; j++)
+        {
+            if(j >= 4)
+            {
+                M[j & 3] = vsha1su1q_u32(vsha1su0q_u32(M[j & 3], M[(j + 1) & 3], M[(j + 2) & 3]), M[(j + 3) & 3]);
+            }
+            uint32x4_t WK = vaddq_u32(M[j & 3], vdupq_n_u32(K[j / 5]));
+            uint32_t E1 = vsha1h_u32(vgetq_lane_u32(ABCD, 0));
+            switch(j / 5)
+            {
+                case 0: ABCD = vsha1cq_u32(ABCD, E0, WK); break;
+                case 2: ABCD = vsha1mq_u32(ABCD, E0, WK); break;
+                default: ABCD = vsha1pq_u32(ABCD, E0, WK); break;
+            }
+            E0 = E1;
+        }
+
+        E0 += E0_SAVE;
+        ABCD = vaddq_u32(ABCD, ABCD_SAVE);
+
+        data += 64;
+    }
+
+    vst1q_u32(state, ABCD);
+    state[4] = E0;
+}
+
+#endif // SHA1_HAVE_ARMV8
+
+void sha1_compress(uint32_t state[5], const unsigned char *data, size_t blocks)
+{
+#if defined(SHA1_HAVE_SHANI)
+    if(has_shani)
+    {
+        compress_shani(state, data, blocks);
+        return;
+    }
+#elif defined(SHA1_HAVE_ARMV8)
+    compress_armv8(state, data, blocks);
+    return;
+#endif
+    compress_portable(state, data, blocks);
+}
+
+} // namespace
+
+void sha1_digest(const void *message_array, size_t length, unsigned char *digest)
+{
+    uint32_t state[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    const unsigned char *message = static_cast<const unsigned char *>(message_array);
+
+    size_t blocks = length / 64;
+    if(blocks)
+    {
+        sha1_compress(state, message, blocks);
+    }
+
+    unsigned char tail[128] = {0};
+    size_t rest = length - blocks * 64;
+    std::memcpy(tail, message + blocks * 64, rest);
+    tail[rest] = 0x80;
+    size_t tail_blocks = rest > 55 ? 2 : 1;
+    uint64_t bits = uint64_t(length) * 8;
+    for(int i = 0; i < 8; i++)
+    {
+        tail[tail_blocks * 64 - 1 - i] = static_cast<unsigned char>(bits >> (i * 8));
+    }
+    sha1_compress(state, tail, tail_blocks);
+
+    for(int i = 0; i < 5; i++)
+    {
+        digest[i * 4 + 0] = static_cast<unsigned char>(state[i] >> 24);
+        digest[i * 4 + 1] = static_cast<unsigned char>(state[i] >> 16);
+        digest[i * 4 + 2] = static_cast<unsigned char>(state[i] >> 8);
+        digest[i * 4 + 3] = static_cast<unsigned char>(state[i]);
+    }
+}
@@ -24,6 +24,8 @@
 #ifndef _SHA1_H_
 #define _SHA1_H_
 
+#include <cstddef>
+
 
 class SHA1
 {
@@ -86,5 +88,14 @@ class SHA1
     
 };
 
-	
+
+/*
+ *  One-shot SHA-1 of a complete message.  The 20-byte digest is written
+ *  in network byte order.  Uses SHA-NI or the ARMv8 SHA1 instructions
+ *  when the CPU has them and an unrolled portable compressor otherwise.
+ */
+void sha1_digest(const void *message_array,
+                 size_t      length,
+                 unsigned char *digest);
+
 #endif // _SHA1_H_
@@ -0,0 +1,273 @@
+#include "utf8.h"
+#include <cstring>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define UTF8_HAVE_AVX2 1
+#endif
+
+// simdjson/simdutf lookup 算法:
+// 用 (前一字节高4位, 前一字节低4位, 当前字节高4位) 三张16项表查出错误类别, 按位与后非零即非法;
+// 3/4字节序列的第3/4字节由饱和减法单独判断.
+namespace
+{
+	constexpr uint8_t TOO_SHORT = 1 << 0;
+	constexpr uint8_t TOO_LONG = 1 << 1;
+	constexpr uint8_t OVERLONG_3 = 1 << 2;
+	constexpr uint8_t TOO_LARGE = 1 << 3;
+	constexpr uint8_t SURROGATE = 1 << 4;
+	constexpr uint8_t OVERLONG_2 = 1 << 5;
+	constexpr uint8_t TOO_LARGE_1000 = 1 << 6;
+	constexpr uint8_t OVERLONG_4 = 1 << 6;
+	constexpr uint8_t TWO_CONTS = 1 << 7;
+	constexpr uint8_t CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
+
+	alignas(16) const uint8_t byte1High[16] = {
+		TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+		TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+		TOO_SHORT | OVERLONG_2,
+		TOO_SHORT,
+		TOO_SHORT | OVERLONG_3 | SURROGATE,
+		TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+	};
+
+	alignas(16) const uint8_t byte1Low[16] = {
+		CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+		CARRY | OVERLONG_2,
+		CARRY,
+		CARRY,
+		CARRY | TOO_LARGE,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000
+	};
+
+	alignas(16) const uint8_t byte2High[16] = {
+		TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+		TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+	};
+
+#ifdef UTF8_HAVE_AVX2
+	const bool hasAvx2 = __builtin_cpu_supports("avx2");
+
+	template <int N>
+	__attribute__((target("avx2"))) inline __m256i prevBytes(__m256i input, __m256i prev)
+	{
+		return _mm256_alignr_epi8(input, _mm256_permute2x128_si256(prev, input, 0x21), 16 - N);
+	}
+
+	// n 必须是32的倍数, 返回 false 表示有非法序列
+	__attribute__((target("avx2"))) bool avx2Run(const uint8_t* in, size_t n, uint8_t* prevBlock, uint8_t& prevIncomplete)
+	{
+		const __m256i t1h = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(byte1High)));
+		const __m256i t1l = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(byte1Low)));
+		const __m256i t2h = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(byte2High)));
+		const __m256i lowNibble = _mm256_set1_epi8(0x0F);
+		const __m256i maxValue = _mm256_setr_epi8(
+				-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+				-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+				static_cast<char>(0xF0 - 1), static_cast<char>(0xE0 - 1), static_cast<char>(0xC0 - 1));
+
+		__m256i prev = _mm256_load_si256(reinterpret_cast<const __m256i*>(prevBlock));
+		__m256i incomplete = prevIncomplete ? _mm256_set1_epi8(1) : _mm256_setzero_si256();
+		__m256i error = _mm256_setzero_si256();
+
+		for(size_t i = 0; i < n; i += 32)
+		{
+			__m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+			if(_mm256_movemask_epi8(input) == 0)
+			{
+				error = _mm256_or_si256(error, incomplete);
+			}
+			else
+			{
+				__m256i prev1 = prevBytes<1>(input, prev);
+				__m256i sc = _mm256_and_si256(
+						_mm256_and_si256(
+							_mm256_shuffle_epi8(t1h, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), lowNibble)),
+							_mm256_shuffle_epi8(t1l, _mm256_and_si256(prev1, lowNibble))),
+						_mm256_shuffle_epi8(t2h, _mm256_and_si256(_mm256_srli_epi16(input, 4), lowNibble)));
+
+				__m256i prev2 = prevBytes<2>(input, prev);
+				__m256i prev3 = prevBytes<3>(input, prev);
+				__m256i must23 = _mm256_or_si256(
+						_mm256_subs_epu8(prev2, _mm256_set1_epi8(static_cast<char>(0xE0 - 0x80))),
+						_mm256_subs_epu8(prev3, _mm256_set1_epi8(static_cast<char>(0xF0 - 0x80))));
+				__m256i must23_80 = _mm256_and_si256(must23, _mm256_set1_epi8(static_cast<char>(0x80)));
+
+				error = _mm256_or_si256(error, _mm256_xor_si256(must23_80, sc));
+				incomplete = _mm256_subs_epu8(input, maxValue);
+			}
+			prev = input;
+		}
+
+		_mm256_store_si256(reinterpret_cast<__m256i*>(prevBlock), prev);
+		prevIncomplete = !_mm256_testz_si256(incomplete, incomplete);
+		return _mm256_testz_si256(error, error);
+	}
+#endif
+}
+
+UTF8Validator::UTF8Validator()
+{
+#ifdef UTF8_HAVE_AVX2
+	simd = hasAvx2;
+#endif
+	reset();
+}
+
+void UTF8Validator::reset()
+{
+	error = false;
+	std::memset(prevBlock, 0, sizeof(prevBlock));
+	prevIncomplete = 0;
+	tailLen = 0;
+	need = 0;
+	lower = 0x80;
+	upper = 0xBF;
+}
+
+void UTF8Validator::process(const uint8_t* block)
+{
+#ifdef UTF8_HAVE_AVX2
+	if(!avx2Run(block, 32, prevBlock, prevIncomplete))
+		error = true;
+#else
+	(void)block;
+#endif
+}
+
+bool UTF8Validator::feed(const char* data, size_t len)
+{
+	if(error)
+		return false;
+
+	const uint8_t* in = reinterpret_cast<const uint8_t*>(data);
+	if(!simd)
+		return feedScalar(in, len);
+
+#ifdef UTF8_HAVE_AVX2
+	if(tailLen)
+	{
+		size_t fill = std::min<size_t>(32 - tailLen, len);
+		std::memcpy(tail + tailLen, in, fill);
+		tailLen += fill;
+		in += fill;
+		len -= fill;
+		if(tailLen < 32)
+			return true;
+		process(tail);
+		tailLen = 0;
+	}
+
+	size_t bulk = len & ~size_t(31);
+	if(bulk && !avx2Run(in, bulk, prevBlock, prevIncomplete))
+		error = true;
+
+	tailLen = len - bulk;
+	std::memcpy(tail, in + bulk, tailLen);
+#endif
+	return !error;
+}
+
+bool UTF8Validator::feedScalar(const uint8_t* data, size_t len)
+{
+	size_t i = 0;
+	while(i < len)
+	{
+		if(need == 0)
+		{
+			// 8字节一组跳过ASCII
+			while(i + 8 <= len)
+			{
+				uint64_t word;
+				std::memcpy(&word, data + i, 8);
+				if(word & 0x8080808080808080ULL)
+					break;
+				i += 8;
+			}
+			if(i == len)
+				break;
+
+			uint8_t c = data[i++];
+			if(c < 0x80)
+				continue;
+			else if(c >= 0xC2 && c <= 0xDF)
+				need = 1;
+			else if(c == 0xE0)
+				need = 2, lower = 0xA0;
+			else if(c == 0xED)
+				need = 2, upper = 0x9F;
+			else if(c >= 0xE1 && c <= 0xEF)
+				need = 2;
+			else if(c == 0xF0)
+				need = 3, lower = 0x90;
+			else if(c >= 0xF1 && c <= 0xF3)
+				need = 3;
+			else if(c == 0xF4)
+				need = 3, upper = 0x8F;
+			else
+			{
+				error = true;
+				return false;
+			}
+		}
+		else
+		{
+			uint8_t c = data[i++];
+			if(c < lower || c > upper)
+			{
+				error = true;
+				return false;
+			}
+			lower = 0x80;
+			upper = 0xBF;
+			--need;
+		}
+	}
+	return true;
+}
+
+bool UTF8Validator::finish()
+{
+	if(!error)
+	{
+		if(simd)
+		{
+			if(tailLen)
+			{
+				// 补0(ASCII)凑满一块, 截断的序列会被判为 TOO_SHORT
+				std::memset(tail + tailLen, 0, 32 - tailLen);
+				process(tail);
+			}
+			if(prevIncomplete)
+				error = true;
+		}
+		else if(need)
+			error = true;
+	}
+
+	bool ok = !error;
+	reset();
+	return ok;
+}
+
+bool utf8_validate(const char* data, size_t len)
+{
+	UTF8Validator validator;
+	validator.feed(data, len);
+	return validator.finish();
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// 流式UTF-8校验 (simdjson lookup 算法), 可跨分片调用 feed
+struct UTF8Validator
+{
+	UTF8Validator();
+
+	void reset();
+
+	// 返回 false 表示已发现非法序列
+	bool feed(const char* data, size_t len);
+
+	// 消息结束, 检查末尾是否有未完成的多字节序列
+	bool finish();
+
+	bool valid() const { return !error; }
+
+	private:
+		void process(const uint8_t* block);
+		bool feedScalar(const uint8_t* data, size_t len);
+
+		bool simd = false;
+		bool error = false;
+
+		// SIMD: 上一个块 + 未满32字节的尾部
+		alignas(32) uint8_t prevBlock[32];
+		uint8_t prevIncomplete = 0;
+		alignas(32) uint8_t tail[32];
+		uint8_t tailLen = 0;
+
+		// 标量: 剩余续字节数 + 下一个续字节的取值范围
+		uint8_t need = 0;
+		uint8_t lower = 0x80;
+		uint8_t upper = 0xBF;
+};
+
+bool utf8_validate(const char* data, size_t len);